@@ -0,0 +1,289 @@
+/**
+ * @file metabench.c
+ * @brief 种子元信息处理路径的微基准
+ *
+ * 生成从 1k 到 2M 个分片、带长 announce-list 的合成种子，
+ * 对启动路径上的各个函数计时，输出 ns/op 以及峰值 RSS.
+ *
+ * 每种规模在独立的子进程中运行，使峰值 RSS 互不影响。
+ * 被测函数的日志输出被重定向到 /dev/null, 结果写到原来的标准输出。
+ *
+ * 用法：metabench [-t nr_trackers] [nr_pieces ...]
+ */
+
+#include "bparser.h"
+#include "bencoder.h"
+#include "butil.h"
+#include "metainfo.h"
+#include "util.h"
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+/**
+ * @brief 每个测试项至少运行的墙钟时间（纳秒）
+ */
+#define MIN_DURATION_NS 200000000L
+
+/**
+ * @brief 每个测试项至少运行的次数
+ */
+#define MIN_ITERATIONS 3
+
+/**
+ * @brief 合成种子的分片大小
+ */
+#define PIECE_SIZE (256 * 1024)
+
+static FILE *out;  ///< 结果输出，指向原来的标准输出
+
+/**
+ * @brief 单调时钟，单位纳秒
+ */
+static long
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * @brief 生成合成种子
+ * @param enc 输出
+ * @param nr_pieces 分片数量
+ * @param nr_trackers announce-list 的长度
+ */
+static void
+generate_torrent(struct BEncoder *enc, size_t nr_pieces, int nr_trackers)
+{
+    uint8_t *hashes = malloc(nr_pieces * HASH_SIZE);
+    uint64_t x = 0x9e3779b97f4a7c15ULL;  // xorshift64, 摘要内容无关紧要
+    for (size_t i = 0; i < nr_pieces * HASH_SIZE; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        hashes[i] = (uint8_t)x;
+    }
+
+    char url[128];
+    benc_dict_begin(enc);
+        benc_key(enc, "announce");
+        benc_cstr(enc, "http://tracker0.example.com:6969/announce");
+        benc_key(enc, "announce-list");
+        benc_list_begin(enc);
+        for (int i = 0; i < nr_trackers; i++) {
+            snprintf(url, sizeof(url), "http://tracker%d.example.com:6969/announce", i);
+            benc_list_begin(enc);
+            benc_cstr(enc, url);
+            benc_end(enc);
+        }
+        benc_end(enc);
+        benc_key(enc, "comment");
+        benc_cstr(enc, "synthetic torrent for metabench");
+        benc_key(enc, "info");
+        benc_dict_begin(enc);
+            benc_key(enc, "length");
+            benc_int(enc, (long)(nr_pieces * PIECE_SIZE - PIECE_SIZE / 2));
+            benc_key(enc, "name");
+            benc_cstr(enc, "synthetic.bin");
+            benc_key(enc, "piece length");
+            benc_int(enc, PIECE_SIZE);
+            benc_key(enc, "pieces");
+            benc_str(enc, hashes, nr_pieces * HASH_SIZE);
+        benc_end(enc);
+    benc_end(enc);
+
+    free(hashes);
+}
+
+/**
+ * @brief 被测操作
+ */
+enum Op
+{
+    OP_BPARSER,
+    OP_FREE_BNODE,
+    OP_BPARSER_ARENA,
+    OP_FREE_BNODE_ARENA,
+    OP_QUERY_BY_KEY,
+    OP_QUERY_BY_PATH,
+    OP_MAKE_INFO_HASH,
+    OP_EXTRACT_PIECES,
+    OP_EXTRACT_TRACKERS,
+    NR_OPS
+};
+
+static const char *op_names[] =
+{
+    "bparser",
+    "free_bnode",
+    "bparser_arena",
+    "free_bnode(arena)",
+    "query_bcode_by_key",
+    "query_bcode_by_path",
+    "make_info_hash",
+    "extract_pieces",
+    "extract_trackers",
+};
+
+/**
+ * @brief 运行一次被测操作，只计被测部分的时间
+ * @param op 操作
+ * @param data 种子数据
+ * @param size 种子大小
+ * @param tree 预先用 arena 模式解析好的语法树
+ * @return 本次耗时（纳秒）
+ */
+static long
+run_once(enum Op op, char *data, size_t size, const struct BNode *tree)
+{
+    struct BNode *ast;
+    struct MetaInfo *mi;
+    unsigned char md[HASH_SIZE];
+    long start, elapsed;
+    static volatile const void *sink;
+
+    switch (op) {
+    case OP_BPARSER:
+        start = now_ns();
+        ast = bparser(data);
+        elapsed = now_ns() - start;
+        free_bnode(&ast);
+        return elapsed;
+    case OP_FREE_BNODE:
+        ast = bparser(data);
+        start = now_ns();
+        free_bnode(&ast);
+        return now_ns() - start;
+    case OP_BPARSER_ARENA:
+        start = now_ns();
+        ast = bparser_arena(data, size);
+        elapsed = now_ns() - start;
+        free_bnode(&ast);
+        return elapsed;
+    case OP_FREE_BNODE_ARENA:
+        ast = bparser_arena(data, size);
+        start = now_ns();
+        free_bnode(&ast);
+        return now_ns() - start;
+    case OP_QUERY_BY_KEY:
+        start = now_ns();
+        sink = query_bcode_by_key(tree, "piece length");
+        return now_ns() - start;
+    case OP_QUERY_BY_PATH:
+        start = now_ns();
+        sink = query_bcode_by_path(tree, "info.piece length");
+        return now_ns() - start;
+    case OP_MAKE_INFO_HASH:
+        start = now_ns();
+        make_info_hash(tree, md);
+        elapsed = now_ns() - start;
+        sink = md;
+        return elapsed;
+    case OP_EXTRACT_PIECES:
+        mi = calloc(1, sizeof(*mi));
+        start = now_ns();
+        extract_pieces(mi, tree);
+        elapsed = now_ns() - start;
+        free_metainfo(&mi);
+        return elapsed;
+    case OP_EXTRACT_TRACKERS:
+        mi = calloc(1, sizeof(*mi));
+        start = now_ns();
+        extract_trackers(mi, tree);
+        elapsed = now_ns() - start;
+        free_metainfo(&mi);
+        return elapsed;
+    default:
+        panic("unexpected op %d", op);
+    }
+}
+
+/**
+ * @brief 在子进程中测试一种规模
+ * @param nr_pieces 分片数量
+ * @param nr_trackers announce-list 长度
+ */
+static void
+bench_size(size_t nr_pieces, int nr_trackers)
+{
+    struct BEncoder enc;
+    benc_init(&enc, nr_pieces * HASH_SIZE + (size_t)nr_trackers * 64 + 1024);
+    generate_torrent(&enc, nr_pieces, nr_trackers);
+
+    fprintf(out, "\n%lu pieces, %d trackers, torrent %.1f KiB\n",
+            nr_pieces, nr_trackers, enc.size / 1024.0);
+    fprintf(out, "  %-22s %14s %10s\n", "op", "ns/op", "iters");
+
+    struct BNode *tree = bparser_arena(enc.data, enc.size);
+
+    for (int op = 0; op < NR_OPS; op++) {
+        // 以包含准备工作在内的墙钟时间决定何时停止，只累计被测部分的耗时
+        long total = 0, iters = 0, deadline = now_ns() + MIN_DURATION_NS;
+        while (now_ns() < deadline || iters < MIN_ITERATIONS) {
+            total += run_once(op, enc.data, enc.size, tree);
+            iters++;
+        }
+        fprintf(out, "  %-22s %14.1f %10ld\n", op_names[op], (double)total / iters, iters);
+    }
+
+    free_bnode(&tree);
+    benc_free(&enc);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(out, "  peak RSS %ld KiB\n", ru.ru_maxrss);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int nr_trackers = 200;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+        case 't': nr_trackers = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-t nr_trackers] [nr_pieces ...]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    size_t default_sizes[] = { 1000, 10000, 100000, 1000000, 2000000 };
+    size_t nr_sizes = argc - optind;
+    size_t *sizes = default_sizes;
+    if (nr_sizes == 0) {
+        nr_sizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+    }
+    else {
+        sizes = calloc(nr_sizes, sizeof(*sizes));
+        for (size_t i = 0; i < nr_sizes; i++) {
+            sizes[i] = strtoul(argv[optind + i], NULL, 10);
+        }
+    }
+
+    // 结果写到原标准输出，被测函数的日志丢弃
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    setbuf(out, NULL);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    fprintf(out, "metabench (CFLAGS as built)\n");
+    for (size_t i = 0; i < nr_sizes; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            bench_size(sizes[i], nr_trackers);
+            exit(EXIT_SUCCESS);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(out, "benchmark for %lu pieces failed\n", sizes[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return 0;
+}
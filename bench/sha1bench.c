@@ -0,0 +1,157 @@
+/**
+ * @file sha1bench.c
+ * @brief SHA1 各后端与 OpenSSL 的吞吐量对比
+ *
+ * 对每个受支持的后端，分别以单流（逐个分片调用 sha1()）和多流
+ * （每次 sha1_multi() 计算 8 个分片）的方式计算同一批分片的摘要，
+ * 先与 OpenSSL SHA1() 的结果比对，再计时输出 MiB/s.
+ *
+ * 用法：sha1bench [piece_size [nr_pieces]]
+ */
+
+#include "sha1.h"
+#include "util.h"
+#include <string.h>
+#include <time.h>
+#include <openssl/sha.h>
+
+/**
+ * @brief 每个测试项至少运行的墙钟时间（纳秒）
+ */
+#define MIN_DURATION_NS 200000000L
+
+static long
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static uint8_t *data;      ///< 全部分片，连续存放
+static size_t piece_size;  ///< 分片大小
+static size_t nr_pieces;   ///< 分片数量
+static uint8_t *expect;    ///< OpenSSL 计算的摘要
+static uint8_t *md;        ///< 被测后端计算的摘要
+
+static void
+hash_openssl(void)
+{
+    for (size_t i = 0; i < nr_pieces; i++) {
+        SHA1(data + i * piece_size, piece_size, md + i * SHA1_DIGEST_SIZE);
+    }
+}
+
+static void
+hash_single(void)
+{
+    for (size_t i = 0; i < nr_pieces; i++) {
+        sha1(data + i * piece_size, piece_size, md + i * SHA1_DIGEST_SIZE);
+    }
+}
+
+static void
+hash_multi(void)
+{
+    for (size_t i = 0; i < nr_pieces; i += SHA1_MAX_LANES) {
+        const uint8_t *in[SHA1_MAX_LANES];
+        uint8_t *out[SHA1_MAX_LANES];
+        int n = 0;
+        for (; n < SHA1_MAX_LANES && i + n < nr_pieces; n++) {
+            in[n] = data + (i + n) * piece_size;
+            out[n] = md + (i + n) * SHA1_DIGEST_SIZE;
+        }
+        sha1_multi(in, piece_size, out, n);
+    }
+}
+
+/**
+ * @brief 校验并计时一种计算方式
+ * @param label 输出标签
+ * @param fn 计算全部分片摘要的函数
+ */
+static void
+run(const char *label, void (*fn)(void))
+{
+    memset(md, 0, nr_pieces * SHA1_DIGEST_SIZE);
+    fn();
+    if (memcmp(md, expect, nr_pieces * SHA1_DIGEST_SIZE) != 0) {
+        panic("%s: digest mismatch", label);
+    }
+
+    long start = now_ns(), elapsed;
+    int iterations = 0;
+    do {
+        fn();
+        iterations++;
+        elapsed = now_ns() - start;
+    } while (elapsed < MIN_DURATION_NS);
+
+    double bytes = (double)piece_size * nr_pieces * iterations;
+    printf("  %-24s %8.1f MiB/s\n", label, bytes / (elapsed / 1e9) / (1 << 20));
+}
+
+int
+main(int argc, char *argv[])
+{
+    piece_size = argc > 1 ? strtoul(argv[1], NULL, 0) : 256 * 1024;
+    nr_pieces = argc > 2 ? strtoul(argv[2], NULL, 0) : 64;
+    if (piece_size == 0 || nr_pieces == 0) {
+        fprintf(stderr, "Usage: %s [piece_size [nr_pieces]]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    data = malloc(piece_size * nr_pieces);
+    uint64_t x = 0x9e3779b97f4a7c15ULL;  // xorshift64
+    for (size_t i = 0; i < piece_size * nr_pieces; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        data[i] = (uint8_t)x;
+    }
+    expect = malloc(nr_pieces * SHA1_DIGEST_SIZE);
+    md = malloc(nr_pieces * SHA1_DIGEST_SIZE);
+    for (size_t i = 0; i < nr_pieces; i++) {
+        SHA1(data + i * piece_size, piece_size, expect + i * SHA1_DIGEST_SIZE);
+    }
+
+    // 边界长度：与 OpenSSL 比对增量接口的分块和填充
+    uint8_t a[SHA1_DIGEST_SIZE], b[SHA1_DIGEST_SIZE];
+    for (size_t len = 0; len < 300; len++) {
+        SHA1(data, len, a);
+        struct Sha1Ctx ctx;
+        sha1_init(&ctx);
+        for (size_t off = 0; off < len; off += 7) {
+            sha1_update(&ctx, data + off, len - off < 7 ? len - off : 7);
+        }
+        sha1_final(&ctx, b);
+        if (memcmp(a, b, SHA1_DIGEST_SIZE) != 0) {
+            panic("incremental digest mismatch at length %lu", len);
+        }
+    }
+
+    printf("sha1bench: %lu pieces of %lu bytes, default %s + %s\n",
+           nr_pieces, piece_size, sha1_backend(0), sha1_backend(1));
+
+    run("openssl SHA1()", hash_openssl);
+
+    const char *singles[] = { "generic", "openssl", "shani" };
+    const char *multis[] = { "none", "avx2x8" };
+    char label[64];
+    for (size_t i = 0; i < sizeof(singles) / sizeof(singles[0]); i++) {
+        if (sha1_use(singles[i]) == -1) {
+            printf("  %-24s unsupported\n", singles[i]);
+            continue;
+        }
+        sha1_use("none");
+        run(singles[i], hash_single);
+
+        for (size_t j = 1; j < sizeof(multis) / sizeof(multis[0]); j++) {
+            if (sha1_use(multis[j]) == -1) {
+                continue;
+            }
+            snprintf(label, sizeof(label), "%s + %s", multis[j], singles[i]);
+            run(label, hash_multi);
+        }
+    }
+
+    return 0;
+}
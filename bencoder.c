@@ -0,0 +1,305 @@
+/**
+ * @file bencoder.c
+ * @brief B 编码 encoder 的 API 实现
+ */
+
+#include "bencoder.h"
+#include "bparser.h"
+#include "util.h"
+#include <string.h>
+#include <assert.h>
+
+void
+benc_init(struct BEncoder *enc, size_t capacity)
+{
+    memset(enc, 0, sizeof(*enc));
+    enc->capacity = capacity ? capacity : 64;
+    enc->data = malloc(enc->capacity);
+}
+
+void
+benc_reserve(struct BEncoder *enc, size_t extra)
+{
+    if (enc->size + extra <= enc->capacity) {
+        return;
+    }
+
+    size_t capacity = enc->capacity;
+    while (capacity < enc->size + extra) {
+        capacity *= 2;
+    }
+    enc->data = realloc(enc->data, capacity);
+    enc->capacity = capacity;
+}
+
+void
+benc_reset(struct BEncoder *enc)
+{
+    enc->size = 0;
+    enc->depth = 0;
+}
+
+void
+benc_free(struct BEncoder *enc)
+{
+    free(enc->data);
+    enc->data = NULL;
+    enc->size = enc->capacity = 0;
+    enc->depth = 0;
+}
+
+/**
+ * @brief 写入一个字节，调用者保证空间足够
+ */
+static inline void
+put_char(struct BEncoder *enc, char ch)
+{
+    enc->data[enc->size++] = ch;
+}
+
+/**
+ * @brief 写入十进制整数，调用者保证空间足够
+ *
+ * 不使用 sprintf, 避免格式串解析的开销。
+ *
+ * @param enc encoder
+ * @param value 无符号整数值
+ */
+static void
+put_decimal(struct BEncoder *enc, uint64_t value)
+{
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    while (n > 0) {
+        put_char(enc, digits[--n]);
+    }
+}
+
+/**
+ * @brief 写入一个值之前的检查：字典中的值必须紧跟在键之后
+ *
+ * 字典的每一层用 is_dict 记录 1 - 期待键，2 - 期待值。
+ */
+static inline void
+before_value(struct BEncoder *enc)
+{
+    if (enc->depth > 0 && enc->is_dict[enc->depth - 1]) {
+        assert(enc->is_dict[enc->depth - 1] == 2 && "dict value without key");
+        enc->is_dict[enc->depth - 1] = 1;
+    }
+}
+
+void
+benc_int(struct BEncoder *enc, long value)
+{
+    before_value(enc);
+    benc_reserve(enc, 22);  // 'i' + '-' + 19 位数字 + 'e'
+    put_char(enc, 'i');
+    uint64_t abs = (uint64_t)value;
+    if (value < 0) {
+        put_char(enc, '-');
+        abs = -abs;
+    }
+    put_decimal(enc, abs);
+    put_char(enc, 'e');
+}
+
+/**
+ * @brief 写入长度前缀和串内容，不做键值检查
+ */
+static void
+put_str(struct BEncoder *enc, const void *data, size_t size)
+{
+    benc_reserve(enc, 21 + size);  // 20 位长度 + ':' + 内容
+    put_decimal(enc, size);
+    put_char(enc, ':');
+    memcpy(enc->data + enc->size, data, size);
+    enc->size += size;
+}
+
+void
+benc_str(struct BEncoder *enc, const void *data, size_t size)
+{
+    before_value(enc);
+    put_str(enc, data, size);
+}
+
+void
+benc_cstr(struct BEncoder *enc, const char *s)
+{
+    benc_str(enc, s, strlen(s));
+}
+
+void
+benc_key_bin(struct BEncoder *enc, const char *key, size_t key_size)
+{
+    int level = enc->depth - 1;
+    assert(level >= 0 && enc->is_dict[level] == 1 && "key outside dict or missing value");
+
+    if (enc->last_key_size[level] != SIZE_MAX) {
+        int order = bkey_cmp(enc->data + enc->last_key[level], enc->last_key_size[level], key, key_size);
+        assert(order < 0 && "dict keys must be unique and sorted");
+        (void)order;
+    }
+
+    put_str(enc, key, key_size);
+    enc->last_key[level] = enc->size - key_size;
+    enc->last_key_size[level] = key_size;
+    enc->is_dict[level] = 2;
+}
+
+void
+benc_key(struct BEncoder *enc, const char *key)
+{
+    benc_key_bin(enc, key, strlen(key));
+}
+
+/**
+ * @brief 开始一个容器
+ * @param enc encoder
+ * @param lead 容器起始字符
+ * @param is_dict 是否为字典
+ */
+static void
+container_begin(struct BEncoder *enc, char lead, int is_dict)
+{
+    before_value(enc);
+    if (enc->depth == BENCODE_MAX_DEPTH) {
+        panic("bencode nesting exceeds %d", BENCODE_MAX_DEPTH);
+    }
+    enc->is_dict[enc->depth] = (char)is_dict;
+    enc->last_key_size[enc->depth] = SIZE_MAX;
+    enc->depth++;
+
+    benc_reserve(enc, 1);
+    put_char(enc, lead);
+}
+
+void
+benc_list_begin(struct BEncoder *enc)
+{
+    container_begin(enc, 'l', 0);
+}
+
+void
+benc_dict_begin(struct BEncoder *enc)
+{
+    container_begin(enc, 'd', 1);
+}
+
+void
+benc_end(struct BEncoder *enc)
+{
+    assert(enc->depth > 0 && "unbalanced benc_end");
+    assert(enc->is_dict[enc->depth - 1] != 2 && "dict key without value");
+    enc->depth--;
+
+    benc_reserve(enc, 1);
+    put_char(enc, 'e');
+}
+
+/**
+ * @brief 按键比较两个字典项指针，供 qsort 使用
+ */
+static int
+compare_entry_ptr(const void *x, const void *y)
+{
+    const struct BNode *a = *(const struct BNode **)x;
+    const struct BNode *b = *(const struct BNode **)y;
+    return bkey_cmp(a->d_key, a->d_key_size, b->d_key, b->d_key_size);
+}
+
+/**
+ * @brief 输出一个字典项，键与上一项相同时跳过
+ *
+ * parser 并不拒绝重复的键，而 benc_key_bin() 要求键严格递增，
+ * 所以来自不可信输入的语法树中重复的键只保留排序后的第一项。
+ *
+ * @param enc encoder
+ * @param entry 字典项
+ * @param prev 上一个输出的字典项，NULL 表示还没有；输出后改写成 entry
+ */
+static void
+benc_dict_entry(struct BEncoder *enc, const struct BNode *entry, const struct BNode **prev)
+{
+    if (*prev != NULL && bkey_cmp((*prev)->d_key, (*prev)->d_key_size, entry->d_key, entry->d_key_size) == 0) {
+        return;
+    }
+    benc_key_bin(enc, entry->d_key, entry->d_key_size);
+    benc_bnode(enc, entry->d_val);
+    *prev = entry;
+}
+
+/**
+ * @brief 编码字典
+ *
+ * 带索引的字典（arena 模式）已经有序，直接按 d_next 输出；
+ * 否则先收集各项并排序。重复的键只输出一次。
+ */
+static void
+benc_dict(struct BEncoder *enc, const struct BNode *dict)
+{
+    benc_dict_begin(enc);
+
+    if (dict->d_key == NULL) {  // 空字典
+        benc_end(enc);
+        return;
+    }
+
+    const struct BNode *prev = NULL;
+    if (dict->d_count != 0) {
+        for (const struct BNode *iter = dict; iter; iter = iter->d_next) {
+            benc_dict_entry(enc, iter, &prev);
+        }
+    }
+    else {
+        size_t n = 0;
+        for (const struct BNode *iter = dict; iter; iter = iter->d_next) {
+            n++;
+        }
+
+        const struct BNode **entries = malloc(n * sizeof(*entries));
+        n = 0;
+        for (const struct BNode *iter = dict; iter; iter = iter->d_next) {
+            entries[n++] = iter;
+        }
+        qsort(entries, n, sizeof(*entries), compare_entry_ptr);
+
+        for (size_t i = 0; i < n; i++) {
+            benc_dict_entry(enc, entries[i], &prev);
+        }
+        free(entries);
+    }
+
+    benc_end(enc);
+}
+
+void
+benc_bnode(struct BEncoder *enc, const struct BNode *node)
+{
+    switch (node->type) {
+    case B_INT:
+        benc_int(enc, node->i);
+        break;
+    case B_STR:
+        benc_str(enc, node->s_data, node->s_size);
+        break;
+    case B_LIST:
+        benc_list_begin(enc);
+        for (const struct BNode *iter = node; iter && iter->l_item; iter = iter->l_next) {
+            benc_bnode(enc, iter->l_item);
+        }
+        benc_end(enc);
+        break;
+    case B_DICT:
+        benc_dict(enc, node);
+        break;
+    default:
+        panic("unexpected bnode type %d", node->type);
+    }
+}
@@ -0,0 +1,119 @@
+/**
+ * @file bencoder.h
+ * @brief B 编码 encoder 的 API 声明
+ */
+
+#ifndef BENCODER_H
+#define BENCODER_H
+
+#include "bparser.h"
+#include <stddef.h>
+#include <inttypes.h>
+
+/**
+ * @brief B 编码 encoder
+ *
+ * 输出写入一块可增长的缓冲区。缓冲区按倍数扩容，benc_reset() 只清空内容
+ * 而保留容量，所以反复使用同一个 encoder（或事先 benc_reserve() 足够空间）
+ * 时，热路径上不会再发生 realloc.
+ *
+ * 为了保证字典键有序，encoder 记录每一层字典上一个键在缓冲区中的位置，
+ * benc_key() 会检查新键是否严格大于上一个键。
+ *
+ * 使用模式
+ * @code
+ * struct BEncoder enc;
+ * benc_init(&enc, 256);
+ * benc_dict_begin(&enc);
+ *     benc_key(&enc, "interval"); benc_int(&enc, 1800);
+ *     benc_key(&enc, "peers");    benc_str(&enc, peers, size);
+ * benc_end(&enc);
+ * write(fd, enc.data, enc.size);
+ * benc_free(&enc);
+ * @endcode
+ */
+struct BEncoder
+{
+    char *data;                               ///< 输出缓冲区
+    size_t size;                              ///< 已写入的字节数
+    size_t capacity;                          ///< 缓冲区容量
+    int depth;                                ///< 当前容器嵌套深度
+    char is_dict[BENCODE_MAX_DEPTH];          ///< 各层容器是否为字典
+    size_t last_key[BENCODE_MAX_DEPTH];       ///< 各层字典上一个键内容在缓冲区中的偏移
+    size_t last_key_size[BENCODE_MAX_DEPTH];  ///< 各层字典上一个键的长度，SIZE_MAX 表示还没有键
+};
+
+/**
+ * @brief 初始化 encoder
+ * @param enc 要初始化的 encoder
+ * @param capacity 初始容量
+ */
+void benc_init(struct BEncoder *enc, size_t capacity);
+
+/**
+ * @brief 保证缓冲区至少还能写入 extra 字节
+ * @param enc encoder
+ * @param extra 要预留的字节数
+ */
+void benc_reserve(struct BEncoder *enc, size_t extra);
+
+/**
+ * @brief 清空已编码的内容，保留缓冲区容量以便复用
+ * @param enc encoder
+ */
+void benc_reset(struct BEncoder *enc);
+
+/**
+ * @brief 释放 encoder 的缓冲区
+ * @param enc encoder
+ */
+void benc_free(struct BEncoder *enc);
+
+/** @brief 编码整型 */
+void benc_int(struct BEncoder *enc, long value);
+
+/** @brief 编码（二进制）串 */
+void benc_str(struct BEncoder *enc, const void *data, size_t size);
+
+/** @brief 编码 C 字符串 */
+void benc_cstr(struct BEncoder *enc, const char *s);
+
+/**
+ * @brief 编码字典键
+ *
+ * 只能在字典中调用，并且要求键按字节序严格递增。
+ *
+ * @param enc encoder
+ * @param key 键，C 字符串
+ */
+void benc_key(struct BEncoder *enc, const char *key);
+
+/**
+ * @brief 编码字典键（二进制形式）
+ * @param enc encoder
+ * @param key 键
+ * @param key_size 键长度
+ */
+void benc_key_bin(struct BEncoder *enc, const char *key, size_t key_size);
+
+/** @brief 开始一个列表 */
+void benc_list_begin(struct BEncoder *enc);
+
+/** @brief 开始一个字典 */
+void benc_dict_begin(struct BEncoder *enc);
+
+/** @brief 结束当前的列表或字典 */
+void benc_end(struct BEncoder *enc);
+
+/**
+ * @brief 将语法树编码回 B 编码
+ *
+ * 字典键按字节序输出，对于没有排序索引的字典会先排序。
+ * 语法树可以来自不可信的输入：重复的键只输出排序后的第一项。
+ *
+ * @param enc encoder
+ * @param node 语法树根结点
+ */
+void benc_bnode(struct BEncoder *enc, const struct BNode *node);
+
+#endif  // BENCODER_H
@@ -3,10 +3,14 @@
  * @brief This module handles bittorrent protocol
  */
 
+#define _GNU_SOURCE       // splice(), pipe2()
 #include "butil.h"
 #include "util.h"
 #include "peer.h"
 #include "connect.h"
+#include "diskio.h"
+#include "resume.h"
+#include "readcache.h"
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>       // read(), write()
@@ -14,13 +18,34 @@
 #include <sys/epoll.h>    // epoll_create1(), epoll_ctl(), epoll_wait(), epoll_event
 #include <arpa/inet.h>    // inet_ntoa()
 #include <sys/timerfd.h>  // timerfd_settime()
-#include <openssl/sha.h>  // SHA1()
+#include <sys/mman.h>     // madvise()
+#include <sys/uio.h>      // writev()
+#include <sys/socket.h>   // send()
+#include <fcntl.h>        // splice(), F_SETPIPE_SZ
 
 /**
  * @brief 报文缓冲区大小
  */
 #define BUF_SIZE 4096
 
+/**
+ * @brief 一个 HASHES 消息最多携带的结点数 (BEP 52)
+ */
+#define MAX_HASHES 512
+
+/**
+ * @brief 转发 PIECE 数据的管道容量，更长的子分片改为读到内存再发送
+ */
+#define SPLICE_PIPE_SIZE 0x10000
+
+/**
+ * @brief 留着复用的空管道个数上限
+ */
+#define MAX_SPARE_PIPES 16
+
+static int spare_pipes[MAX_SPARE_PIPES][2];
+static int nr_spare_pipes;
+
 /**
  * @brief 发送握手信息
  */
@@ -30,6 +55,9 @@ send_handshake(int sfd, struct MetaInfo *mi)
     PeerHandShake handshake = { .hs_pstrlen = PSTRLEN_DEFAULT };
     strncpy(handshake.hs_pstr, PSTR_DEFAULT, PSTRLEN_DEFAULT);
     memset(handshake.hs_reserved, 0, sizeof(handshake.hs_reserved));
+    if (mi->is_v2) {
+        handshake.hs_reserved[HS_V2_BYTE] |= HS_V2_MASK;
+    }
     memcpy(handshake.hs_info_hash, mi->info_hash, sizeof(mi->info_hash));
     memcpy(handshake.hs_peer_id, mi->peer_id, HASH_SIZE);
 
@@ -90,6 +118,87 @@ send_msg_to_tracker(struct MetaInfo *mi, struct Tracker *tracker)
     send_http_request(req, tracker->sfd);
 }
 
+/**
+ * @brief 获取分片的默克尔树状态，没有时分配
+ *
+ * 每个分片只有一个叶子时分片层就是叶子层，期望叶子直接可知。
+ *
+ * @param mi 全局信息，要求 is_v2
+ * @param index 分片号
+ * @return 分片的默克尔树状态
+ */
+static struct PieceMerkle *
+get_piece_merkle(struct MetaInfo *mi, uint32_t index)
+{
+    struct PieceInfo *piece = &mi->pieces[index];
+    if (piece->merkle == NULL) {
+        struct PieceMerkle *merkle = calloc(1, sizeof(*merkle));
+        merkle->got = malloc(mi->sub_count * MERKLE_HASH_SIZE);
+        merkle->want = malloc(mi->sub_count * MERKLE_HASH_SIZE);
+        merkle->flags = calloc(mi->sub_count, 1);
+        if (mi->piece_height == 0) {
+            memcpy(merkle->want, piece_root(mi, index), MERKLE_HASH_SIZE);
+            merkle->flags[0] |= LEAF_WANT;
+        }
+        piece->merkle = merkle;
+    }
+    return piece->merkle;
+}
+
+/**
+ * @brief 向 peer 请求一个分片的全部叶子
+ *
+ * 每个请求最多 MAX_HASHES 个叶子，附带证明到分片层所需的 uncle,
+ * 完全落在文件末尾之后的部分不请求。
+ *
+ * @param mi 全局信息，要求 is_v2
+ * @param peer 支持 v2 的 peer
+ * @param index 分片号
+ * @return 发出的请求数，peer 不支持 v2 或者分片只有一个叶子时为 0
+ */
+static int
+send_hash_request(struct MetaInfo *mi, struct Peer *peer, uint32_t index)
+{
+    int height = mi->piece_height;
+    if (!peer->is_v2 || height == 0) {
+        return 0;
+    }
+
+    size_t sub_cnt = (piece_length(mi, index) - 1) / mi->sub_size + 1;
+    size_t chunk = ((size_t)1 << height) < MAX_HASHES ? ((size_t)1 << height) : MAX_HASHES;
+    struct PeerMsg msg = { .len = htonl(1 + sizeof(msg.hash)), .id = BT_HASH_REQUEST };
+    memcpy(msg.hash.pieces_root, mi->pieces_root, MERKLE_HASH_SIZE);
+    msg.hash.base_layer = htonl(0);
+    msg.hash.length = htonl((uint32_t)chunk);
+    msg.hash.proof_layers = htonl((uint32_t)height);
+
+    int n = 0;
+    for (size_t first = 0; first < sub_cnt; first += chunk, n++) {
+        msg.hash.index = htonl((uint32_t)(((size_t)index << height) + first));
+        peer_send_msg(peer, &msg);
+    }
+    get_piece_merkle(mi, index)->nr_requested += n;
+
+    log("send %d %s for piece %u to %s:%u", n, bt_types[msg.id], index, peer->ip, peer->port);
+    return n;
+}
+
+/**
+ * @brief 向任意一个拥有分片的 v2 peer 请求分片的叶子
+ * @return 发出的请求数，没有合适的 peer 时为 0
+ */
+static int
+request_piece_hashes(struct MetaInfo *mi, uint32_t index)
+{
+    for (int i = 0; i < mi->nr_peers; i++) {
+        struct Peer *peer = mi->peers[i];
+        if (peer->is_v2 && peer_get_bit(peer, index)) {
+            return send_hash_request(mi, peer, index);
+        }
+    }
+    return 0;
+}
+
 /**
  * @brief 向 peer 发送分片请求，同时更新 peer 和对应子分片的大小
  *
@@ -120,6 +229,14 @@ send_request(struct MetaInfo *mi, struct Peer *peer, struct PeerMsg *msg)
     piece->substate[sub_idx] = SUB_DOWNLOAD;
     clock_gettime(CLOCK_BOOTTIME, &peer->st);
 
+    // v2 种子顺便向 peer 要这个分片的叶子，子分片到达时就能逐个校验
+    if (mi->is_v2) {
+        struct PieceMerkle *merkle = get_piece_merkle(mi, index);
+        if (merkle->nr_requested == 0 && !(merkle->flags[0] & LEAF_WANT)) {
+            send_hash_request(mi, peer, index);
+        }
+    }
+
     msg->request.index = htonl(index);
     msg->request.begin = htonl(begin);
     msg->request.length = htonl(length);
@@ -144,19 +261,34 @@ select_peer(struct MetaInfo *mi, struct PeerMsg *msg)
 {
     // 没有阻塞我方的、没有下载任务的，是 available 的.
     int peer_available = 2;
+    struct Peer *suspect = NULL;
+
+    // 分片上次校验失败时，这个子分片尽量换一个 peer 下载，以便区分坏数据的来源
+    const struct BlockRecord *record = mi->pieces[msg->request.index].suspects;
+    uint32_t suspect_addr = record ? record[msg->request.begin / mi->sub_size].addr : 0;
 
     for (int i = 0; i < mi->nr_peers; i++) {
         struct Peer *peer = mi->peers[i];
-        if (!peer->get_choked && peer->requesting_index == -1) {
+        if (!peer->get_choked && peer->requesting_index == -1 && !peer->is_banned) {
             peer_available = 1;
             if (peer_get_bit(peer, msg->request.index)) {
                 // 可以响应的，没有下载任务的，有分片的
+                if (suspect_addr != 0 && peer->addr == suspect_addr) {
+                    suspect = suspect ? suspect : peer;
+                    continue;
+                }
                 send_request(mi, peer, msg);
                 return 0;
             }
         }
     }
 
+    // 没有别的选择时仍然使用嫌疑 peer
+    if (suspect != NULL) {
+        send_request(mi, suspect, msg);
+        return 0;
+    }
+
     return peer_available;
 }
 
@@ -211,7 +343,10 @@ select_piece(struct MetaInfo *mi, int end_game)
         }
 
         for (sub_idx = 0; sub_idx < sub_cnt; sub_idx++) {
-            if (piece->substate[sub_idx] == SUB_NA || (piece->substate[sub_idx] == SUB_DOWNLOAD && end_game)) {
+            if (piece->substate[sub_idx] == SUB_NA && piece->is_rewriting) {
+                continue;  // 等旧数据写完再重新请求
+            }
+            else if (piece->substate[sub_idx] == SUB_NA || (piece->substate[sub_idx] == SUB_DOWNLOAD && end_game)) {
                 //------------------------------------
                 // 寻找可以发送请求的 peer 并发送请求
                 //------------------------------------
@@ -265,35 +400,886 @@ select_piece(struct MetaInfo *mi, int end_game)
 }
 
 /**
- * @brief check a piece's sha1
- * @param fp file
- * @param piece_idx piece index
- * @param piece_size common piece size, no need to adjust for the last one
- * @param file_size file size
- * @param check correct sha1
- * @return 1 - consistent, 0 - not
+ * @brief 提交分片的后台校验
+ *
+ * 分片的全部子分片都已写入但没有完整的增量摘要（例如部分子分片
+ * 来自上次运行），交给磁盘线程池读出并计算 SHA1,
+ * 结果由 handle_disk_completion() 在事件循环中处理。校验期间子分片
+ * 保持 SUB_FINISH 而 is_downloaded 仍为 0, 所以既不会被再次请求，
+ * 也不会被上传给其他 peer.
+ *
+ * @param mi 全局信息
+ * @param index 分片号
  */
-int check_piece(FILE *fp, int piece_idx, uint32_t piece_size, uint8_t check[20])
+static void
+submit_verify(struct MetaInfo *mi, uint32_t index)
 {
-    uint8_t *piece = malloc(piece_size);
-    fseek(fp, piece_idx * piece_size, SEEK_SET);
-    ssize_t nr_read = fread(piece, 1, piece_size, fp);
-    if (nr_read < piece_size && ferror(fp)) {
-        err("failed to read file");
-        exit(EXIT_FAILURE);
+    struct DiskJob *job = calloc(1, sizeof(*job));
+    job->type = DISK_VERIFY;
+    job->fd = mi->fd;
+    job->st = mi->storage;
+    job->index = index;
+    job->offset = (off_t)index * mi->piece_size;
+    job->length = piece_length(mi, index);
+    memcpy(job->expect, piece_hash(mi, index), HASH_SIZE);
+    if (mi->map != NULL) {
+        job->src = mi->map + job->offset;
+    }
+    diskio_submit(mi->dio, job);
+}
+
+/**
+ * @brief 创建从分片开头读出一段数据并分块计算摘要的任务
+ * @param mi 全局信息
+ * @param index 分片号
+ * @param length 字节数，可以跨过多个分片
+ * @param src 数据所在的内存缓冲区，NULL 表示使用数据文件的映射或者读盘
+ * @return 动态分配的任务，调用者填好摘要函数和 buf 后提交
+ */
+static struct DiskJob *
+new_digest_job(struct MetaInfo *mi, uint32_t index, size_t length, const uint8_t *src)
+{
+    struct DiskJob *job = calloc(1, sizeof(*job));
+    job->type = DISK_DIGEST;
+    job->fd = mi->fd;
+    job->st = mi->storage;
+    job->index = index;
+    job->offset = (off_t)index * mi->piece_size;
+    job->length = length;
+    job->src = src;
+    if (src == NULL && mi->map != NULL) {
+        job->src = mi->map + job->offset;
+    }
+    job->peer_fd = -1;
+    return job;
+}
+
+/**
+ * @brief 把分片的各子分片交给磁盘线程池计算 SHA1, 由 handle_blame() 对比
+ * @param mi 全局信息
+ * @param index 分片号
+ */
+static void
+submit_blame(struct MetaInfo *mi, uint32_t index)
+{
+    size_t length = piece_length(mi, index);
+    struct DiskJob *job = new_digest_job(mi, index, length, mi->pieces[index].buf);
+    job->block = mi->sub_size;
+    job->md_size = HASH_SIZE;
+    job->digest = sha1;
+    job->is_piece = 1;
+    job->buf = malloc(((length - 1) / mi->sub_size + 1) * HASH_SIZE);
+    diskio_submit(mi->dio, job);
+}
+
+/**
+ * @brief 把内存缓冲区中校验通过的分片交给磁盘线程池一次写盘
+ *
+ * 缓冲区随任务交出，写完之前仍计入 cache_used,
+ * 由 handle_written() 结算分片。
+ *
+ * @param mi 全局信息
+ * @param index 分片号，要求有缓冲区
+ */
+static void
+submit_write_piece(struct MetaInfo *mi, uint32_t index)
+{
+    struct PieceInfo *piece = &mi->pieces[index];
+    struct DiskJob *job = calloc(1, sizeof(*job));
+    job->type = DISK_WRITE;
+    job->fd = mi->fd;
+    job->st = mi->storage;
+    job->index = index;
+    job->offset = (off_t)index * mi->piece_size;
+    job->length = piece_length(mi, index);
+    job->is_piece = 1;
+    job->buf = piece->buf;
+    piece->buf = NULL;
+    piece->nr_writes++;
+    diskio_submit(mi->dio, job);
+}
+
+/**
+ * @brief 把一个子分片交给磁盘线程池写盘
+ * @param mi 全局信息
+ * @param index 分片号
+ * @param sub_idx 子分片号
+ * @param block 子分片数据
+ * @param size 子分片字节数
+ * @param owned 非 NULL 时就是 block, 由 diskio_alloc() 分配，直接随任务交出；否则写出 block 的拷贝
+ */
+static void
+submit_write_block(struct MetaInfo *mi, uint32_t index, size_t sub_idx, const uint8_t *block, uint32_t size,
+                   uint8_t *owned)
+{
+    struct DiskJob *job = calloc(1, sizeof(*job));
+    job->type = DISK_WRITE;
+    job->fd = mi->fd;
+    job->st = mi->storage;
+    job->index = index;
+    job->begin = (uint32_t)(sub_idx * mi->sub_size);
+    job->offset = (off_t)index * mi->piece_size + job->begin;
+    job->length = size;
+    if (owned != NULL) {
+        job->buf = owned;
+    }
+    else {
+        job->buf = diskio_alloc(mi->dio, size);
+        memcpy(job->buf, block, size);
+    }
+    mi->pieces[index].nr_writes++;
+    diskio_submit(mi->dio, job);
+}
+
+/**
+ * @brief 记录一个 ip 地址发送了一次坏数据，达到 BAN_STRIKES 时拒绝它的全部连接
+ * @param mi 全局信息
+ * @param addr ip 地址，网络字节序，0 表示来源未知，忽略
+ */
+static void
+blame_peer(struct MetaInfo *mi, uint32_t addr)
+{
+    if (addr == 0) {
+        return;
+    }
+
+    int strikes = add_strike(mi, addr);
+    struct in_addr ia = { .s_addr = addr };
+    err("%s sent bad data, %d strikes", inet_ntoa(ia), strikes);
+
+    if (strikes == BAN_STRIKES) {
+        log("ban %s", inet_ntoa(ia));
+        for (int i = 0; i < mi->nr_peers; i++) {
+            if (mi->peers[i]->addr == addr) {
+                mi->peers[i]->is_banned = 1;
+            }
+        }
+    }
+}
+
+/**
+ * @brief 作废校验失败的分片，重新下载
+ * @param mi 全局信息
+ * @param index 分片号
+ */
+static void
+reset_failed_piece(struct MetaInfo *mi, uint32_t index)
+{
+    struct PieceInfo *piece = &mi->pieces[index];
+    if (piece->sources != NULL) {
+        memset(piece->sources, 0, mi->sub_count * sizeof(*piece->sources));
+    }
+    memset(piece->substate, SUB_NA, mi->sub_count);
+    piece->is_rewriting = piece->nr_writes > 0;
+    mi->left += piece_length(mi, index);
+    free_piece_buffer(mi, piece);
+}
+
+/**
+ * @brief 分片校验失败后记下每个子分片的来源和摘要
+ *
+ * 只看整个分片无法知道哪个子分片是坏的，先记下来，重新下载时尽量换别的
+ * peer（见 select_peer()），等分片通过校验后由 blame_passed_piece()
+ * 对比出与正确数据不同的子分片，才能确定坏数据的来源。
+ * 已有记录时保留最早的一份。
+ *
+ * 摘要在磁盘线程池中计算，算完之前分片保持原样（子分片仍为 SUB_FINISH,
+ * 缓冲区也不释放），以免重新下载的数据覆盖要追查的数据，
+ * 由 handle_blame() 记录后再作废分片。
+ *
+ * @param mi 全局信息
+ * @param index 分片号
+ */
+static void
+blame_failed_piece(struct MetaInfo *mi, uint32_t index)
+{
+    struct PieceInfo *piece = &mi->pieces[index];
+    if (piece->sources == NULL || piece->suspects != NULL) {
+        reset_failed_piece(mi, index);
+        return;
+    }
+    piece->is_blaming = 1;
+    submit_blame(mi, index);
+}
+
+/**
+ * @brief 曾经校验失败的分片通过校验后，找出当时发送坏子分片的 peer
+ *
+ * 有记录时交给磁盘线程池计算摘要，由 handle_blame() 对比。
+ *
+ * @param mi 全局信息
+ * @param index 分片号
+ */
+static void
+blame_passed_piece(struct MetaInfo *mi, uint32_t index)
+{
+    struct PieceInfo *piece = &mi->pieces[index];
+    if (piece->suspects != NULL) {
+        submit_blame(mi, index);
+        return;
+    }
+    free_piece_blame(piece);
+}
+
+/**
+ * @brief 处理 submit_blame() 算出的子分片摘要
+ *
+ * 分片已经通过校验时与失败时的记录对比，找出坏数据的来源；
+ * 否则记下各子分片的来源和摘要，然后作废分片。读取出错时放弃追查。
+ *
+ * @param mi 全局信息
+ * @param job 完成的摘要任务
+ */
+static void
+handle_blame(struct MetaInfo *mi, struct DiskJob *job)
+{
+    struct PieceInfo *piece = &mi->pieces[job->index];
+    size_t sub_cnt = (job->length - 1) / mi->sub_size + 1;
+
+    if (piece->is_downloaded) {
+        for (size_t j = 0; job->result == 0 && j < sub_cnt; j++) {
+            if (memcmp(job->buf + j * HASH_SIZE, piece->suspects[j].md, HASH_SIZE) != 0) {
+                log("piece %u subpiece %lu was bad", job->index, j);
+                blame_peer(mi, piece->suspects[j].addr);
+            }
+        }
+        free_piece_blame(piece);
+        return;
+    }
+
+    if (job->result == 0) {
+        piece->suspects = calloc(sub_cnt, sizeof(*piece->suspects));
+        for (size_t j = 0; j < sub_cnt; j++) {
+            piece->suspects[j].addr = piece->sources[j];
+            memcpy(piece->suspects[j].md, job->buf + j * HASH_SIZE, HASH_SIZE);
+        }
+    }
+    piece->is_blaming = 0;
+    reset_failed_piece(mi, job->index);
+}
+
+/**
+ * @brief 处理一个分片的校验结果
+ *
+ * 校验通过才标记分片完成、设置位图并向所有没有该分片的 peer 广播 HAVE,
+ * 内存缓冲区中的分片此时才提交写盘，写完后由 handle_written() 再次调用；
+ * 校验失败则丢弃缓冲区、重置子分片状态，分片重新计入 left.
+ * 两种情况都会追查坏数据的来源。
+ *
+ * @param mi 全局信息
+ * @param index 分片号
+ * @param result 1 - 一致，0 - 不一致，-1 - 读写出错
+ */
+static void
+handle_verified(struct MetaInfo *mi, uint32_t index, int result)
+{
+    struct PieceInfo *piece = &mi->pieces[index];
+    free_piece_merkle(mi, piece);
+
+    if (result == 1 && piece->buf != NULL) {
+        submit_write_piece(mi, index);
+        return;
+    }
+
+    if (result == 1) {
+        blame_passed_piece(mi, index);
+        piece->is_downloaded = 1;
+        set_bit(mi->bitfield, index);
+        log("piece %u verified", index);
+
+        // 发送 HAVE 消息
+        struct PeerMsg have_msg = { .len = htonl(5), .id = BT_HAVE, .have.piece_index = htonl(index) };
+        for (int i = 0; i < mi->nr_peers; i++) {
+            struct Peer *peer = mi->peers[i];
+            if (!peer_get_bit(peer, index)) {
+                peer_send_msg(peer, &have_msg);
+                log("send %s %u to %s:%u", bt_types[have_msg.id], index, peer->ip, peer->port);
+            }
+        }
+
+        // 下载完成，记录下来以便重启后直接做种
+        if (mi->left == 0) {
+            resume_save(mi);
+            if (mi->map != NULL) {
+                madvise(mi->map, mi->file_size, MADV_RANDOM);  // 此后只有上传的随机读
+            }
+        }
+    }
+    else {
+        if (result == -1) {
+            err("failed to read or write piece %u", index);
+        }
+        log("piece %u mismatch", index);
+        blame_failed_piece(mi, index);
+        return;
+    }
+
+    free_piece_buffer(mi, piece);
+}
+
+/**
+ * @brief 把一个子分片计入分片的增量摘要
+ *
+ * 分片的第一个子分片到达时才分配 hasher; 如果此时分片已经有完成的子分片
+ * （摘要状态无从恢复），就不再增量计算，完成后由 submit_verify() 读盘校验。
+ *
+ * @param mi 全局信息
+ * @param index 分片号
+ * @param sub_idx 子分片号
+ * @param block 子分片数据
+ * @param size 子分片字节数
+ */
+static void
+hash_block(struct MetaInfo *mi, uint32_t index, size_t sub_idx, const uint8_t *block, uint32_t size)
+{
+    struct PieceInfo *piece = &mi->pieces[index];
+    size_t sub_cnt = (piece_length(mi, index) - 1) / mi->sub_size + 1;
+
+    if (piece->hasher == NULL) {
+        if (memchr(piece->substate, SUB_FINISH, sub_cnt) != NULL) {
+            return;
+        }
+        piece->hasher = calloc(1, sizeof(*piece->hasher));
+        piece->hasher->held = calloc(mi->sub_count, sizeof(*piece->hasher->held));
+        sha1_init(&piece->hasher->ctx);
+    }
+
+    struct PieceHasher *hasher = piece->hasher;
+    if (sub_idx != hasher->next_sub) {
+        // 乱序到达，暂存到空缺补上为止
+        assert(hasher->held[sub_idx] == NULL);
+        uint8_t *copy = malloc(4 + size);
+        memcpy(copy, &size, 4);
+        memcpy(copy + 4, block, size);
+        hasher->held[sub_idx] = copy;
+        return;
+    }
+
+    sha1_update(&hasher->ctx, block, size);
+    hasher->next_sub++;
+
+    // 依次喂入已经暂存的后续子分片
+    while (hasher->next_sub < sub_cnt && hasher->held[hasher->next_sub] != NULL) {
+        uint8_t *copy = hasher->held[hasher->next_sub];
+        uint32_t held_size;
+        memcpy(&held_size, copy, 4);
+        sha1_update(&hasher->ctx, copy + 4, held_size);
+        free(copy);
+        hasher->held[hasher->next_sub] = NULL;
+        hasher->next_sub++;
+    }
+}
+
+/**
+ * @brief 计算子分片的叶子并与期望叶子比较
+ * @param mi 全局信息，要求 is_v2
+ * @param index 分片号
+ * @param sub_idx 子分片号
+ * @param block 子分片数据
+ * @param size 子分片字节数
+ * @return 可以写入返回 1, 与经过证明的期望叶子不符返回 0
+ */
+static int
+merkle_block(struct MetaInfo *mi, uint32_t index, size_t sub_idx, const uint8_t *block, uint32_t size)
+{
+    struct PieceMerkle *merkle = get_piece_merkle(mi, index);
+    uint8_t *leaf = merkle->got + sub_idx * MERKLE_HASH_SIZE;
+
+    merkle_leaf(block, size, leaf);
+    if ((merkle->flags[sub_idx] & LEAF_WANT)
+            && memcmp(leaf, merkle->want + sub_idx * MERKLE_HASH_SIZE, MERKLE_HASH_SIZE) != 0) {
+        return 0;
+    }
+    merkle->flags[sub_idx] |= LEAF_GOT;
+    return 1;
+}
+
+/**
+ * @brief 丢弃一个已写入的子分片，之后会重新请求，并记它的来源一次
+ * @param mi 全局信息
+ * @param index 分片号
+ * @param sub_idx 子分片号
+ */
+static void
+drop_block(struct MetaInfo *mi, uint32_t index, size_t sub_idx)
+{
+    struct PieceInfo *piece = &mi->pieces[index];
+    size_t rest = piece_length(mi, index) - sub_idx * mi->sub_size;
+
+    piece->substate[sub_idx] = SUB_NA;
+    piece->is_rewriting = piece->nr_writes > 0;
+    piece->merkle->flags[sub_idx] &= (uint8_t)~LEAF_GOT;
+    if (piece->sources != NULL) {
+        blame_peer(mi, piece->sources[sub_idx]);
+        piece->sources[sub_idx] = 0;
+    }
+    mi->left += rest < mi->sub_size ? rest : mi->sub_size;
+    log("drop piece %u subpiece %lu", index, sub_idx);
+}
+
+/**
+ * @brief 结算叶子齐全的 v2 分片
+ *
+ * 叶子归约出的根与分片层一致即完成。不一致时如果已经请求或者还能请求到
+ * 经过证明的叶子，就等 handle_hashes() 找出坏的子分片；否则整片重新下载。
+ *
+ * @param mi 全局信息
+ * @param index 分片号
+ */
+static void
+finish_merkle_piece(struct MetaInfo *mi, uint32_t index)
+{
+    struct PieceMerkle *merkle = mi->pieces[index].merkle;
+    size_t sub_cnt = (piece_length(mi, index) - 1) / mi->sub_size + 1;
+
+    uint8_t root[MERKLE_HASH_SIZE];
+    merkle_root(merkle->got, sub_cnt, 0, mi->piece_height, root);
+    if (memcmp(root, piece_root(mi, index), MERKLE_HASH_SIZE) == 0) {
+        handle_verified(mi, index, 1);
+    }
+    else if (merkle->nr_requested > 0 || request_piece_hashes(mi, index) > 0) {
+        log("piece %u merkle root mismatch, waiting for leaves", index);
+        merkle->failed_ticks = 1;
+    }
+    else {
+        handle_verified(mi, index, 0);
+    }
+}
+
+/**
+ * @brief 获取分片的内存缓冲区，没有时尝试分配
+ *
+ * 缓冲区总量不超过 cache_size 时才分配；已经有完成子分片（例如来自上次运行）
+ * 的分片不使用缓冲区。
+ *
+ * @param mi 全局信息
+ * @param index 分片号
+ * @return 缓冲区，不能使用缓冲区时返回 NULL
+ */
+static uint8_t *
+piece_buffer(struct MetaInfo *mi, uint32_t index)
+{
+    struct PieceInfo *piece = &mi->pieces[index];
+    size_t length = piece_length(mi, index);
+    size_t sub_cnt = (length - 1) / mi->sub_size + 1;
+
+    if (piece->buf == NULL && mi->cache_used + length <= mi->cache_size
+            && memchr(piece->substate, SUB_FINISH, sub_cnt) == NULL) {
+        piece->buf = malloc(length);
+        mi->cache_used += length;
+    }
+    return piece->buf;
+}
+
+/**
+ * @brief 保存一个子分片
+ *
+ * 分片的第一个子分片到达时尝试分配内存缓冲区（见 piece_buffer()）：
+ * 子分片只拷贝到缓冲区，分片校验通过后才一次写盘，坏数据不会进入文件；
+ * 缓冲区达到上限时新的分片退回到逐个子分片提交写盘（mmap 模式下直接拷贝到映射）
+ * 并增量计算摘要。子分片已经直接读到了缓冲区或者映射中时不再拷贝。
+ *
+ * @param mi 全局信息
+ * @param index 分片号
+ * @param sub_idx 子分片号
+ * @param block 子分片数据
+ * @param size 子分片字节数
+ * @param owned 非 NULL 时就是 block, 由 diskio_alloc() 分配，逐个子分片写盘时直接随任务交出
+ * @return owned 被交出返回 1, 否则返回 0
+ */
+static int
+store_block(struct MetaInfo *mi, uint32_t index, size_t sub_idx, const uint8_t *block, uint32_t size,
+            uint8_t *owned)
+{
+    uint8_t *buf = piece_buffer(mi, index);
+    if (buf != NULL) {
+        uint8_t *dst = buf + sub_idx * mi->sub_size;
+        if (dst != block) {
+            memcpy(dst, block, size);
+        }
+        return 0;
+    }
+
+    // 先算摘要，子分片交给写盘任务后可能随时被释放
+    if (!mi->is_v2) {
+        hash_block(mi, index, sub_idx, block, size);
+    }
+    if (mi->map != NULL) {
+        uint8_t *dst = mi->map + (size_t)index * mi->piece_size + sub_idx * mi->sub_size;
+        if (dst != block) {
+            memcpy(dst, block, size);
+        }
+        return 0;
+    }
+    submit_write_block(mi, index, sub_idx, block, size, owned);
+    return owned != NULL;
+}
+
+/**
+ * @brief 查找正在把同一个子分片直接读入缓冲区或者映射的其他 peer
+ * @param mi 全局信息
+ * @param self 排除的 peer
+ * @param index 分片号
+ * @param begin 子分片偏移
+ * @return 找到的 peer, 没有返回 NULL
+ */
+static struct Peer *
+find_block_reader(struct MetaInfo *mi, struct Peer *self, uint32_t index, uint32_t begin)
+{
+    for (int i = 0; i < mi->nr_peers; i++) {
+        struct Peer *p = mi->peers[i];
+        if (p != self && p->block != NULL && !p->block_owned && p->wanted > 0
+                && p->requesting_index == (int)index && p->requesting_begin == (int)begin) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief 为 PIECE 报文的子分片选定读入位置，见 BlockPlacer
+ *
+ * 自己正在请求的、尚未完成的子分片直接读到分片缓冲区或者映射中，省掉一次拷贝；
+ * 逐个子分片写盘时读到一个 diskio_alloc() 缓冲区，随后直接交给写盘任务。
+ * 其他情况（重复或者不请自来的子分片、End Game 中另一个 peer 已经在直接读入
+ * 同一个子分片）读到单独的缓冲区，以免覆盖别人的数据。
+ *
+ * @param peer 发送报文的 peer
+ * @param msg 报文头，网络字节序
+ * @param arg 全局信息
+ * @return 子分片的读入位置
+ */
+static uint8_t *
+place_block(struct Peer *peer, const struct PeerMsg *msg, void *arg)
+{
+    struct MetaInfo *mi = arg;
+    uint32_t index = ntohl(msg->piece.index);
+    uint32_t begin = ntohl(msg->piece.begin);
+    uint32_t size = msg->len - 9;
+
+    if (index < mi->nr_pieces && peer->requesting_index == (int)index && peer->requesting_begin == (int)begin
+            && begin % mi->sub_size == 0 && size <= mi->sub_size && (size_t)begin + size <= piece_length(mi, index)
+            && mi->pieces[index].substate[begin / mi->sub_size] == SUB_DOWNLOAD
+            && find_block_reader(mi, peer, index, begin) == NULL) {
+        uint8_t *buf = piece_buffer(mi, index);
+        if (buf != NULL) {
+            return buf + begin;
+        }
+        if (mi->map != NULL) {
+            return mi->map + (size_t)index * mi->piece_size + begin;
+        }
+    }
+
+    peer->block_owned = 1;
+    return diskio_alloc(mi->dio, size);
+}
+
+/**
+ * @brief 结算全部子分片都已写入的分片
+ *
+ * v2 种子的叶子齐全时按默克尔树结算；分片在内存缓冲区中时直接计算摘要；
+ * 增量摘要完整时直接比较；否则（例如部分子分片来自上次运行）退回到后台读盘校验。
+ *
+ * @param mi 全局信息
+ * @param index 分片号
+ */
+static void
+finish_piece(struct MetaInfo *mi, uint32_t index)
+{
+    struct PieceInfo *piece = &mi->pieces[index];
+    size_t sub_cnt = (piece_length(mi, index) - 1) / mi->sub_size + 1;
+
+    size_t nr_leaves = 0;
+    while (piece->merkle != NULL && nr_leaves < sub_cnt && (piece->merkle->flags[nr_leaves] & LEAF_GOT)) {
+        nr_leaves++;
+    }
+
+    if (piece->merkle != NULL && nr_leaves == sub_cnt) {
+        finish_merkle_piece(mi, index);
+    }
+    else if (piece->buf != NULL) {
+        uint8_t md[HASH_SIZE];
+        sha1(piece->buf, piece_length(mi, index), md);
+        handle_verified(mi, index, memcmp(md, piece_hash(mi, index), HASH_SIZE) == 0);
+    }
+    else if (piece->hasher != NULL && piece->hasher->next_sub == sub_cnt) {
+        uint8_t md[HASH_SIZE];
+        sha1_final(&piece->hasher->ctx, md);
+        free_piece_hasher(mi, piece);
+        handle_verified(mi, index, memcmp(md, piece_hash(mi, index), HASH_SIZE) == 0);
+    }
+    else {
+        free_piece_hasher(mi, piece);
+        submit_verify(mi, index);
+    }
+}
+
+/**
+ * @brief 处理完成的写盘任务
+ *
+ * 整个分片写完才真正结算校验通过的分片，写盘失败时按读写出错处理。
+ * 子分片写盘失败则重新下载这个子分片，增量摘要已经包含了它，只能作废，
+ * 分片完成后退回到读盘校验。分片的写盘任务全部完成后，
+ * 如果子分片已经齐全就结算分片。
+ *
+ * @param mi 全局信息
+ * @param job 完成的写盘任务
+ */
+static void
+handle_written(struct MetaInfo *mi, struct DiskJob *job)
+{
+    struct PieceInfo *piece = &mi->pieces[job->index];
+    piece->nr_writes--;
+
+    if (job->is_piece) {
+        mi->cache_used -= job->length;
+        handle_verified(mi, job->index, job->result == 0 ? 1 : -1);
+        return;
+    }
+
+    if (job->result == -1) {
+        size_t sub_idx = job->begin / mi->sub_size;
+        err("failed to write piece %u subpiece %lu", job->index, sub_idx);
+        if (piece->substate[sub_idx] == SUB_FINISH) {
+            piece->substate[sub_idx] = SUB_NA;
+            if (piece->merkle != NULL) {
+                piece->merkle->flags[sub_idx] &= (uint8_t)~LEAF_GOT;
+            }
+            mi->left += job->length;
+        }
+        piece->is_rewriting = 1;
+        free_piece_hasher(mi, piece);
+    }
+
+    if (piece->nr_writes == 0) {
+        piece->is_rewriting = 0;
+        if (!piece->is_downloaded && !piece->is_blaming && check_substate(mi, job->index)) {
+            finish_piece(mi, job->index);
+        }
+    }
+}
+
+/**
+ * @brief 发送 PIECE 消息，子分片数据直接从内存中的分片（缓冲或者映射）发出
+ * @param fd peer 的套接字
+ * @param index 分片号
+ * @param begin 子分片在分片内的偏移
+ * @param data 子分片数据
+ * @param length 子分片长度
+ */
+static void
+send_piece_msg(int fd, uint32_t index, uint32_t begin, const uint8_t *data, uint32_t length)
+{
+    struct PeerMsg header = {
+        .len = htonl(9 + length),
+        .id = BT_PIECE,
+        .piece.index = htonl(index),
+        .piece.begin = htonl(begin),
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &header, .iov_len = 4 + 9 },
+        { .iov_base = (void *)data, .iov_len = length },
+    };
+    if (writev(fd, iov, 2) < 4 + 9 + length) {
+        err("damn");
+    }
+}
+
+/**
+ * @brief 为读缓存读入整个分片
+ * @param mi 全局信息，要求 read_cache 不为 NULL
+ * @param index 分片号，要求没有缓存
+ * @return 正在读入的缓存分片；缓存腾不出空间返回 NULL
+ */
+static struct CachedPiece *
+load_cached_piece(struct MetaInfo *mi, uint32_t index)
+{
+    size_t length = piece_length(mi, index);
+    struct CachedPiece *cp = readcache_add(mi->read_cache, index, length);
+    if (cp == NULL) {
+        return NULL;
+    }
+
+    struct DiskJob *job = calloc(1, sizeof(*job));
+    job->type = DISK_READ;
+    job->fd = mi->fd;
+    job->st = mi->storage;
+    job->index = index;
+    job->offset = (off_t)index * mi->piece_size;
+    job->length = length;
+    job->buf = malloc(length);  // 读完交给缓存，不用注册缓冲区
+    job->is_piece = 1;
+    job->peer_fd = -1;
+    diskio_submit(mi->dio, job);
+    return cp;
+}
+
+/**
+ * @brief 读缓存的分片读入完成，发送读入期间到达的请求
+ * @param mi 全局信息
+ * @param job 完成的读盘任务，buf 是整个分片
+ */
+static void
+handle_cache_load(struct MetaInfo *mi, struct DiskJob *job)
+{
+    struct CachedPiece *cp = mi->read_cache->pieces[job->index];
+    if (job->result == -1) {
+        err("failed to load piece %u into the read cache", job->index);
+        readcache_drop(mi->read_cache, cp);
+        return;
+    }
+
+    cp->data = job->buf;
+    job->buf = NULL;
+    cp->is_loading = 0;
+    while (cp->waiters != NULL) {
+        struct CacheWaiter *w = cp->waiters;
+        struct Peer *peer = get_peer_by_fd(mi, w->peer_fd);
+        if (peer != NULL && memcmp(peer->peer_id, w->peer_id, HASH_SIZE) == 0) {
+            send_piece_msg(peer->fd, cp->index, w->begin, cp->data + w->begin, w->length);
+        }
+        cp->waiters = w->next;
+        free(w);
+    }
+    cp->waiters_tail = &cp->waiters;
+}
+
+/**
+ * @brief 把读出的子分片作为 PIECE 消息发给请求它的 peer
+ *
+ * 读盘期间 peer 可能已经断开，套接字甚至可能被新的连接复用，
+ * 所以按套接字找到 peer 后还要核对 peer_id.
+ *
+ * @param mi 全局信息
+ * @param job 完成的读盘任务，buf 是预先构造好的 PIECE 消息
+ */
+static void
+handle_read(struct MetaInfo *mi, struct DiskJob *job)
+{
+    if (job->is_piece) {
+        handle_cache_load(mi, job);
+        return;
+    }
+
+    struct Peer *peer = get_peer_by_fd(mi, job->peer_fd);
+    if (peer == NULL || memcmp(peer->peer_id, job->peer_id, HASH_SIZE) != 0) {
+        log("requester of piece %u begin %u has gone", job->index, job->begin);
+        return;
+    }
+    if (job->result == -1) {
+        err("index %u begin %u length %zu is not feasible", job->index, job->begin, job->length);
+        return;
+    }
+
+    struct PeerMsg *response = (struct PeerMsg *)job->buf;
+    if (write(peer->fd, response, 4 + 9 + job->length) < 4 + 9 + job->length) {
+        err("damn");
+    }
+}
+
+/**
+ * @brief 取一个空管道，没有空闲的就新建一个
+ *
+ * 工作线程把整个子分片移入管道之后事件循环才会取出，
+ * 所以管道容量必须放得下 SPLICE_PIPE_SIZE 字节。
+ *
+ * @param pfd [OUT] 管道的读端和写端
+ * @return 成功返回 0, 失败返回 -1
+ */
+static int
+get_pipe(int pfd[2])
+{
+    if (nr_spare_pipes > 0) {
+        nr_spare_pipes--;
+        pfd[0] = spare_pipes[nr_spare_pipes][0];
+        pfd[1] = spare_pipes[nr_spare_pipes][1];
+        return 0;
+    }
+    if (pipe2(pfd, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return -1;
+    }
+    if (fcntl(pfd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE) < SPLICE_PIPE_SIZE) {
+        close(pfd[0]);
+        close(pfd[1]);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 归还管道，管道里还有数据时关闭
+ * @param pfd 管道的读端和写端
+ * @param is_empty 管道是否已经取空
+ */
+static void
+put_pipe(int pfd[2], int is_empty)
+{
+    if (is_empty && nr_spare_pipes < MAX_SPARE_PIPES) {
+        spare_pipes[nr_spare_pipes][0] = pfd[0];
+        spare_pipes[nr_spare_pipes][1] = pfd[1];
+        nr_spare_pipes++;
+        return;
+    }
+    close(pfd[0]);
+    close(pfd[1]);
+}
+
+/**
+ * @brief 把工作线程移入管道的子分片作为 PIECE 消息发给请求它的 peer
+ *
+ * 数据从管道直接移到套接字，不经过用户空间。
+ *
+ * @param mi 全局信息
+ * @param job 完成的 DISK_SPLICE 任务
+ */
+static void
+handle_splice(struct MetaInfo *mi, struct DiskJob *job)
+{
+    size_t left = job->length;
+    struct Peer *peer = get_peer_by_fd(mi, job->peer_fd);
+    if (peer == NULL || memcmp(peer->peer_id, job->peer_id, HASH_SIZE) != 0) {
+        log("requester of piece %u begin %u has gone", job->index, job->begin);
+    }
+    else if (job->result == -1) {
+        err("index %u begin %u length %zu is not feasible", job->index, job->begin, job->length);
+    }
+    else {
+        struct PeerMsg header = {
+            .len = htonl(9 + job->length),
+            .id = BT_PIECE,
+            .piece.index = htonl(job->index),
+            .piece.begin = htonl(job->begin),
+        };
+        // MSG_MORE 让报文头和数据合并到同一个 TCP 段
+        if (send(peer->fd, &header, 4 + 9, MSG_MORE) == 4 + 9) {
+            while (left > 0) {
+                ssize_t n = splice(job->pipe[0], NULL, peer->fd, NULL, left, SPLICE_F_MOVE);
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                left -= (size_t)n;
+            }
+        }
+        if (left > 0) {
+            err("damn");
+        }
     }
-    uint8_t md[20];
-    log("idx %d size %u, read %ld", piece_idx, piece_size, nr_read);
-    SHA1(piece, nr_read, md);
-    free(piece);
-    return memcmp(check, md, 20) == 0;
+    put_pipe(job->pipe, left == 0);
 }
 
 /**
  * @brief 处理分片消息
  *
  * 收到分片消息后，期望调用者处理字节序。
- * 会将子分片写入到对应的分片文件中，如果一个子分片已经被写入过，则抛弃。
+ * 子分片通常已经由 place_block() 直接读到了 peer->block, 否则在 msg 中。
+ * 会将子分片交给 store_block() 保存（内存缓冲区或者提交写盘），如果一个子分片已经被写入过，则抛弃。
+ * 子分片完成后，End Game 中正在把同一个子分片直接读入缓冲区的其他 peer 改读到单独的缓冲区，
+ * 以免覆盖已经完成的数据。
+ * 分片还有没写完的子分片时，由最后完成的写盘任务结算分片。
  * 出于简单实现的考虑，子分片采取固定大小，使用位图管理完成进度，
  * 最后一个分片不会在这里进行特殊处理，由发送过程保证最后一个分片长度的正确性。
  *
@@ -311,36 +1297,38 @@ handle_piece(struct MetaInfo *mi, struct Peer *peer, struct PeerMsg *msg)
     int sub_idx = msg->piece.begin / mi->sub_size;
 
     uint32_t dl_size = msg->len - 9;  // 9 是 id, index, begin 的冗余长度。
+    const uint8_t *block = peer->block != NULL ? peer->block : msg->piece.block;
 
-    if (piece->substate[sub_idx] != SUB_FINISH) {
-        fseek(mi->file, msg->piece.index * mi->piece_size + msg->piece.begin, SEEK_SET);
-        fwrite(msg->piece.block, 1, dl_size, mi->file);
-        fflush(mi->file);  // sub piece may not be write back, cause the final race never end.
+    if (piece->substate[sub_idx] != SUB_FINISH && mi->is_v2
+            && !merkle_block(mi, msg->piece.index, sub_idx, block, dl_size)) {
+        // 与经过证明的叶子不符，只重新请求这一个子分片
+        err("piece %d subpiece %d from %s:%d does not match its leaf hash",
+            msg->piece.index, msg->piece.begin, peer->ip, peer->port);
+        piece->substate[sub_idx] = SUB_NA;
+        blame_peer(mi, peer->addr);
+    }
+    else if (piece->substate[sub_idx] != SUB_FINISH) {
+        if (store_block(mi, msg->piece.index, sub_idx, block, dl_size, peer->block_owned ? peer->block : NULL)) {
+            peer->block = NULL;
+            peer->block_owned = 0;
+        }
+        struct Peer *reader;
+        while ((reader = find_block_reader(mi, peer, msg->piece.index, msg->piece.begin)) != NULL) {
+            reader->block = diskio_alloc(mi->dio, reader->msg.len - 9);
+            reader->block_owned = 1;
+        }
+        if (piece->sources == NULL) {
+            piece->sources = calloc(mi->sub_count, sizeof(*piece->sources));
+        }
+        piece->sources[sub_idx] = peer->addr;
         piece->substate[sub_idx] = SUB_FINISH;
         peer->contribution += dl_size;
         mi->downloaded += dl_size;
         mi->left -= dl_size;
         log("downloaded %lu", mi->downloaded);
 
-        if (check_substate(mi, msg->piece.index)) {
-            if (check_piece(mi->file, msg->piece.index, mi->piece_size, piece->hash)) {
-                piece->is_downloaded = 1;
-                set_bit(mi->bitfield, msg->piece.index);
-                // 发送 HAVE 消息
-                struct PeerMsg have_msg = {.len = htonl(5), .have.piece_index = msg->piece.index};
-                for (int i = 0; i < mi->nr_peers; i++) {
-                    if (!peer_get_bit(peer, msg->piece.index)) {
-                        peer_send_msg(peer, &have_msg);
-                        log("send %s %d to %s:%u", bt_types[have_msg.id], have_msg.have.piece_index, peer->ip, peer->port);
-                    }
-                }
-            }
-            else {
-                log("piece %d mismatch", msg->piece.index);
-                memset(piece->substate, SUB_NA, mi->sub_count);
-                mi->left -= (msg->piece.index == mi->nr_pieces - 1) ?(mi->file_size % mi->piece_size) : mi->piece_size;
-                mi->left += dl_size;  // make up the following subtraction
-            }
+        if (check_substate(mi, msg->piece.index) && piece->nr_writes == 0) {
+            finish_piece(mi, msg->piece.index);
         }
     }
     else {
@@ -360,12 +1348,22 @@ handle_piece(struct MetaInfo *mi, struct Peer *peer, struct PeerMsg *msg)
 
 /**
  * @brief Handle request from peer
+ *
+ * A disk worker splices the block from the file into a pipe, so a cold
+ * page cache never stalls the event loop; handle_splice() then sends the
+ * message header and splices the block on to the socket, without a
+ * userspace copy. In mmap mode the block is sent straight from the mapping instead.
+ * With the read cache the whole piece is loaded on the first request and
+ * later requests for it are sent from memory (see readcache.h).
+ * With io_uring, or when the block does not fit in a pipe, the piece message
+ * is built up front and the block is read into it in background,
+ * handle_read() sends it when the read completes.
+ *
  * @param pInfo global information
  * @param pPeer the peer to send piece
  * @param pMsg the request msg
  */
 void handle_request(struct MetaInfo *pInfo, struct Peer *pPeer, struct PeerMsg *pMsg) {
-    FILE *fp = pInfo->file;
     uint32_t piece_size = pInfo->piece_size;
     uint32_t index = pMsg->request.index;
     uint32_t begin = pMsg->request.begin;
@@ -375,28 +1373,380 @@ void handle_request(struct MetaInfo *pInfo, struct Peer *pPeer, struct PeerMsg *
 
     // Check whether we have that piece.
     // If we allow seeking non-existing piece, it might exceed the file boundary.
-    if (!pInfo->pieces[index].is_downloaded) {
+    if (index >= pInfo->nr_pieces || !pInfo->pieces[index].is_downloaded
+            || (size_t)begin + length > piece_length(pInfo, index)) {
         log("give up");
         return;
     }
 
-    // Construct piece message.
-    struct PeerMsg *response = malloc(4 + 9 + length);
-    response->len = htonl(9 + length);
-    response->id = BT_PIECE;
-    response->piece.index = htonl(index);
-    response->piece.begin = htonl(begin);
-    fseek(fp, index * piece_size + begin, SEEK_SET);
-    if (fread(response->piece.block, 1, length, fp) < length) {
-        err("index %u begin %u length %u is not feasible", index, length, length);
+    if (pInfo->map != NULL) {
+        send_piece_msg(pPeer->fd, index, begin, pInfo->map + (size_t)index * piece_size + begin, length);
+        return;
     }
 
-    // Send message
-    if (write(pPeer->fd, response, 4 + 9 + length) < 4 + 9 + length) {
-        err("damn");
+    // 读缓存：未命中时读入整个分片，读入期间同一分片的请求排队等待
+    struct CachedPiece *cp = NULL;
+    if (pInfo->read_cache != NULL && (cp = readcache_get(pInfo->read_cache, index)) == NULL) {
+        cp = load_cached_piece(pInfo, index);
+    }
+    if (cp != NULL && cp->is_loading) {
+        readcache_wait(cp, pPeer->fd, pPeer->peer_id, begin, length);
+        return;
+    }
+    if (cp != NULL) {
+        send_piece_msg(pPeer->fd, index, begin, cp->data + begin, length);
+        return;
+    }
+
+    // Read the block in background
+    struct DiskJob *job = calloc(1, sizeof(*job));
+    job->st = pInfo->storage;
+    job->index = index;
+    job->begin = begin;
+    job->offset = (off_t)index * piece_size + begin;
+    job->length = length;
+    job->peer_fd = pPeer->fd;
+    memcpy(job->peer_id, pPeer->peer_id, HASH_SIZE);
+
+    if ((!diskio_has_uring(pInfo->dio) || pInfo->fd == -1)
+            && length <= SPLICE_PIPE_SIZE && get_pipe(job->pipe) == 0) {
+        job->type = DISK_SPLICE;
+        job->fd = -1;
+    }
+    else {
+        // Construct piece message.
+        struct PeerMsg *response = (struct PeerMsg *)diskio_alloc(pInfo->dio, 4 + 9 + length);
+        response->len = htonl(9 + length);
+        response->id = BT_PIECE;
+        response->piece.index = htonl(index);
+        response->piece.begin = htonl(begin);
+
+        job->type = DISK_READ;
+        job->fd = pInfo->fd;
+        job->buf = (uint8_t *)response;
+        job->head = 4 + 9;
+    }
+    diskio_submit(pInfo->dio, job);
+}
+
+/**
+ * @brief 从分片层计算分片层之上的结点
+ * @param mi 全局信息
+ * @param height 结点高度，不低于 piece_height
+ * @param index 结点在所在层中的下标
+ * @param out [OUT] 结点
+ */
+static void
+layer_node(struct MetaInfo *mi, int height, size_t index, uint8_t *out)
+{
+    int levels = height - mi->piece_height;
+    size_t first = index << levels;
+    size_t n = 0;
+    if (first < mi->nr_pieces) {
+        n = mi->nr_pieces - first < ((size_t)1 << levels) ? mi->nr_pieces - first : ((size_t)1 << levels);
+    }
+    merkle_root(n ? piece_root(mi, first) : NULL, n, mi->piece_height, levels, out);
+}
+
+/**
+ * @brief 回复 HASH REJECT
+ * @param peer 发送请求的 peer
+ * @param msg 请求，网络字节序，改写成回复
+ */
+static void
+send_hash_reject(struct Peer *peer, struct PeerMsg *msg)
+{
+    msg->id = BT_HASH_REJECT;
+    msg->len = htonl(1 + sizeof(msg->hash));
+    peer_send_msg(peer, msg);
+    log("send %s to %s:%u", bt_types[msg->id], peer->ip, peer->port);
+}
+
+/**
+ * @brief 处理 HASH REQUEST 消息
+ *
+ * 只提供叶子层：请求覆盖的分片必须都已完成，叶子由磁盘线程池读出后现算，
+ * 算完后由 handle_hash_leaves() 回复。不能满足时回复 HASH REJECT.
+ *
+ * @param mi 全局信息
+ * @param peer 发送请求的 peer
+ * @param msg 请求，网络字节序
+ */
+static void
+handle_hash_request(struct MetaInfo *mi, struct Peer *peer, struct PeerMsg *msg)
+{
+    uint32_t base = ntohl(msg->hash.base_layer);
+    uint32_t first = ntohl(msg->hash.index);
+    uint32_t length = ntohl(msg->hash.length);
+    uint32_t proof = ntohl(msg->hash.proof_layers);
+    int height = mi->piece_height;
+    int sub_height = merkle_log2(length);
+
+    log("%s:%u hash request index %u length %u proof %u", peer->ip, peer->port, first, length, proof);
+
+    int is_valid = mi->is_v2 && base == 0
+        && memcmp(msg->hash.pieces_root, mi->pieces_root, MERKLE_HASH_SIZE) == 0
+        && length >= 2 && length <= MAX_HASHES && (length & (length - 1)) == 0 && first % length == 0
+        && (int)proof >= sub_height && (int)proof <= height + merkle_log2(mi->nr_pieces)
+        && (first >> height) < mi->nr_pieces;
+
+    // 请求覆盖的分片
+    size_t first_piece = first >> height;
+    size_t last_piece = ((size_t)first + length - 1) >> height;
+    for (size_t i = first_piece; is_valid && i <= last_piece && i < mi->nr_pieces; i++) {
+        is_valid = mi->pieces[i].is_downloaded;
+    }
+
+    if (!is_valid) {
+        send_hash_reject(peer, msg);
+        return;
+    }
+
+    // 请求报文放在 buf 开头，其后是覆盖的分片的全部叶子，文件末尾之后的由 handle_hash_leaves() 补齐
+    size_t end_piece = last_piece < mi->nr_pieces ? last_piece + 1 : mi->nr_pieces;
+    size_t size = (end_piece - 1 - first_piece) * mi->piece_size + piece_length(mi, end_piece - 1);
+    struct DiskJob *job = new_digest_job(mi, (uint32_t)first_piece, size, NULL);
+    job->block = MERKLE_BLOCK_SIZE;
+    job->md_size = MERKLE_HASH_SIZE;
+    job->digest = merkle_leaf;
+    job->head = 4 + 1 + sizeof(msg->hash);
+    job->buf = malloc(job->head + ((last_piece - first_piece + 1) << height) * MERKLE_HASH_SIZE);
+    memcpy(job->buf, msg, job->head);
+    job->peer_fd = peer->fd;
+    memcpy(job->peer_id, peer->peer_id, HASH_SIZE);
+    diskio_submit(mi->dio, job);
+}
+
+/**
+ * @brief 用算好的叶子回复 HASH REQUEST
+ *
+ * uncle 在分片内的部分由叶子归约，在分片层之上的部分由分片层归约。
+ * 读取出错时回复 HASH REJECT.
+ *
+ * @param mi 全局信息
+ * @param job 完成的摘要任务，buf 开头是请求报文
+ */
+static void
+handle_hash_leaves(struct MetaInfo *mi, struct DiskJob *job)
+{
+    struct PeerMsg *msg = (struct PeerMsg *)job->buf;
+    uint32_t first = ntohl(msg->hash.index);
+    uint32_t length = ntohl(msg->hash.length);
+    uint32_t proof = ntohl(msg->hash.proof_layers);
+    int height = mi->piece_height;
+    int sub_height = merkle_log2(length);
+    size_t first_piece = first >> height;
+    size_t last_piece = ((size_t)first + length - 1) >> height;
+
+    struct Peer *peer = get_peer_by_fd(mi, job->peer_fd);
+    if (peer == NULL || memcmp(peer->peer_id, job->peer_id, HASH_SIZE) != 0) {
+        log("requester of hashes index %u length %u has gone", first, length);
+        return;
+    }
+    if (job->result == -1) {
+        err("failed to read pieces %lu-%lu for hashes", first_piece, last_piece);
+        send_hash_reject(peer, msg);
+        return;
+    }
+
+    uint8_t *leaves = job->buf + job->head;
+    size_t nr_leaves = (last_piece - first_piece + 1) << height;
+    for (size_t j = (job->length - 1) / MERKLE_BLOCK_SIZE + 1; j < nr_leaves; j++) {
+        memcpy(leaves + j * MERKLE_HASH_SIZE, merkle_zero(0), MERKLE_HASH_SIZE);
+    }
+
+    size_t nr_uncles = proof - sub_height;
+    size_t payload = 1 + sizeof(msg->hash) + (length + nr_uncles) * MERKLE_HASH_SIZE;
+    struct PeerMsg *reply = malloc(4 + payload);
+    reply->len = htonl((uint32_t)payload);
+    reply->id = BT_HASHES;
+    memcpy(&reply->hash, &msg->hash, sizeof(msg->hash));
+    memcpy(reply->hash.hashes, leaves + (first - (first_piece << height)) * MERKLE_HASH_SIZE,
+           length * MERKLE_HASH_SIZE);
+
+    // uncle 自底向上
+    for (int h = sub_height; h < (int)proof; h++) {
+        size_t sibling = (first >> h) ^ 1;
+        uint8_t *out = reply->hash.hashes + (length + h - sub_height) * MERKLE_HASH_SIZE;
+        if (h < height) {  // 请求在一个分片之内，兄弟结点也是
+            merkle_root(leaves + ((sibling << h) - (first_piece << height)) * MERKLE_HASH_SIZE,
+                        (size_t)1 << h, 0, h, out);
+        }
+        else {
+            layer_node(mi, h, sibling, out);
+        }
+    }
+
+    peer_send_msg(peer, reply);
+    log("send %s [index %u length %u uncles %lu] to %s:%u",
+        bt_types[reply->id], first, length, nr_uncles, peer->ip, peer->port);
+    free(reply);
+}
+
+/**
+ * @brief 取回并处理磁盘线程池完成的任务
+ * @param mi 全局信息
+ */
+static void
+handle_disk_completion(struct MetaInfo *mi)
+{
+    struct DiskJob *job = diskio_reap(mi->dio);
+    while (job) {
+        struct DiskJob *next = job->next;
+        switch (job->type) {
+        case DISK_VERIFY:
+            handle_verified(mi, job->index, job->result);
+            break;
+        case DISK_READ:
+            handle_read(mi, job);
+            break;
+        case DISK_WRITE:
+            handle_written(mi, job);
+            break;
+        case DISK_SPLICE:
+            handle_splice(mi, job);
+            break;
+        case DISK_DIGEST:
+            if (job->is_piece) {
+                handle_blame(mi, job);
+            }
+            else {
+                handle_hash_leaves(mi, job);
+            }
+            break;
+        default:
+            err("unexpected disk job type %d", job->type);
+            break;
+        }
+        diskio_release(mi->dio, job);
+        job = next;
+    }
+}
+
+/**
+ * @brief 处理 HASHES 消息
+ *
+ * 只接受 send_hash_request() 请求过的形式：叶子层，分片之内，证明到分片层。
+ * 证明通过后记下期望叶子，已经写入的子分片立即比较，不符的丢弃重新请求。
+ * 根不符而等待叶子的分片如果没有找到坏的子分片，只能整片重新下载。
+ *
+ * @param mi 全局信息
+ * @param peer 发送消息的 peer
+ * @param msg 消息，网络字节序
+ */
+static void
+handle_hashes(struct MetaInfo *mi, struct Peer *peer, struct PeerMsg *msg)
+{
+    uint32_t first = ntohl(msg->hash.index);
+    uint32_t length = ntohl(msg->hash.length);
+    uint32_t proof = ntohl(msg->hash.proof_layers);
+    int height = mi->piece_height;
+    int sub_height = merkle_log2(length);
+    uint32_t index = first >> height;
+
+    if (!mi->is_v2 || ntohl(msg->hash.base_layer) != 0
+            || memcmp(msg->hash.pieces_root, mi->pieces_root, MERKLE_HASH_SIZE) != 0
+            || length == 0 || (length & (length - 1)) != 0 || length > ((size_t)1 << height)
+            || first % length != 0 || index >= mi->nr_pieces || (int)proof != height
+            || msg->len != 1 + sizeof(msg->hash) + (length + proof - sub_height) * MERKLE_HASH_SIZE) {
+        err("unexpected %s from %s:%u", bt_types[msg->id], peer->ip, peer->port);
+        return;
+    }
+
+    struct PieceInfo *piece = &mi->pieces[index];
+    struct PieceMerkle *merkle = piece->merkle;
+    if (piece->is_downloaded || merkle == NULL) {
+        log("piece %u is no longer in progress", index);
+        return;
+    }
+    if (merkle->nr_requested > 0) {
+        merkle->nr_requested--;
+    }
+
+    uint8_t node[MERKLE_HASH_SIZE];
+    merkle_root(msg->hash.hashes, length, 0, sub_height, node);
+    merkle_climb(node, first >> sub_height, msg->hash.hashes + length * MERKLE_HASH_SIZE,
+                 height - sub_height, node);
+    if (memcmp(node, piece_root(mi, index), MERKLE_HASH_SIZE) != 0) {
+        err("%s:%u sent leaves that do not prove piece %u", peer->ip, peer->port, index);
+        if (merkle->failed_ticks && merkle->nr_requested == 0) {
+            handle_verified(mi, index, 0);
+        }
+        return;
+    }
+
+    size_t sub_cnt = (piece_length(mi, index) - 1) / mi->sub_size + 1;
+    size_t offset = first - ((size_t)index << height);
+    int nr_bad = 0;
+    for (size_t j = offset; j < offset + length && j < sub_cnt; j++) {
+        uint8_t *want = merkle->want + j * MERKLE_HASH_SIZE;
+        memcpy(want, msg->hash.hashes + (j - offset) * MERKLE_HASH_SIZE, MERKLE_HASH_SIZE);
+        merkle->flags[j] |= LEAF_WANT;
+        if ((merkle->flags[j] & LEAF_GOT) && memcmp(merkle->got + j * MERKLE_HASH_SIZE, want, MERKLE_HASH_SIZE) != 0) {
+            drop_block(mi, index, j);
+            nr_bad++;
+        }
+    }
+    log("piece %u: %u leaves proved, %d subpieces dropped", index, length, nr_bad);
+
+    if (merkle->failed_ticks && nr_bad > 0) {
+        merkle->failed_ticks = 0;
+    }
+    else if (merkle->failed_ticks && merkle->nr_requested == 0) {
+        handle_verified(mi, index, 0);
+    }
+}
+
+/**
+ * @brief 处理 HASH REJECT 消息，等待叶子的分片整片重新下载
+ * @param mi 全局信息
+ * @param peer 发送消息的 peer
+ * @param msg 消息，网络字节序
+ */
+static void
+handle_hash_reject(struct MetaInfo *mi, struct Peer *peer, struct PeerMsg *msg)
+{
+    uint32_t index = ntohl(msg->hash.index) >> mi->piece_height;
+    if (!mi->is_v2 || index >= mi->nr_pieces || mi->pieces[index].merkle == NULL) {
+        return;
+    }
+
+    struct PieceMerkle *merkle = mi->pieces[index].merkle;
+    if (merkle->nr_requested > 0) {
+        merkle->nr_requested--;
+    }
+    log("%s:%u rejected hash request for piece %u", peer->ip, peer->port, index);
+
+    if (merkle->failed_ticks && merkle->nr_requested == 0) {
+        handle_verified(mi, index, 0);
     }
+}
 
-    free(response);
+/**
+ * @brief 定时检查 v2 分片的叶子请求
+ *
+ * 请求可能因为 peer 断开而永远没有回应：没有失败的分片清除请求计数，
+ * 以便之后重新请求；根不符之后等过一个完整的定时周期仍没有定位到
+ * 坏的子分片，就整片重新下载。
+ *
+ * @param mi 全局信息
+ */
+static void
+expire_hash_requests(struct MetaInfo *mi)
+{
+    for (size_t i = 0; i < mi->nr_pieces; i++) {
+        struct PieceMerkle *merkle = mi->pieces[i].merkle;
+        if (merkle == NULL) {
+            continue;
+        }
+        if (merkle->failed_ticks == 0) {
+            merkle->nr_requested = 0;
+        }
+        else if (++merkle->failed_ticks > 2) {
+            log("piece %u: no leaves arrived in time", (uint32_t)i);
+            handle_verified(mi, (uint32_t)i, 0);
+        }
+    }
 }
 
 /**
@@ -413,8 +1763,20 @@ handle_msg(struct MetaInfo *mi, struct Peer *peer, struct PeerMsg *msg)
         return;
     }
 
+    if (msg->id >= NR_BT_TYPES || bt_types[msg->id] == NULL) {
+        log("recv unknown msg %u from %s:%d", msg->id, peer->ip, peer->port);
+        return;
+    }
+
     log("recv %s msg from %s:%d", bt_types[msg->id], peer->ip, peer->port);
 
+    // 默克尔树消息的定长部分
+    if ((msg->id == BT_HASH_REQUEST || msg->id == BT_HASHES || msg->id == BT_HASH_REJECT)
+            && msg->len < 1 + sizeof(msg->hash)) {
+        err("truncated %s from %s:%d", bt_types[msg->id], peer->ip, peer->port);
+        return;
+    }
+
     switch (msg->id) {
     case BT_BITFIELD:
         print_bit(msg->bitfield, mi->nr_pieces);
@@ -461,73 +1823,39 @@ handle_msg(struct MetaInfo *mi, struct Peer *peer, struct PeerMsg *msg)
     case BT_CANCEL:
         /// @todo 处理 CANCEL 消息
         break;
+    case BT_HASH_REQUEST:
+        handle_hash_request(mi, peer, msg);
+        break;
+    case BT_HASHES:
+        handle_hashes(mi, peer, msg);
+        break;
+    case BT_HASH_REJECT:
+        handle_hash_reject(mi, peer, msg);
+        break;
     default:
         break;
     }
 }
 
 /**
- * @brief 处理 tracker 响应的 HTTP 报文，将解析后的语法树返回给上层使用，在内部关闭套接字
+ * @brief peer_recv() 的报文处理函数，见 MsgHandler
  *
- * 考虑到 tracker 的响应数据量不大，内部全部使用 recv + MSG_WAITALL 防止 read 读取不足。
+ * 处理完 PIECE 报文后释放没有被转交的子分片缓冲区。
  *
- * @param sfd 与 tracker 的连接套接字
- * @return 解析后的语法树，非法时返回 NULL
+ * @param peer 发送报文的 peer
+ * @param msg 完整的报文
+ * @param arg 全局信息
  */
-struct BNode *
-handle_tracker_response(int sfd)
+static void
+dispatch_msg(struct Peer *peer, struct PeerMsg *msg, void *arg)
 {
-    // 解析 HTTP 响应报文
-    char response[BUF_SIZE] = { 0 };
-    char *curr = response;
-    size_t size = 0;
-    int is_html = 0;
-    while (recv(sfd, curr, 1, MSG_WAITALL) == 1) {
-        if (*curr++ != '\n') {
-            continue;
-        }
-
-        printf("%s", response);
-
-#define CONTENT_LENGTH "Content-Length"
-#define CONTENT_TYPE "Content-Type"
-        if (!strncmp(response, CONTENT_LENGTH, sizeof(CONTENT_LENGTH) - 1)) {
-            size = strtoul(response + 16, NULL, 10);
-        }
-        else if (!strncmp(response, CONTENT_TYPE, sizeof(CONTENT_TYPE) - 1)) {
-            if (strstr(response, "text/html") != NULL) {
-                is_html = 1;
-            }
-        }
-        else if (!strcmp(response, "\r\n")) {
-            break;
-        }
-
-        // Reset
-        memset(response, 0, sizeof(response));
-        curr = response;
-    }
-
-    if (size == 0) {
-        return NULL;
-    }
-
-    char *data = malloc(size);
-    if (recv(sfd, data, size, MSG_WAITALL) < size) {
-        perror("read");
-    }
-
-    struct BNode *bcode = NULL;
-    if (is_html) {
-        printf("%s", data);
-    }
-    else {
-        bcode = bparser(data);
+    struct MetaInfo *mi = arg;
+    handle_msg(mi, peer, msg);
+    if (peer->block_owned) {
+        diskio_free_buf(mi->dio, peer->block);
+        peer->block = NULL;
+        peer->block_owned = 0;
     }
-
-    free(data);
-
-    return bcode;
 }
 
 /**
@@ -538,9 +1866,9 @@ handle_tracker_response(int sfd)
  * @param bcode B 编码数据
  */
 void
-handle_peer_list(struct MetaInfo *mi, int efd, struct BNode *bcode)
+handle_peer_list(struct MetaInfo *mi, int efd, const struct BNode *bcode)
 {
-    const struct BNode *peers = query_bcode_by_key(bcode, "peers");
+    const struct BNode *peers = query_bcode_by_path(bcode, "peers");
 
     if (peers == NULL) {
         log("no peers are found");
@@ -563,6 +1891,11 @@ handle_peer_list(struct MetaInfo *mi, int efd, struct BNode *bcode)
         // peer-id 检查。
         //--------------------------------------------
 
+        if (is_banned(mi, p->addr)) {
+            log("skip banned peer %d.%d.%d.%d:%d", p->ip[0], p->ip[1], p->ip[2], p->ip[3], ntohs(p->port));
+            continue;
+        }
+
         if (get_peer_by_addr(mi, p->addr, p->port) != NULL) {
             log("already handshaked with peer %d.%d.%d.%d:%d", p->ip[0], p->ip[1], p->ip[2], p->ip[3], ntohs(p->port));
             continue;
@@ -597,9 +1930,9 @@ handle_peer_list(struct MetaInfo *mi, int efd, struct BNode *bcode)
  * @param efd epoll file descriptor，用于加入 timer fd
  */
 void
-handle_interval(struct Tracker *tracker, struct BNode *bcode, int efd)
+handle_interval(struct Tracker *tracker, const struct BNode *bcode, int efd)
 {
-    const struct BNode *interval = query_bcode_by_key(bcode, "interval");
+    const struct BNode *interval = query_bcode_by_path(bcode, "interval");
     if (interval == NULL) {
         fprintf(stderr, "interval not found\n");
         return;
@@ -628,6 +1961,169 @@ handle_interval(struct Tracker *tracker, struct BNode *bcode, int efd)
     epoll_ctl(efd, EPOLL_CTL_ADD, tracker->timerfd, &ev);
 }
 
+/**
+ * @brief tracker 响应的最大长度
+ */
+#define REPLY_MAX (1 << 20)
+
+/**
+ * @brief 一个 tracker 的 HTTP 响应的接收状态
+ *
+ * 响应报文随着 EPOLLIN 事件分段到达。头部累积在 header 中直到遇到空行，
+ * 之后的报文体交给流式 parser, 不需要事先读满 Content-Length.
+ */
+struct TrackerReply
+{
+    char header[BUF_SIZE];   ///< 尚未结束的响应头
+    size_t header_size;      ///< header 中的字节数
+    int is_body;             ///< 是否已经进入报文体
+    int is_html;             ///< 报文体是 HTML（通常是错误页面），只打印
+    size_t content_length;   ///< Content-Length, 0 表示未知
+    size_t body_size;        ///< 已收到的报文体字节数
+    struct BStream *bs;      ///< 报文体的流式 parser
+};
+
+void
+free_tracker_reply(struct Tracker *tracker)
+{
+    if (tracker->reply) {
+        bstream_free(&tracker->reply->bs);
+        free(tracker->reply);
+        tracker->reply = NULL;
+    }
+}
+
+/**
+ * @brief 解析完整的 HTTP 响应头
+ * @param reply 响应接收状态，header 以空行结尾
+ */
+static void
+parse_reply_header(struct TrackerReply *reply)
+{
+#define CONTENT_LENGTH "Content-Length:"
+#define CONTENT_TYPE "Content-Type:"
+    char *line = reply->header;
+    char *eol;
+    while ((eol = strstr(line, "\r\n")) != NULL && eol != line) {
+        *eol = '\0';
+        printf("%s\n", line);
+        if (!strncasecmp(line, CONTENT_LENGTH, sizeof(CONTENT_LENGTH) - 1)) {
+            reply->content_length = strtoul(line + sizeof(CONTENT_LENGTH) - 1, NULL, 10);
+        }
+        else if (!strncasecmp(line, CONTENT_TYPE, sizeof(CONTENT_TYPE) - 1)) {
+            if (strstr(line, "text/html") != NULL) {
+                reply->is_html = 1;
+            }
+        }
+        line = eol + 2;
+    }
+}
+
+/**
+ * @brief 处理一段报文体
+ * @param reply 响应接收状态
+ * @param data 报文体片段
+ * @param size 片段长度
+ * @return 报文体接收完毕返回 1, 否则返回 0
+ */
+static int
+feed_reply_body(struct TrackerReply *reply, const char *data, size_t size)
+{
+    reply->body_size += size;
+    if (reply->is_html) {
+        printf("%.*s", (int)size, data);
+        return reply->content_length != 0 && reply->body_size >= reply->content_length;
+    }
+    return bstream_feed(reply->bs, data, size) != BSTREAM_PARTIAL;
+}
+
+/**
+ * @brief 接收 tracker 的 HTTP 响应，完整后处理其中的 peers 和 interval
+ *
+ * 套接字可读时调用，一次读完当前可读的数据而不阻塞。
+ * 响应头逐段累积，报文体交给流式 parser 边到边解析，
+ * 响应完整（或出错、连接关闭）之前保留接收状态，等待下一次 EPOLLIN.
+ *
+ * @param mi 全局信息
+ * @param tracker 发送响应的 tracker
+ * @param efd epoll 描述符
+ * @return 响应处理结束（不论成败）返回 1, 调用者应关闭连接；还需等待数据返回 0
+ */
+int
+handle_tracker_response(struct MetaInfo *mi, struct Tracker *tracker, int efd)
+{
+    if (tracker->reply == NULL) {
+        tracker->reply = calloc(1, sizeof(*tracker->reply));
+        tracker->reply->bs = bstream_new(REPLY_MAX);
+    }
+
+    struct TrackerReply *reply = tracker->reply;
+    int is_done = 0;
+    char buf[BUF_SIZE];
+    ssize_t n;
+
+    while (!is_done && (n = recv(tracker->sfd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        if (reply->is_body) {
+            is_done = feed_reply_body(reply, buf, (size_t)n);
+            continue;
+        }
+
+        // 累积响应头，头部和报文体可能在同一段数据里
+        size_t room = sizeof(reply->header) - 1 - reply->header_size;
+        size_t copied = (size_t)n < room ? (size_t)n : room;
+        memcpy(reply->header + reply->header_size, buf, copied);
+        size_t old_size = reply->header_size;
+        reply->header_size += copied;
+        reply->header[reply->header_size] = '\0';
+
+        char *blank = strstr(reply->header, "\r\n\r\n");
+        if (blank == NULL) {
+            if (reply->header_size == sizeof(reply->header) - 1) {
+                err("tracker %s: response header too long", tracker->host);
+                is_done = 1;
+            }
+            continue;
+        }
+
+        reply->is_body = 1;
+        size_t header_len = (size_t)(blank + 4 - reply->header);
+        blank[2] = '\0';  // 保留最后一行的 \r\n 以便逐行切分
+        parse_reply_header(reply);
+
+        size_t body_off = header_len - old_size;  // 报文体在 buf 中的起始位置
+        if (body_off < (size_t)n) {
+            is_done = feed_reply_body(reply, buf + body_off, (size_t)n - body_off);
+        }
+    }
+
+    if (!is_done) {
+        if (n == 0) {
+            log("tracker %s closed the connection", tracker->host);
+            is_done = 1;
+        }
+        else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("recv tracker response");
+            is_done = 1;
+        }
+        else {
+            return 0;
+        }
+    }
+
+    const struct BNode *bcode = bstream_tree(reply->bs);
+    if (bcode != NULL) {
+        print_bcode(bcode, 0, 0);
+        handle_peer_list(mi, efd, bcode);
+        handle_interval(tracker, bcode, efd);
+    }
+    else if (!reply->is_html) {
+        err("tracker %s: incomplete or malformed response", tracker->host);
+    }
+
+    free_tracker_reply(tracker);
+    return 1;
+}
+
 /**
  * @brief 处理出错套接字
  *
@@ -655,6 +2151,7 @@ handle_error(struct MetaInfo *mi, int error_fd)
     if ((tracker = get_tracker_by_fd(mi, error_fd)) != NULL) {
         // tracker 列表不需要修改，无法连接的 tracker 留在列表里不会产生冲突。
         err("%s:%s%s: %s", tracker->host, tracker->port, tracker->request, strerror(result));
+        free_tracker_reply(tracker);
     }
     else if ((peer = get_peer_by_fd(mi, error_fd)) != NULL) {
         err("rm peer %s:%u: %s", peer->ip, peer->port, strerror(result));
@@ -763,6 +2260,13 @@ finish_handshake(struct MetaInfo *mi, int sfd)
         return -1;
     }
 
+    // 拒绝多次发送坏数据的 peer
+    if (is_banned(mi, p.addr)) {
+        log("reject banned peer %u.%u.%u.%u", p.ip[0], p.ip[1], p.ip[2], p.ip[3]);
+        close(sfd);
+        return -1;
+    }
+
     // 防止和已有 peer 重复
     for (int i = 0; i < mi->nr_peers; i++) {
         if (memcmp(hs->hs_peer_id, mi->peers[i]->peer_id, HASH_SIZE) == 0) {
@@ -775,6 +2279,7 @@ finish_handshake(struct MetaInfo *mi, int sfd)
 
     struct Peer *peer = peer_new(sfd, mi->nr_pieces);
     memcpy(peer->peer_id, hs->hs_peer_id, HASH_SIZE);
+    peer->is_v2 = mi->is_v2 && (hs->hs_reserved[HS_V2_BYTE] & HS_V2_MASK);
     add_peer(mi, peer);
 
     log("handshaked with %u.%u.%u.%u:%u",
@@ -838,6 +2343,40 @@ void handle_coming_peer(struct MetaInfo *mi, struct epoll_event *ev, int efd)
     epoll_ctl(efd, EPOLL_CTL_ADD, fd, ev);
 }
 
+/**
+ * @brief 断开所有被拒绝的 peer
+ *
+ * 坏数据的来源可能在处理别的 peer 的报文时才被确定，所以在每一轮事件之后统一断开。
+ * 它正在下载的子分片退回未下载状态。
+ *
+ * @param mi 全局信息
+ * @param efd epoll 描述符
+ */
+static void
+drop_banned_peers(struct MetaInfo *mi, int efd)
+{
+    int i = 0;
+    while (i < mi->nr_peers) {
+        struct Peer *peer = mi->peers[i];
+        if (!peer->is_banned) {
+            i++;
+            continue;
+        }
+
+        log("disconnect banned peer %s:%u", peer->ip, peer->port);
+        if (peer->requesting_index != -1) {
+            unsigned char *state = &mi->pieces[peer->requesting_index].substate[peer->requesting_begin / mi->sub_size];
+            if (*state == SUB_DOWNLOAD) {
+                *state = SUB_NA;
+            }
+        }
+        int fd = peer->fd;
+        epoll_ctl(efd, EPOLL_CTL_DEL, fd, NULL);
+        close(fd);
+        del_peer_by_fd(mi, fd);
+    }
+}
+
 /**
  * @brief 处理所有网络报文
  *
@@ -847,6 +2386,7 @@ void handle_coming_peer(struct MetaInfo *mi, struct epoll_event *ev, int efd)
  * 2. 与 peer 的连接套接字
  * 3. tracker 的回访定时器
  * 4. 本机的 keep-alive 定时器
+ * 5. 磁盘线程池的完成通知 eventfd
  *
  * 目前只对 peer 的 bt 消息做异步接受，其他报文基本要求同步地完全接受。
  *
@@ -866,6 +2406,7 @@ bt_handler(struct MetaInfo *mi, int efd)
     struct epoll_event *events = calloc(100, sizeof(*events));
     int end_game = 0;
     while (1) {
+        diskio_flush(mi->dio);  // 本轮攒下的读写一次提交
         int n = epoll_wait(efd, events, 100, -1);  // 超时限制 5s
 
         // 处理接收逻辑
@@ -917,11 +2458,9 @@ bt_handler(struct MetaInfo *mi, int efd)
 
             // 处理 BT 消息
             if ((peer = get_peer_by_fd(mi, ev->data.fd)) != NULL) {
-                // 虽然有多个 BT 报文凑到一个 TCP 报文段里的情况, 但是这里只处理一个报文.
-                // 由于报文变长, 所以要注意保持数据的一致性.
+                // peer 的套接字是边沿触发的，一次读空，其中所有完整的报文一起处理
                 log("handling %s:%u :", peer->ip, peer->port);
-                struct PeerMsg *msg = peer_get_packet(peer);
-                if (msg == NULL) {
+                if (peer_recv(peer, dispatch_msg, place_block, mi) == -1) {
                     log("remove peer %s:%d", peer->ip, peer->port);
                     epoll_ctl(efd, EPOLL_CTL_DEL, ev->data.fd, NULL);
                     close(peer->fd);
@@ -930,15 +2469,17 @@ bt_handler(struct MetaInfo *mi, int efd)
                     // 再次修改会导致不一致。
                     del_peer_by_fd(mi, peer->fd);
                 }
-                else if (peer->wanted == 0) {  // 读取了完整的 BT 消息
-                    handle_msg(mi, peer, msg);
-                    free(msg);
-                }
 
                 continue;
             }
 
-            // 定时事件：发送 KEEP ALIVE
+            // 后台磁盘任务完成
+            if (ev->data.fd == diskio_eventfd(mi->dio)) {
+                handle_disk_completion(mi);
+                continue;
+            }
+
+            // 定时事件：发送 KEEP ALIVE, 顺便保存续传文件、清理没有回应的叶子请求、报告读缓存的命中率
             if (ev->data.fd == mi->timerfd) {
                 log("keep-alive");
                 uint64_t expiration;
@@ -947,6 +2488,17 @@ bt_handler(struct MetaInfo *mi, int efd)
                 for (int k = 0; k < mi->nr_peers; k++) {
                     write(mi->peers[k]->fd, &len, 4);
                 }
+                if (mi->left != 0) {
+                    resume_save(mi);
+                }
+                if (mi->is_v2) {
+                    expire_hash_requests(mi);
+                }
+                if (mi->read_cache != NULL) {
+                    struct ReadCache *rc = mi->read_cache;
+                    log("read cache: %lu hits, %lu misses, %lu / %lu bytes",
+                        rc->hits, rc->misses, rc->used, rc->budget);
+                }
 
                 continue;
             }
@@ -960,16 +2512,11 @@ bt_handler(struct MetaInfo *mi, int efd)
             // tracker 的响应
             if ((tracker = get_tracker_by_fd(mi, ev->data.fd)) != NULL) {
                 log("handle tracker response");
-                struct BNode *bcode = handle_tracker_response(tracker->sfd);
-                if (bcode != NULL) {
-                    print_bcode(bcode, 0, 0);
-                    handle_peer_list(mi, efd, bcode);
-                    handle_interval(tracker, bcode, efd);
-                    free_bnode(&bcode);
+                if (handle_tracker_response(mi, tracker, efd)) {
+                    epoll_ctl(efd, EPOLL_CTL_DEL, tracker->sfd, NULL);
+                    close(tracker->sfd);  // tracker 的连接只用一次
+                    tracker->sfd = -1;
                 }
-                epoll_ctl(efd, EPOLL_CTL_DEL, tracker->sfd, NULL);
-                close(tracker->sfd);  // tracker 的连接只用一次
-                tracker->sfd = -1;
 
                 continue;
             }
@@ -991,8 +2538,16 @@ bt_handler(struct MetaInfo *mi, int efd)
                 // 连接已断开，没有必要再侦听
                 epoll_ctl(efd, EPOLL_CTL_DEL, ev->data.fd, NULL);
             }
+            else if (get_peer_by_fd(mi, ev->data.fd) != NULL) {
+                // 握手完成，之后的 BT 报文由 peer_recv() 读空套接字，改为边沿触发；
+                // 已经到达的数据会立即触发一次事件
+                ev->events = EPOLLIN | EPOLLET;
+                epoll_ctl(efd, EPOLL_CTL_MOD, ev->data.fd, ev);
+            }
         }
 
+        drop_banned_peers(mi, efd);
+
         // 处理发送逻辑
         if (end_game != 2 && mi->left != 0) {
             int ret = select_piece(mi, end_game);
@@ -6,6 +6,7 @@
 #include "bparser.h"
 #include "util.h"
 #include <string.h>
+#include <assert.h>
 
 #define DELIM     ':'  ///< 长度与字节串的分割符
 #define LEAD_INT  'i'  ///< 整型结点的起始字符
@@ -13,6 +14,8 @@
 #define LEAD_DICT 'd'  ///< 字典结点的起始字符
 #define END       'e'  ///< 非串结点的终止字符
 
+#define BUF_INIT  1024 ///< 流式 parser 缓冲区的初始容量
+
 /**
  * @brief parser 状态
  *
@@ -20,32 +23,82 @@
  */
 struct State
 {
-    char *start;  ///< 源缓冲区起始地址
-    char *curr;   ///< 解析的当前地址
+    char *start;          ///< 源缓冲区起始地址
+    char *curr;           ///< 解析的当前地址
+    char *end;            ///< 源缓冲区结束地址，仅预扫描使用
+    struct BNode *arena;  ///< 预分配的结点池，NULL 表示逐个动态分配
+    size_t nr_used;       ///< arena 中已使用的结点数
+    size_t *dict_sizes;   ///< 预扫描按先序记录的各字典项数，供 arena 模式连续分配字典项
+    size_t nr_dicts;      ///< dict_sizes 中的有效项数（解析时为已消耗的项数）
+    size_t cap_dicts;     ///< dict_sizes 的容量
 };
 
 /**
- * @brief 从数据流中取出一个长整型
+ * @brief 读取一个非负十进制整数，溢出 size_t 时失败
+ *
+ * 预扫描和解析共用，保证两个阶段对串长度的理解一致。
+ *
+ * @param p 指向读取位置，会推进到第一个非数字字符（溢出时停在溢出的数字上）
+ * @param end 数据结束地址，NULL 表示不限
+ * @param value [OUT] 读取到的整数
+ * @return 成功返回 1; 没有数字或者溢出返回 0
+ */
+static int
+read_digits(char **p, const char *end, size_t *value)
+{
+    size_t v = 0;
+    char *begin = *p;
+    while ((end == NULL || *p < end) && **p >= '0' && **p <= '9') {
+        size_t d = (size_t)(**p - '0');
+        if (v > (SIZE_MAX - d) / 10) {
+            return 0;
+        }
+        v = v * 10 + d;
+        (*p)++;
+    }
+    *value = v;
+    return *p != begin;
+}
+
+/**
+ * @brief 从数据流中取出一个串长度
+ *
+ * arena 模式下数据已经由预扫描以同样的规则检查过，不会失败。
+ *
  * @param st 指向状态记录
- * @return 返回匹配的长整型
+ * @return 串长度，溢出时返回 0
  */
 static inline size_t
 parse_get_int(struct State *st)
 {
-    return strtoul(st->curr, &st->curr, 10);
+    size_t len;
+    if (!read_digits(&st->curr, st->end, &len)) {
+        log("ERROR: bad string length at %lu", st->curr - st->start);
+        return 0;
+    }
+    return len;
 }
 
 /**
  * @brief 从数据流中取出一个给定长度的字符串
+ *
+ * arena 模式下直接返回源缓冲区中的位置，不做拷贝。
+ *
  * @param st 指向状态记录
  * @param length 字符串长度（不含 '\0'）
- * @return 动态分配的字符数组指针
+ * @return 动态分配的字符数组指针，或指向源缓冲区
  */
 static inline char *
 parse_get_str(struct State *st, size_t length)
 {
-    char *s = calloc(length + 1, sizeof(*s));
-    memcpy(s, st->curr, length);  // 有时候会需要拷贝字节流
+    char *s;
+    if (st->arena) {
+        s = st->curr;
+    }
+    else {
+        s = calloc(length + 1, sizeof(*s));
+        memcpy(s, st->curr, length);  // 有时候会需要拷贝字节流
+    }
     st->curr += length;
     return s;
 }
@@ -90,19 +143,32 @@ pos(struct State *st)
 
 /**
  * @brief 构造一个新的语法结点
+ *
+ * arena 模式下按先序从结点池中依次取出，所以根结点总是 arena 的首个结点。
+ *
+ * @param st parser 状态
  * @param type 语法结点类型标签
- * @return 动态分配的语法结点
+ * @return 动态分配或取自 arena 的语法结点
  */
 static struct BNode *
-new_bnode(enum BNodeType type)
+new_bnode(struct State *st, enum BNodeType type)
 {
-    struct BNode *bnode = calloc(1, sizeof(*bnode));
+    struct BNode *bnode;
+    if (st->arena) {
+        bnode = &st->arena[st->nr_used++];
+        bnode->in_arena = 1;
+    }
+    else {
+        bnode = calloc(1, sizeof(*bnode));
+    }
     bnode->type = type;
     return bnode;
 }
 
 static struct BNode *parse_bcode(struct State *st);
 
+static struct BNode *parse_bcode_is_dict_in_arena(struct State *st);
+
 /**
  * @brief 解析字符串（字典键）
  *
@@ -138,7 +204,7 @@ parse_bcode_is_key(struct State *st, size_t *len_o)
 static struct BNode *
 parse_bcode_is_str(struct State *st)
 {
-    struct BNode *bnode = new_bnode(B_STR);
+    struct BNode *bnode = new_bnode(st, B_STR);
     bnode->start = st->curr;
     bnode->s_data = parse_bcode_is_key(st, &bnode->s_size);
     bnode->end = st->curr;
@@ -157,10 +223,10 @@ parse_bcode_is_str(struct State *st)
 static struct BNode *
 parse_bcode_is_int(struct State *st)
 {
-    struct BNode *bnode = new_bnode(B_INT);
+    struct BNode *bnode = new_bnode(st, B_INT);
     bnode->start = st->curr - 1;
 
-    bnode->i = parse_get_int(st);
+    bnode->i = strtol(st->curr, &st->curr, 10);
 
     char end = parse_get_char(st);
     if (END != end) {
@@ -176,6 +242,7 @@ parse_bcode_is_int(struct State *st)
  *
  * 本函数假设调用者已经消耗了字典的起始字符 'd'.
  * 函数内部消耗终止字符 'e'.
+ * 空字典用一个 d_key 为 NULL 的字典结点表示。
  *
  * @param st parser 状态
  * @return 动态分配的字典结点
@@ -183,7 +250,11 @@ parse_bcode_is_int(struct State *st)
 static struct BNode *
 parse_bcode_is_dict(struct State *st)
 {
-    struct BNode *bnode;
+    if (st->arena) {
+        return parse_bcode_is_dict_in_arena(st);
+    }
+
+    struct BNode *bnode = NULL;
     struct BNode **iter = &bnode;
 
     char *start = st->curr - 1;
@@ -191,8 +262,8 @@ parse_bcode_is_dict(struct State *st)
     char ch;
     while ((ch = parse_get_char(st)) != END) {
         parse_back(st, 1);
-        (*iter) = new_bnode(B_DICT);
-        (*iter)->d_key = parse_bcode_is_key(st, NULL);  // 一定是字符串，不需要大小了
+        (*iter) = new_bnode(st, B_DICT);
+        (*iter)->d_key = parse_bcode_is_key(st, &(*iter)->d_key_size);
         (*iter)->d_val = parse_bcode(st);
         iter = &(*iter)->d_next;
     }
@@ -201,16 +272,85 @@ parse_bcode_is_dict(struct State *st)
         error_unexpected_char(st, ch, END);
     }
 
+    if (bnode == NULL) {
+        bnode = new_bnode(st, B_DICT);
+    }
+
     bnode->start = start;
     bnode->end = st->curr;
     return bnode;
 }
 
+/**
+ * @brief 按键比较两个字典项，供 qsort 使用
+ */
+static int
+compare_dict_entry(const void *x, const void *y)
+{
+    const struct BNode *a = x, *b = y;
+    return bkey_cmp(a->d_key, a->d_key_size, b->d_key, b->d_key_size);
+}
+
+/**
+ * @brief 在 arena 中解析字典并建立索引
+ *
+ * 项数来自预扫描，所以可以先在 arena 中连续预留全部字典项，
+ * 值结点随后按先序分配在它们之后。B 编码要求字典键有序，
+ * 这里只在遇到不规范的数据时才排序，最后再串起 d_next.
+ *
+ * @param st parser 状态
+ * @return 字典首项
+ */
+static struct BNode *
+parse_bcode_is_dict_in_arena(struct State *st)
+{
+    char *start = st->curr - 1;
+    size_t count = st->dict_sizes[st->nr_dicts++];
+
+    if (count == 0) {
+        parse_get_char(st);  // 'e', 已经由预扫描检查过
+        struct BNode *bnode = new_bnode(st, B_DICT);
+        bnode->start = start;
+        bnode->end = st->curr;
+        return bnode;
+    }
+
+    struct BNode *entries = &st->arena[st->nr_used];
+    st->nr_used += count;
+
+    int is_sorted = 1;
+    for (size_t i = 0; i < count; i++) {
+        struct BNode *entry = &entries[i];
+        entry->type = B_DICT;
+        entry->in_arena = 1;
+        entry->d_key = parse_bcode_is_key(st, &entry->d_key_size);
+        entry->d_val = parse_bcode(st);
+        if (i > 0 && compare_dict_entry(entry - 1, entry) > 0) {
+            is_sorted = 0;
+        }
+    }
+    parse_get_char(st);  // 'e'
+
+    if (!is_sorted) {
+        log("WARNING: unsorted dictionary keys at %lu", pos(st));
+        qsort(entries, count, sizeof(*entries), compare_dict_entry);
+    }
+
+    for (size_t i = 0; i + 1 < count; i++) {
+        entries[i].d_next = &entries[i + 1];
+    }
+    entries[0].d_count = count;
+    entries[0].start = start;
+    entries[0].end = st->curr;
+    return entries;
+}
+
 /**
  * @brief 递归下降地解析列表
  *
  * 本函数假设调用者已经消耗了列表的起始字符 'l'.
  * 函数内部消耗终止字符 'e'.
+ * 空列表用一个 l_item 为 NULL 的列表结点表示。
  *
  * @param st parser 状态
  * @return 动态分配的列表结点
@@ -218,7 +358,7 @@ parse_bcode_is_dict(struct State *st)
 static struct BNode *
 parse_bcode_is_list(struct State *st)
 {
-    struct BNode *bnode;
+    struct BNode *bnode = NULL;
     struct BNode **iter = &bnode;
 
     char *start = st->curr - 1;
@@ -226,7 +366,7 @@ parse_bcode_is_list(struct State *st)
     char ch;
     while ((ch = parse_get_char(st)) != EOF && END != ch) {
         parse_back(st, 1);
-        (*iter) = new_bnode(B_LIST);
+        (*iter) = new_bnode(st, B_LIST);
         (*iter)->l_item = parse_bcode(st);
         iter = &(*iter)->l_next;
     }
@@ -235,6 +375,10 @@ parse_bcode_is_list(struct State *st)
         error_unexpected_char(st, ch, END);
     }
 
+    if (bnode == NULL) {
+        bnode = new_bnode(st, B_LIST);
+    }
+
     bnode->start = start;
     bnode->end = st->curr;
     return bnode;
@@ -294,8 +438,160 @@ bparser(char *bcode)
     return parse_bcode(&st);
 }
 
+/**
+ * @brief 预扫描时读取一个非负十进制整数
+ *
+ * 严格检查边界，至少要有一位数字，溢出 size_t 视为非法。
+ *
+ * @param st parser 状态
+ * @param value 如果不为 NULL, 写入读取到的整数
+ * @return 成功返回 1, 否则返回 0
+ */
+static int
+scan_digits(struct State *st, size_t *value)
+{
+    size_t v;
+    if (!read_digits(&st->curr, st->end, &v)) {
+        return 0;
+    }
+    if (value) *value = v;
+    return 1;
+}
+
+/**
+ * @brief 预扫描一个串，检查长度是否越界
+ * @param st parser 状态
+ * @return 合法返回 1, 否则返回 0
+ */
+static int
+scan_str(struct State *st)
+{
+    size_t len;
+    if (!scan_digits(st, &len) || st->curr >= st->end || *st->curr++ != DELIM) {
+        return 0;
+    }
+    if (len > (size_t)(st->end - st->curr)) {
+        return 0;
+    }
+    st->curr += len;
+    return 1;
+}
+
+/**
+ * @brief 预扫描时为一个字典预留项数记录
+ * @param st parser 状态
+ * @return 记录的下标
+ */
+static size_t
+scan_push_dict(struct State *st)
+{
+    if (st->nr_dicts == st->cap_dicts) {
+        st->cap_dicts = st->cap_dicts ? st->cap_dicts * 2 : 16;
+        st->dict_sizes = realloc(st->dict_sizes, st->cap_dicts * sizeof(*st->dict_sizes));
+    }
+    st->dict_sizes[st->nr_dicts] = 0;
+    return st->nr_dicts++;
+}
+
+/**
+ * @brief 预扫描 B 编码，统计 parse_bcode() 将要构造的结点数量
+ *
+ * 统计规则与 parse_bcode() 的构造方式一一对应：
+ *
+ * 1. 串和整型各占一个结点；
+ * 2. 列表每一项占一个列表结点，加上项本身的结点；
+ * 3. 字典每一项占一个字典结点（键不单独成结点），加上值的结点；
+ * 4. 空列表、空字典占一个结点。
+ *
+ * 同时按先序记录每个字典的项数，以便解析时连续分配字典项。
+ *
+ * @param st parser 状态
+ * @param depth 当前嵌套深度
+ * @return 结点数量，语法错误或越界时返回 0
+ */
+static size_t
+scan_bcode(struct State *st, int depth)
+{
+    if (depth > BENCODE_MAX_DEPTH || st->curr >= st->end) {
+        return 0;
+    }
+
+    size_t n = 0, k, slot;
+    switch (*st->curr++) {
+    case LEAD_INT:
+        if (st->curr < st->end && *st->curr == '-') {
+            st->curr++;
+        }
+        if (!scan_digits(st, NULL) || st->curr >= st->end || *st->curr++ != END) {
+            return 0;
+        }
+        return 1;
+    case LEAD_LIST:
+        while (st->curr < st->end && *st->curr != END) {
+            if ((k = scan_bcode(st, depth + 1)) == 0) {
+                return 0;
+            }
+            n += 1 + k;
+        }
+        break;
+    case LEAD_DICT:
+        slot = scan_push_dict(st);
+        while (st->curr < st->end && *st->curr != END) {
+            if (!scan_str(st) || (k = scan_bcode(st, depth + 1)) == 0) {
+                return 0;
+            }
+            n += 1 + k;
+            st->dict_sizes[slot]++;
+        }
+        break;
+    default:
+        parse_back(st, 1);
+        return scan_str(st);
+    }
+
+    if (st->curr >= st->end) {  // 缺少终止字符 'e'
+        return 0;
+    }
+    st->curr++;
+    return n ? n : 1;
+}
+
+struct BNode *
+bparser_arena(char *bcode, size_t size)
+{
+    if (bcode == NULL) {
+        return NULL;
+    }
+
+    struct State st = {
+        .start = bcode,
+        .curr = bcode,
+        .end = bcode + size,
+    };
+
+    size_t nr_nodes = scan_bcode(&st, 0);
+    if (nr_nodes == 0) {
+        log("ERROR: malformed bencode at %lu", pos(&st));
+        free(st.dict_sizes);
+        return NULL;
+    }
+
+    size_t nr_dicts = st.nr_dicts;
+    st.curr = bcode;
+    st.nr_dicts = 0;
+    st.arena = calloc(nr_nodes, sizeof(*st.arena));
+    struct BNode *root = parse_bcode(&st);
+    assert(root == st.arena && st.nr_used == nr_nodes && st.nr_dicts == nr_dicts);
+    free(st.dict_sizes);
+    return root;
+}
+
 /**
  * @brief 释放 B 编码的抽象语法树
+ *
+ * arena 模式下根结点就是整块结点池的首地址，一次 free 即可，
+ * 此时只允许对根结点调用。
+ *
  * @param pbnode 指向要释放的抽象语法树的根结点
  */
 void
@@ -304,6 +600,15 @@ free_bnode(struct BNode **pbnode)
     struct BNode *bnode = *pbnode;
     *pbnode = NULL;
 
+    if (bnode == NULL) {
+        return;
+    }
+
+    if (bnode->in_arena) {
+        free(bnode);
+        return;
+    }
+
     if (bnode->type == B_DICT) {
         struct BNode *dict = bnode;
         while (dict) {
@@ -331,3 +636,226 @@ free_bnode(struct BNode **pbnode)
         free(bnode);
     }
 }
+
+/**
+ * @brief 流式扫描的词法状态
+ */
+enum BStreamLex
+{
+    LEX_VALUE,       ///< 等待一个值（或者容器的终止字符）
+    LEX_INT_SIGN,    ///< 刚读完 'i', 可以是负号或数字
+    LEX_INT_DIGITS,  ///< 读取整型的数字，直到 'e'
+    LEX_STR_LEN,     ///< 读取串的长度，直到 ':'
+    LEX_STR_DATA,    ///< 跳过串的内容
+};
+
+/**
+ * @brief 流式 parser 句柄
+ *
+ * 数据累积在 buf 中，scanned 之前的部分都已经扫描过。
+ * 容器的嵌套用栈记录：栈元素是 LEAD_LIST 或 LEAD_DICT,
+ * 对字典还要记录下一个期待的是键还是值。
+ */
+struct BStream
+{
+    char *buf;                           ///< 累积的数据
+    size_t size;                         ///< 累积的字节数
+    size_t capacity;                     ///< buf 的容量
+    size_t limit;                        ///< 允许累积的最大字节数
+    size_t scanned;                      ///< 已扫描的字节数
+    enum BStreamStatus status;           ///< 当前状态
+    enum BStreamLex lex;                 ///< 词法状态
+    size_t str_left;                     ///< LEX_STR_LEN 时累积长度，LEX_STR_DATA 时剩余字节数
+    int nr_digits;                       ///< 当前整数已读的数字个数
+    int depth;                           ///< 栈深度
+    char stack[BENCODE_MAX_DEPTH];       ///< 容器栈
+    char expect_key[BENCODE_MAX_DEPTH];  ///< 对字典：下一个是否应当是键
+    struct BNode *tree;                  ///< 完成后构造的语法树
+};
+
+struct BStream *
+bstream_new(size_t limit)
+{
+    struct BStream *bs = calloc(1, sizeof(*bs));
+    bs->limit = limit;
+    bs->status = BSTREAM_PARTIAL;
+    bs->lex = LEX_VALUE;
+    return bs;
+}
+
+/**
+ * @brief 一个值（标量或容器）扫描结束后更新外层状态
+ * @param bs 流式 parser 句柄
+ */
+static void
+bstream_value_done(struct BStream *bs)
+{
+    bs->lex = LEX_VALUE;
+    if (bs->depth == 0) {
+        bs->status = BSTREAM_COMPLETE;
+    }
+    else if (bs->stack[bs->depth - 1] == LEAD_DICT) {
+        bs->expect_key[bs->depth - 1] ^= 1;
+    }
+}
+
+/**
+ * @brief 扫描一个字节，推进词法状态
+ * @param bs 流式 parser 句柄
+ * @param ch 当前字节
+ * @return 合法返回 1, 否则返回 0
+ */
+static int
+bstream_step(struct BStream *bs, char ch)
+{
+    int is_digit = (ch >= '0' && ch <= '9');
+
+    switch (bs->lex) {
+    case LEX_VALUE:
+        if (bs->depth > 0 && ch == END) {  // 容器结束，字典不能停在键与值之间
+            if (bs->stack[bs->depth - 1] == LEAD_DICT && !bs->expect_key[bs->depth - 1]) {
+                return 0;
+            }
+            bs->depth--;
+            bstream_value_done(bs);
+            return 1;
+        }
+        if (bs->depth > 0 && bs->stack[bs->depth - 1] == LEAD_DICT
+                && bs->expect_key[bs->depth - 1] && !is_digit) {  // 字典键必须是串
+            return 0;
+        }
+        if (is_digit) {
+            bs->lex = LEX_STR_LEN;
+            bs->str_left = (size_t)(ch - '0');
+            return 1;
+        }
+        switch (ch) {
+        case LEAD_INT:
+            bs->lex = LEX_INT_SIGN;
+            bs->nr_digits = 0;
+            return 1;
+        case LEAD_LIST:
+        case LEAD_DICT:
+            if (bs->depth == BENCODE_MAX_DEPTH) {
+                return 0;
+            }
+            bs->stack[bs->depth] = ch;
+            bs->expect_key[bs->depth] = 1;
+            bs->depth++;
+            return 1;
+        default:
+            return 0;
+        }
+    case LEX_INT_SIGN:
+        bs->lex = LEX_INT_DIGITS;
+        if (ch == '-') {
+            return 1;
+        }
+        // fall through
+    case LEX_INT_DIGITS:
+        if (is_digit) {
+            bs->nr_digits++;
+            return 1;
+        }
+        if (ch == END && bs->nr_digits > 0) {
+            bstream_value_done(bs);
+            return 1;
+        }
+        return 0;
+    case LEX_STR_LEN:
+        if (is_digit) {
+            bs->str_left = bs->str_left * 10 + (size_t)(ch - '0');
+            return bs->str_left <= bs->limit;
+        }
+        if (ch != DELIM) {
+            return 0;
+        }
+        if (bs->str_left == 0) {
+            bstream_value_done(bs);
+        }
+        else {
+            bs->lex = LEX_STR_DATA;
+        }
+        return 1;
+    default:  // LEX_STR_DATA 由 bstream_feed() 整段跳过
+        return 0;
+    }
+}
+
+enum BStreamStatus
+bstream_feed(struct BStream *bs, const char *data, size_t size)
+{
+    if (bs->status != BSTREAM_PARTIAL || size == 0) {
+        return bs->status;
+    }
+
+    if (bs->size + size > bs->limit) {
+        size = bs->limit - bs->size;  // 超出部分不可能属于合法的值
+        if (size == 0) {
+            return bs->status = BSTREAM_ERROR;
+        }
+    }
+
+    if (bs->size + size > bs->capacity) {
+        size_t capacity = bs->capacity ? bs->capacity : BUF_INIT;
+        while (capacity < bs->size + size) {
+            capacity *= 2;
+        }
+        bs->buf = realloc(bs->buf, capacity);
+        bs->capacity = capacity;
+    }
+    memcpy(bs->buf + bs->size, data, size);
+    bs->size += size;
+
+    while (bs->scanned < bs->size && bs->status == BSTREAM_PARTIAL) {
+        if (bs->lex == LEX_STR_DATA) {
+            size_t n = bs->size - bs->scanned;
+            n = n < bs->str_left ? n : bs->str_left;
+            bs->scanned += n;
+            bs->str_left -= n;
+            if (bs->str_left == 0) {
+                bstream_value_done(bs);
+            }
+            continue;
+        }
+        if (!bstream_step(bs, bs->buf[bs->scanned++])) {
+            log("ERROR: malformed bencode stream at %lu", bs->scanned - 1);
+            bs->status = BSTREAM_ERROR;
+        }
+    }
+
+    if (bs->status == BSTREAM_PARTIAL && bs->size == bs->limit) {
+        bs->status = BSTREAM_ERROR;
+    }
+    else if (bs->status == BSTREAM_COMPLETE) {
+        bs->tree = bparser_arena(bs->buf, bs->scanned);
+        if (bs->tree == NULL) {
+            bs->status = BSTREAM_ERROR;
+        }
+    }
+
+    return bs->status;
+}
+
+const struct BNode *
+bstream_tree(struct BStream *bs)
+{
+    return bs->status == BSTREAM_COMPLETE ? bs->tree : NULL;
+}
+
+void
+bstream_free(struct BStream **pbs)
+{
+    struct BStream *bs = *pbs;
+    *pbs = NULL;
+
+    if (bs == NULL) {
+        return;
+    }
+
+    if (bs->tree) {
+        free_bnode(&bs->tree);
+    }
+    free(bs->buf);
+    free(bs);
+}
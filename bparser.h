@@ -7,8 +7,14 @@
 #define BPARSER_H
 
 #include <stddef.h>
+#include <string.h>
 #include <inttypes.h>
 
+/**
+ * @brief 允许的最大嵌套深度，parser 和 encoder 共用，防止恶意数据耗尽栈空间
+ */
+#define BENCODE_MAX_DEPTH 64
+
 /**
  * @brief B 编码语法结点类型标签
  */
@@ -32,13 +38,26 @@ enum BNodeType
  * 3. s_ 表示串（虽然串有时候是字符串可以不需要 size, 但是也有二进制串）
  *
  * start 和 end 指向源缓冲区，以记录一个结点的字节范围，
- * 主要为准确计算 info_hash 所准备。但是结点中的实际数据
- * 是深拷贝的，与源缓冲区脱离，只是要使用 start 和 end 时
- * 要保证源缓冲区的有效性。
+ * 主要为准确计算 info_hash 所准备。
+ *
+ * 结点有两种来源：
+ *
+ * 1. bparser() 逐个动态分配结点，串和字典键是深拷贝的，以 '\0' 结尾，
+ *    与源缓冲区脱离，只是要使用 start 和 end 时要保证源缓冲区的有效性。
+ * 2. bparser_arena() 从一整块预先分配的 arena 中取结点，s_data 和 d_key
+ *    直接指向源缓冲区（零拷贝），不以 '\0' 结尾，必须配合 s_size 和
+ *    d_key_size 使用，且整棵树的生命周期不能超过源缓冲区。
+ *
+ * 两种模式下 s_size 和 d_key_size 都是有效的，使用者应当统一按长度访问。
+ *
+ * arena 模式下，同一个字典的各项在 arena 中是连续存放的，并且按键排序，
+ * 首项的 d_count 记录项数，可以在字典内二分查找，见 bdict_get().
+ * 深拷贝模式下 d_count 为 0, 只能沿 d_next 线性查找。
  */
 struct BNode
 {
     enum BNodeType type;              ///< 类型标签
+    int in_arena;                     ///< 是否来自 arena, 决定 free_bnode() 的释放方式
     union
     {
         struct {
@@ -47,12 +66,14 @@ struct BNode
         };
         struct {
             char *d_key;              ///< 字典键（在 B 编码中是串，但是可以保证是字符串）
+            size_t d_key_size;        ///< 字典键长度
             struct BNode *d_val;      ///< 字典值
             struct BNode *d_next;     ///< 余下字典项
+            size_t d_count;           ///< 字典项数，只在 arena 模式的首项有效，0 表示没有索引
         };
         struct {
             size_t s_size;            ///< 串长度
-            char *s_data;             ///< 串内容（深拷贝）
+            char *s_data;             ///< 串内容（深拷贝或指向源缓冲区）
         };
         long i;                       ///< 整型
     };
@@ -60,10 +81,95 @@ struct BNode
     char *end;                        ///< 结点在源缓冲区的结束处
 };
 
+/**
+ * @brief 比较两个字典键
+ *
+ * 按 B 编码规范的字节序比较，短键是长键的前缀时短键在前。
+ *
+ * @return 与 memcmp 相同的约定
+ */
+static inline int
+bkey_cmp(const char *a, size_t a_size, const char *b, size_t b_size)
+{
+    int ret = memcmp(a, b, a_size < b_size ? a_size : b_size);
+    if (ret != 0) {
+        return ret;
+    }
+    return (a_size > b_size) - (a_size < b_size);
+}
+
 // 解析 B 编码数据获取抽象语法树
 struct BNode *bparser(char *bcode);
 
+/**
+ * @brief 零拷贝地解析 B 编码数据
+ *
+ * 先对源缓冲区做一遍只计数的扫描（同时检查语法和边界），
+ * 再一次性分配全部结点，串和字典键直接指向源缓冲区。
+ * 字典项连续存放并按键排序，构成字典内的查找索引。
+ *
+ * @param bcode 源缓冲区，不要求以 '\0' 结尾，在语法树释放前必须保持有效
+ * @param size 源缓冲区长度
+ * @return 语法树根结点，语法错误时返回 NULL
+ */
+struct BNode *bparser_arena(char *bcode, size_t size);
+
 // 释放 B 编码的抽象语法树
 void free_bnode(struct BNode **pbnode);
 
+/**
+ * @brief 流式解析的状态
+ */
+enum BStreamStatus
+{
+    BSTREAM_PARTIAL,   ///< 数据还不完整，等待更多数据
+    BSTREAM_COMPLETE,  ///< 一个完整的顶层 B 编码值已经到达
+    BSTREAM_ERROR,     ///< 语法错误或者超出长度限制
+};
+
+/**
+ * @brief 流式（推模式）B 编码 parser 句柄
+ *
+ * 适用于从非阻塞套接字陆续到达的数据：每次把收到的片段交给
+ * bstream_feed(), parser 在调用之间保存自己的扫描位置，不会重复扫描，
+ * 顶层值完整后再零拷贝地构造语法树。
+ */
+struct BStream;
+
+/**
+ * @brief 创建流式 parser
+ * @param limit 允许累积的最大字节数，超出时报告 BSTREAM_ERROR
+ * @return 动态分配的句柄
+ */
+struct BStream *bstream_new(size_t limit);
+
+/**
+ * @brief 向流式 parser 推送一段数据
+ *
+ * 只消耗到顶层值结束为止，之后的多余数据被忽略。
+ * 返回 BSTREAM_COMPLETE 或 BSTREAM_ERROR 之后再推送数据不会改变状态。
+ *
+ * @param bs 流式 parser 句柄
+ * @param data 新到达的数据
+ * @param size 数据长度
+ * @return 推送之后的解析状态
+ */
+enum BStreamStatus bstream_feed(struct BStream *bs, const char *data, size_t size);
+
+/**
+ * @brief 获取解析完成的语法树
+ *
+ * 语法树引用句柄内部的缓冲区，由句柄负责释放，调用者不要 free_bnode().
+ *
+ * @param bs 流式 parser 句柄
+ * @return 状态为 BSTREAM_COMPLETE 时返回语法树根结点，否则返回 NULL
+ */
+const struct BNode *bstream_tree(struct BStream *bs);
+
+/**
+ * @brief 释放流式 parser 以及它构造的语法树
+ * @param pbs 指向句柄，会改写成 NULL
+ */
+void bstream_free(struct BStream **pbs);
+
 #endif //  BPARSER_H
@@ -7,7 +7,7 @@
 #include "metainfo.h"
 #include <string.h>
 #include <arpa/inet.h>
-#include <openssl/sha.h>
+#include "sha1.h"
 
 #define PIECE_HASH (1 << 0)  ///< 打印 hash 的 flag
 #define PEERS (1 << 1)       ///< 打印二进制 peers 列表的 flag
@@ -22,6 +22,22 @@ put_indent(int indent)
     printf("%*s", indent, "");
 }
 
+/**
+ * @brief 比较串与 C 字符串是否相等
+ *
+ * 零拷贝模式下串不以 '\0' 结尾，所以统一按长度比较。
+ *
+ * @param data 串内容
+ * @param size 串长度
+ * @param key 要比较的 C 字符串
+ * @return 相等返回 1, 否则返回 0
+ */
+static inline int
+bstr_equal(const char *data, size_t size, const char *key)
+{
+    return data != NULL && strlen(key) == size && memcmp(data, key, size) == 0;
+}
+
 /**
  * @brief 带缩进的格式化打印
  */
@@ -69,7 +85,7 @@ print_str(const struct BNode *b, int indent, int flags)
         }
     }
     else {
-        print_with_indent(indent, "\"%s\"\n", b->s_data);
+        print_with_indent(indent, "\"%.*s\"\n", (int)b->s_size, b->s_data);
     }
 }
 
@@ -84,7 +100,7 @@ print_list(const struct BNode *list, int indent, int flags)
 {
     print_with_indent(indent, "[\n");
 
-    while (list) {
+    while (list && list->l_item) {
         print_bcode(list->l_item, indent + 2, flags);
         list = list->l_next;
     }
@@ -103,13 +119,13 @@ print_dict(const struct BNode *dict, int indent, int flags)
 {
     print_with_indent(indent, "{\n");
 
-    while (dict) {
-        print_with_indent(indent + 2, "\"%s\":", dict->d_key);
+    while (dict && dict->d_key) {
+        print_with_indent(indent + 2, "\"%.*s\":", (int)dict->d_key_size, dict->d_key);
         int flags_new = flags;
-        if (!strcmp(dict->d_key, "pieces")) {
+        if (bstr_equal(dict->d_key, dict->d_key_size, "pieces")) {
             flags_new |= PIECE_HASH;
         }
-        else if (!strcmp(dict->d_key, "peers")) {
+        else if (bstr_equal(dict->d_key, dict->d_key_size, "peers")) {
             flags_new |= PEERS;
         }
         switch (dict->d_val->type) {
@@ -146,7 +162,7 @@ dfs_bcode(const struct BNode *node, const char *key)
 {
     switch (node->type) {
     case B_LIST:
-        for (const struct BNode *iter = node; iter; iter = iter->l_next) {
+        for (const struct BNode *iter = node; iter && iter->l_item; iter = iter->l_next) {
             const struct BNode *ret = dfs_bcode(iter->l_item, key);
             if (ret) {
                 return ret;
@@ -154,8 +170,8 @@ dfs_bcode(const struct BNode *node, const char *key)
         }
         return NULL;
     case B_DICT:
-        for (const struct BNode *iter = node; iter; iter = iter->d_next) {
-            if (!strcmp(key, iter->d_key)) {
+        for (const struct BNode *iter = node; iter && iter->d_key; iter = iter->d_next) {
+            if (bstr_equal(iter->d_key, iter->d_key_size, key)) {
                 return iter->d_val;
             }
             const struct BNode *ret = dfs_bcode(iter->d_val, key);
@@ -165,7 +181,7 @@ dfs_bcode(const struct BNode *node, const char *key)
         }
         return NULL;
     case B_STR:
-        if (!strcmp(key, node->s_data)) {
+        if (bstr_equal(node->s_data, node->s_size, key)) {
             return node;
         }
         else {
@@ -182,9 +198,59 @@ query_bcode_by_key(const struct BNode *node, const char *key)
     return dfs_bcode(node, key);
 }
 
+const struct BNode *
+bdict_get(const struct BNode *dict, const char *key, size_t key_size)
+{
+    if (dict == NULL || dict->type != B_DICT || dict->d_key == NULL) {
+        return NULL;
+    }
+
+    if (dict->d_count == 0) {
+        for (const struct BNode *iter = dict; iter; iter = iter->d_next) {
+            if (bkey_cmp(iter->d_key, iter->d_key_size, key, key_size) == 0) {
+                return iter->d_val;
+            }
+        }
+        return NULL;
+    }
+
+    size_t lo = 0, hi = dict->d_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct BNode *entry = &dict[mid];
+        int ret = bkey_cmp(entry->d_key, entry->d_key_size, key, key_size);
+        if (ret == 0) {
+            return entry->d_val;
+        }
+        else if (ret < 0) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+const struct BNode *
+query_bcode_by_path(const struct BNode *tree, const char *path)
+{
+    const struct BNode *node = tree;
+    while (node != NULL) {
+        const char *delim = strchr(path, '.');
+        size_t key_size = delim ? (size_t)(delim - path) : strlen(path);
+        node = bdict_get(node, path, key_size);
+        if (delim == NULL) {
+            break;
+        }
+        path = delim + 1;
+    }
+    return node;
+}
+
 void
 make_info_hash(const struct BNode *root, unsigned char *md)
 {
-    const struct BNode *val = query_bcode_by_key(root, "info");
-    SHA1((void *)val->start, val->end - val->start, md);  // avoid the last 'e' for the top-level dict
+    const struct BNode *val = query_bcode_by_path(root, "info");
+    sha1(val->start, val->end - val->start, md);  // avoid the last 'e' for the top-level dict
 }
@@ -18,12 +18,40 @@ void print_bcode(const struct BNode *node, int indent, int flag);
 
 /**
  * @brief 搜索 bencode 树中字典里的某个键 key, 返回对应的值结点
+ *
+ * 深度优先遍历整棵树，代价与树的大小成正比，而且可能匹配到同名的
+ * 串值或者更深层的同名键。已知路径时应当使用 query_bcode_by_path().
+ *
  * @param tree 语法树根结点
  * @param key 要搜索的键
  * @return 键对应的值结点，没有则返回 NULL.
  */
 const struct BNode *query_bcode_by_key(const struct BNode *tree, const char *key);
 
+/**
+ * @brief 在一个字典中查找键
+ *
+ * arena 模式解析的字典有序且连续，使用二分查找；否则沿 d_next 线性查找。
+ *
+ * @param dict 字典结点（首项）
+ * @param key 要查找的键
+ * @param key_size 键长度
+ * @return 键对应的值结点，dict 不是字典或者没有该键时返回 NULL.
+ */
+const struct BNode *bdict_get(const struct BNode *dict, const char *key, size_t key_size);
+
+/**
+ * @brief 按键路径查找值结点
+ *
+ * 路径由 '.' 分割的各级字典键组成，如 "info.piece length",
+ * 只会逐级查找字典，不进入列表，代价与路径深度成正比。
+ *
+ * @param tree 语法树根结点
+ * @param path 键路径
+ * @return 路径对应的值结点，没有则返回 NULL.
+ */
+const struct BNode *query_bcode_by_path(const struct BNode *tree, const char *path);
+
 /**
  * @brief 计算 torrent 文件的 info hash
  * @param root 语法树根
@@ -0,0 +1,133 @@
+/**
+ * @file create.c
+ * @brief 制作种子文件的 API 实现
+ */
+
+#include "create.h"
+#include "bencoder.h"
+#include "piecehash.h"
+#include "metainfo.h"
+#include "util.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+/**
+ * @brief 最小分片大小，与子分片大小一致
+ */
+#define MIN_PIECE_SIZE 0x4000
+
+/**
+ * @brief 解析分片大小参数
+ * @param s 形如 "262144", "256K", "4M" 的字符串
+ * @return 分片大小，非法时返回 0
+ */
+static uint32_t
+parse_piece_size(const char *s)
+{
+    char *end;
+    unsigned long size = strtoul(s, &end, 10);
+    switch (*end) {
+    case 'k': case 'K': size <<= 10; end++; break;
+    case 'm': case 'M': size <<= 20; end++; break;
+    default: break;
+    }
+
+    if (*end != '\0' || size < MIN_PIECE_SIZE || size > (1UL << 30) || (size & (size - 1)) != 0) {
+        return 0;
+    }
+    return (uint32_t)size;
+}
+
+/**
+ * @brief 计时用的单调时钟，单位秒
+ */
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+create_torrent(const char *path, const char *piece_size_str, const char *tracker)
+{
+    uint32_t piece_size = parse_piece_size(piece_size_str);
+    if (piece_size == 0) {
+        err("invalid piece size %s, expect a power of 2 between 16K and 1G", piece_size_str);
+        return -1;
+    }
+
+    struct stat sb;
+    if (stat(path, &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_size == 0) {
+        err("%s is not a non-empty regular file", path);
+        return -1;
+    }
+
+    size_t file_size = (size_t)sb.st_size;
+    size_t nr_pieces = (file_size - 1) / piece_size + 1;
+    uint8_t *hashes = malloc(nr_pieces * HASH_SIZE);
+
+    log("hashing %s: %lu bytes, %lu pieces of %u bytes", path, file_size, nr_pieces, piece_size);
+    double start = now();
+    struct Storage *st = storage_new(1);
+    storage_add_file(st, path, file_size);
+    int ret = hash_pieces(st, file_size, piece_size, hashes, 0, NULL, NULL);
+    double elapsed = now() - start;
+    storage_free(&st);
+
+    if (ret == -1) {
+        err("failed to hash %s", path);
+        free(hashes);
+        return -1;
+    }
+    log("hashed in %.2fs, %.1f MiB/s", elapsed, file_size / elapsed / (1 << 20));
+
+    char *path_copy = strdup(path);
+    const char *name = basename(path_copy);
+
+    // 键必须按字节序写入
+    struct BEncoder enc;
+    benc_init(&enc, nr_pieces * HASH_SIZE + 1024);
+    benc_dict_begin(&enc);
+        benc_key(&enc, "announce");
+        benc_cstr(&enc, tracker);
+        benc_key(&enc, "created by");
+        benc_cstr(&enc, "SimpleTorrent");
+        benc_key(&enc, "creation date");
+        benc_int(&enc, (long)time(NULL));
+        benc_key(&enc, "info");
+        benc_dict_begin(&enc);
+            benc_key(&enc, "length");
+            benc_int(&enc, (long)file_size);
+            benc_key(&enc, "name");
+            benc_cstr(&enc, name);
+            benc_key(&enc, "piece length");
+            benc_int(&enc, piece_size);
+            benc_key(&enc, "pieces");
+            benc_str(&enc, hashes, nr_pieces * HASH_SIZE);
+        benc_end(&enc);
+    benc_end(&enc);
+
+    char *torrent = malloc(strlen(name) + sizeof(".torrent"));
+    sprintf(torrent, "%s.torrent", name);
+
+    FILE *fp = fopen(torrent, "wb");
+    if (fp == NULL || fwrite(enc.data, 1, enc.size, fp) < enc.size) {
+        perror(torrent);
+        ret = -1;
+    }
+    else {
+        log("wrote %s", torrent);
+    }
+    if (fp) fclose(fp);
+
+    free(torrent);
+    free(path_copy);
+    benc_free(&enc);
+    free(hashes);
+    return ret;
+}
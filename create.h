@@ -0,0 +1,22 @@
+/**
+ * @file create.h
+ * @brief 制作种子文件的 API 声明
+ */
+
+#ifndef CREATE_H
+#define CREATE_H
+
+/**
+ * @brief 为单个文件制作种子
+ *
+ * 分片摘要由 hash_pieces() 多线程计算，种子文件写到当前目录下的
+ * <文件名>.torrent.
+ *
+ * @param path 数据文件路径
+ * @param piece_size 分片大小，可带 K / M 后缀，要求是不小于 16K 的 2 的幂
+ * @param tracker tracker 的 announce URL
+ * @return 成功返回 0, 失败返回 -1
+ */
+int create_torrent(const char *path, const char *piece_size, const char *tracker);
+
+#endif  // CREATE_H
@@ -0,0 +1,735 @@
+/**
+ * @file diskio.c
+ * @brief 后台磁盘任务线程池的 API 实现
+ */
+
+#include "diskio.h"
+#include "util.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include "sha1.h"
+
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#ifdef IO_URING_OP_SUPPORTED  // 5.6 以上的头文件才有 IORING_OP_READ/WRITE 和 IORING_REGISTER_PROBE
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+/**
+ * @brief io_uring 实例，只由事件循环线程访问
+ */
+struct DiskRing
+{
+    int fd;                        ///< io_uring 描述符
+    unsigned nr_entries;           ///< 提交队列深度
+    void *sq_ptr;                  ///< 提交队列映射
+    size_t sq_len;
+    void *cq_ptr;                  ///< 完成队列映射，与提交队列共用一块时等于 sq_ptr
+    size_t cq_len;
+    struct io_uring_sqe *sqes;     ///< SQE 数组映射
+    size_t sqes_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned nr_pending;           ///< 已填入提交队列但还没有交给内核的任务数
+    unsigned nr_inflight;          ///< 已经交给内核还没有取回的任务数
+    struct DiskJob *backlog;       ///< 队列满时暂存的任务
+    struct DiskJob **backlog_tail;
+    int file;                      ///< 注册为固定文件的描述符，-1 表示没有
+    uint8_t *slots;                ///< 注册缓冲区，nr_slots 个 DISKIO_SLOT_SIZE
+    unsigned nr_slots;
+    unsigned *free_slots;          ///< 空闲缓冲区下标栈
+    unsigned nr_free;
+};
+#endif
+
+struct DiskIO
+{
+    pthread_mutex_t lock;       ///< 保护两个队列和 is_stopping
+    pthread_cond_t cond;        ///< 提交队列非空或者要求退出
+    struct DiskJob *head;       ///< 提交队列头
+    struct DiskJob **tail;      ///< 提交队列尾，便于 FIFO
+    struct DiskJob *done;       ///< 完成队列头
+    struct DiskJob **done_tail; ///< 完成队列尾
+    int efd;                    ///< 完成通知
+    int is_stopping;            ///< 要求工作线程退出
+    int nr_threads;             ///< 工作线程数
+    pthread_t *tids;            ///< 工作线程
+#ifdef HAVE_IO_URING
+    struct DiskRing *ring;      ///< io_uring 后端，NULL 表示读写也交给工作线程
+#endif
+};
+
+/**
+ * @brief 读满 length 字节
+ * @return 成功返回 0, 出错或者遇到文件末尾返回 -1
+ */
+static int
+pread_full(int fd, uint8_t *buf, size_t length, off_t offset)
+{
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pread(fd, buf + done, length - done, offset + (off_t)done);
+        if (n <= 0) {
+            if (n < 0) perror("pread");
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief 写满 length 字节
+ * @return 成功返回 0, 出错返回 -1
+ */
+static int
+pwrite_full(int fd, const uint8_t *buf, size_t length, off_t offset)
+{
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pwrite(fd, buf + done, length - done, offset + (off_t)done);
+        if (n < 0) {
+            perror("pwrite");
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief 读出任务的数据，有描述符时直接读，否则通过存储层
+ * @return 成功返回 0, 失败返回 -1
+ */
+static int
+read_job(struct DiskJob *job, uint8_t *buf)
+{
+    if (job->fd == -1) {
+        return storage_pread(job->st, buf, job->length, job->offset);
+    }
+    return pread_full(job->fd, buf, job->length, job->offset);
+}
+
+/**
+ * @brief 读出分片并校验 SHA1
+ * @param job 校验任务
+ * @return 1 - 一致，0 - 不一致，-1 - 读取出错
+ */
+static int
+verify_piece(struct DiskJob *job)
+{
+    uint8_t md[HASH_SIZE];
+    if (job->src != NULL) {
+        sha1(job->src, job->length, md);
+        return memcmp(md, job->expect, HASH_SIZE) == 0;
+    }
+
+    uint8_t *buf = malloc(job->length);
+    if (read_job(job, buf) == -1) {
+        free(buf);
+        return -1;
+    }
+
+    sha1(buf, job->length, md);
+    free(buf);
+    return memcmp(md, job->expect, HASH_SIZE) == 0;
+}
+
+/**
+ * @brief 读出任务的数据，每 block 字节计算一个摘要，依次放到 buf + head
+ * @param job 摘要任务
+ * @return 成功返回 0, 读取出错返回 -1
+ */
+static int
+digest_blocks(struct DiskJob *job)
+{
+    const uint8_t *data = job->src;
+    uint8_t *owned = NULL;
+    if (data == NULL) {
+        data = owned = malloc(job->length);
+        if (read_job(job, owned) == -1) {
+            free(owned);
+            return -1;
+        }
+    }
+
+    uint8_t *md = job->buf + job->head;
+    for (size_t off = 0; off < job->length; off += job->block) {
+        job->digest(data + off, job->length - off < job->block ? job->length - off : job->block, md);
+        md += job->md_size;
+    }
+    free(owned);
+    return 0;
+}
+
+/**
+ * @brief 工作线程
+ * @param arg 线程池
+ * @return NULL
+ */
+static void *
+diskio_worker(void *arg)
+{
+    struct DiskIO *dio = arg;
+
+    pthread_mutex_lock(&dio->lock);
+    while (1) {
+        while (dio->head == NULL && !dio->is_stopping) {
+            pthread_cond_wait(&dio->cond, &dio->lock);
+        }
+        if (dio->is_stopping) {
+            break;
+        }
+
+        struct DiskJob *job = dio->head;
+        dio->head = job->next;
+        if (dio->head == NULL) {
+            dio->tail = &dio->head;
+        }
+        pthread_mutex_unlock(&dio->lock);
+
+        switch (job->type) {
+        case DISK_VERIFY:
+            job->result = verify_piece(job);
+            break;
+        case DISK_READ:
+            job->result = read_job(job, job->buf + job->head);
+            break;
+        case DISK_WRITE:
+            job->result = job->fd == -1 ? storage_pwrite(job->st, job->buf, job->length, job->offset)
+                                        : pwrite_full(job->fd, job->buf, job->length, job->offset);
+            break;
+        case DISK_SPLICE:
+            job->result = storage_splice(job->st, job->pipe[1], job->offset, job->length);
+            break;
+        case DISK_DIGEST:
+            job->result = digest_blocks(job);
+            break;
+        default:
+            err("unexpected disk job type %d", job->type);
+            job->result = -1;
+            break;
+        }
+
+        pthread_mutex_lock(&dio->lock);
+        job->next = NULL;
+        *dio->done_tail = job;
+        dio->done_tail = &job->next;
+
+        uint64_t one = 1;
+        if (write(dio->efd, &one, sizeof(one)) != sizeof(one)) {
+            perror("write eventfd");
+        }
+    }
+    pthread_mutex_unlock(&dio->lock);
+
+    return NULL;
+}
+
+struct DiskIO *
+diskio_new(int nr_threads)
+{
+    struct DiskIO *dio = calloc(1, sizeof(*dio));
+    pthread_mutex_init(&dio->lock, NULL);
+    pthread_cond_init(&dio->cond, NULL);
+    dio->tail = &dio->head;
+    dio->done_tail = &dio->done;
+
+    dio->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (dio->efd == -1) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+
+    if (nr_threads <= 0) {
+        nr_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (nr_threads <= 0) nr_threads = 1;
+    }
+    dio->nr_threads = nr_threads;
+    dio->tids = calloc((size_t)nr_threads, sizeof(*dio->tids));
+    for (int i = 0; i < nr_threads; i++) {
+        if (pthread_create(&dio->tids[i], NULL, diskio_worker, dio) != 0) {
+            panic("failed to create disk worker %d", i);
+        }
+    }
+
+    log("disk io pool: %d threads, eventfd %d", nr_threads, dio->efd);
+    return dio;
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * @brief 把任务剩下的部分填入一个 SQE
+ *
+ * 读写的缓冲区在注册缓冲区内时使用 READ_FIXED/WRITE_FIXED,
+ * 描述符是注册过的数据文件时使用固定文件。
+ *
+ * @param ring io_uring 实例，要求提交队列和完成队列都有空位
+ * @param job DISK_READ 或者 DISK_WRITE 任务
+ */
+static void
+ring_prep(struct DiskRing *ring, struct DiskJob *job)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    uint8_t *addr = job->buf + job->done + (job->type == DISK_READ ? job->head : 0);
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (ring->slots != NULL && job->buf >= ring->slots && job->buf < ring->slots + (size_t)ring->nr_slots * DISKIO_SLOT_SIZE) {
+        sqe->opcode = job->type == DISK_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->buf_index = (uint16_t)((size_t)(job->buf - ring->slots) / DISKIO_SLOT_SIZE);
+    }
+    else {
+        sqe->opcode = job->type == DISK_READ ? IORING_OP_READ : IORING_OP_WRITE;
+    }
+    if (job->fd == ring->file) {
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+    }
+    else {
+        sqe->fd = job->fd;
+    }
+    sqe->off = (uint64_t)job->offset + job->done;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = (uint32_t)(job->length - job->done);
+    sqe->user_data = (uint64_t)(uintptr_t)job;
+
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->nr_pending++;
+}
+
+/**
+ * @brief 把任务填入提交队列，队列满时暂存到 backlog
+ *
+ * 进行中的任务数不超过提交队列深度，完成队列（深度是它的两倍）就不会溢出。
+ */
+static void
+ring_submit(struct DiskRing *ring, struct DiskJob *job)
+{
+    if (ring->backlog == NULL && ring->nr_pending + ring->nr_inflight < ring->nr_entries) {
+        ring_prep(ring, job);
+        return;
+    }
+    job->next = NULL;
+    *ring->backlog_tail = job;
+    ring->backlog_tail = &job->next;
+}
+
+/**
+ * @brief 把 backlog 中的任务尽量填入提交队列
+ */
+static void
+ring_refill(struct DiskRing *ring)
+{
+    while (ring->backlog != NULL && ring->nr_pending + ring->nr_inflight < ring->nr_entries) {
+        struct DiskJob *job = ring->backlog;
+        ring->backlog = job->next;
+        if (ring->backlog == NULL) {
+            ring->backlog_tail = &ring->backlog;
+        }
+        ring_prep(ring, job);
+    }
+}
+
+/**
+ * @brief 调用 io_uring_enter 提交攒下的 SQE
+ * @param ring io_uring 实例
+ * @param wait 至少等待完成的任务数
+ */
+static void
+ring_enter(struct DiskRing *ring, unsigned wait)
+{
+    unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+    if (ring->nr_pending == 0 && wait == 0) {
+        return;
+    }
+    int n = (int)syscall(__NR_io_uring_enter, ring->fd, ring->nr_pending, wait, flags, NULL, 0);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EBUSY && errno != EINTR) {
+            perror("io_uring_enter");
+        }
+        return;
+    }
+    ring->nr_pending -= (unsigned)n;
+    ring->nr_inflight += (unsigned)n;
+}
+
+/**
+ * @brief 取回完成队列中的全部 CQE
+ *
+ * 读写了一部分的任务把剩下的部分重新提交，完成的任务挂到 done 链表。
+ *
+ * @param ring io_uring 实例
+ * @param done_tail [IN/OUT] 完成链表的尾
+ * @return 新的尾
+ */
+static struct DiskJob **
+ring_reap(struct DiskRing *ring, struct DiskJob **done_tail)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        struct DiskJob *job = (struct DiskJob *)(uintptr_t)cqe->user_data;
+        ring->nr_inflight--;
+
+        if (cqe->res < 0) {
+            err("io_uring %s: %s", job->type == DISK_READ ? "read" : "write", strerror(-cqe->res));
+            job->result = -1;
+        }
+        else if (cqe->res == 0) {
+            err("io_uring %s: no progress at %ld", job->type == DISK_READ ? "read" : "write", (long)(job->offset + job->done));
+            job->result = -1;  // 读到文件末尾，或者写不进去
+        }
+        else if ((job->done += (size_t)cqe->res) < job->length) {
+            ring_submit(ring, job);
+            continue;
+        }
+        else {
+            job->result = 0;
+        }
+
+        job->next = NULL;
+        *done_tail = job;
+        done_tail = &job->next;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    ring_refill(ring);
+    return done_tail;
+}
+
+/**
+ * @brief 注册一组缓冲区，失败时不用注册缓冲区
+ */
+static void
+ring_register_slots(struct DiskRing *ring, unsigned nr_slots)
+{
+    size_t size = (size_t)nr_slots * DISKIO_SLOT_SIZE;
+    uint8_t *slots = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        perror("mmap io_uring buffers");
+        return;
+    }
+
+    struct iovec *iov = calloc(nr_slots, sizeof(*iov));
+    for (unsigned i = 0; i < nr_slots; i++) {
+        iov[i].iov_base = slots + (size_t)i * DISKIO_SLOT_SIZE;
+        iov[i].iov_len = DISKIO_SLOT_SIZE;
+    }
+    int ret = (int)syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, nr_slots);
+    free(iov);
+    if (ret == -1) {
+        perror("io_uring register buffers");
+        munmap(slots, size);
+        return;
+    }
+
+    ring->slots = slots;
+    ring->nr_slots = nr_slots;
+    ring->free_slots = malloc(nr_slots * sizeof(*ring->free_slots));
+    for (unsigned i = 0; i < nr_slots; i++) {
+        ring->free_slots[i] = nr_slots - 1 - i;
+    }
+    ring->nr_free = nr_slots;
+}
+
+/**
+ * @brief 释放 io_uring 实例，调用前要求没有进行中的任务
+ */
+static void
+ring_free(struct DiskRing *ring)
+{
+    close(ring->fd);
+    if (ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    munmap(ring->sq_ptr, ring->sq_len);
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->slots != NULL) {
+        munmap(ring->slots, (size_t)ring->nr_slots * DISKIO_SLOT_SIZE);
+    }
+    free(ring->free_slots);
+    free(ring);
+}
+
+/**
+ * @brief 检查内核是否支持用到的全部操作
+ *
+ * IORING_OP_READ/WRITE 要求 5.6 以上的内核，更早的内核也不支持
+ * IORING_REGISTER_PROBE, 探测失败就当作不支持。
+ *
+ * @param rfd io_uring 实例的描述符
+ * @return 都支持返回 1, 否则返回 0
+ */
+static int
+ring_probe(int rfd)
+{
+    static const int ops[] = { IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED };
+    struct io_uring_probe *probe = calloc(1, sizeof(*probe) + IORING_OP_LAST * sizeof(probe->ops[0]));
+    int is_supported = syscall(__NR_io_uring_register, rfd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    for (size_t i = 0; is_supported && i < sizeof(ops) / sizeof(ops[0]); i++) {
+        is_supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return is_supported;
+}
+
+int
+diskio_use_uring(struct DiskIO *dio, int fd, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int rfd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (rfd == -1) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    if (!ring_probe(rfd)) {
+        err("io_uring: the kernel lacks IORING_OP_READ/WRITE");
+        close(rfd);
+        return -1;
+    }
+
+    struct DiskRing *ring = calloc(1, sizeof(*ring));
+    ring->fd = rfd;
+    ring->nr_entries = p.sq_entries;
+    ring->backlog_tail = &ring->backlog;
+    ring->file = -1;
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_len = ring->cq_len = ring->sq_len > ring->cq_len ? ring->sq_len : ring->cq_len;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ptr :
+        mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_CQ_RING);
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQES);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        perror("mmap io_uring");
+        close(rfd);  // 进程退出前不再尝试，映射随进程回收
+        free(ring);
+        return -1;
+    }
+
+    uint8_t *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // 完成时由内核写线程池的 eventfd, 事件循环不用区分两种后端
+    if (syscall(__NR_io_uring_register, rfd, IORING_REGISTER_EVENTFD, &dio->efd, 1) == -1) {
+        perror("io_uring register eventfd");
+        ring_free(ring);
+        return -1;
+    }
+
+    if (fd == -1) {
+        log("io_uring: no single data file, multi-file jobs go to the worker threads");
+    }
+    else if (syscall(__NR_io_uring_register, rfd, IORING_REGISTER_FILES, &fd, 1) == 0) {
+        ring->file = fd;
+    }
+    else {
+        perror("io_uring register file");
+    }
+    ring_register_slots(ring, ring->nr_entries);
+
+    dio->ring = ring;
+    log("io_uring: %u entries, %u registered buffers, fixed file %d", ring->nr_entries, ring->nr_slots, ring->file);
+    return 0;
+}
+
+uint8_t *
+diskio_alloc(struct DiskIO *dio, size_t size)
+{
+    struct DiskRing *ring = dio->ring;
+    if (ring != NULL && ring->nr_free > 0 && size <= DISKIO_SLOT_SIZE) {
+        return ring->slots + (size_t)ring->free_slots[--ring->nr_free] * DISKIO_SLOT_SIZE;
+    }
+    return malloc(size);
+}
+
+void
+diskio_free_buf(struct DiskIO *dio, uint8_t *buf)
+{
+    struct DiskRing *ring = dio->ring;
+    if (ring != NULL && ring->slots != NULL && buf >= ring->slots
+            && buf < ring->slots + (size_t)ring->nr_slots * DISKIO_SLOT_SIZE) {
+        ring->free_slots[ring->nr_free++] = (unsigned)((size_t)(buf - ring->slots) / DISKIO_SLOT_SIZE);
+    }
+    else {
+        free(buf);
+    }
+}
+
+void
+diskio_flush(struct DiskIO *dio)
+{
+    if (dio->ring != NULL) {
+        ring_enter(dio->ring, 0);
+    }
+}
+#else
+int
+diskio_use_uring(struct DiskIO *dio, int fd, unsigned entries)
+{
+    err("io_uring is not supported by this build");
+    return -1;
+}
+
+uint8_t *
+diskio_alloc(struct DiskIO *dio, size_t size)
+{
+    return malloc(size);
+}
+
+void
+diskio_free_buf(struct DiskIO *dio, uint8_t *buf)
+{
+    free(buf);
+}
+
+void
+diskio_flush(struct DiskIO *dio)
+{
+}
+#endif
+
+void
+diskio_release(struct DiskIO *dio, struct DiskJob *job)
+{
+    diskio_free_buf(dio, job->buf);
+    free(job);
+}
+
+int
+diskio_eventfd(struct DiskIO *dio)
+{
+    return dio->efd;
+}
+
+int
+diskio_has_uring(const struct DiskIO *dio)
+{
+#ifdef HAVE_IO_URING
+    return dio->ring != NULL;
+#else
+    return 0;
+#endif
+}
+
+void
+diskio_submit(struct DiskIO *dio, struct DiskJob *job)
+{
+#ifdef HAVE_IO_URING
+    if (dio->ring != NULL && (job->type == DISK_READ || job->type == DISK_WRITE) && job->fd != -1) {
+        ring_submit(dio->ring, job);
+        return;
+    }
+#endif
+    job->next = NULL;
+    pthread_mutex_lock(&dio->lock);
+    *dio->tail = job;
+    dio->tail = &job->next;
+    pthread_cond_signal(&dio->cond);
+    pthread_mutex_unlock(&dio->lock);
+}
+
+struct DiskJob *
+diskio_reap(struct DiskIO *dio)
+{
+    uint64_t count;
+    if (read(dio->efd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read eventfd");
+    }
+
+    pthread_mutex_lock(&dio->lock);
+    struct DiskJob *done = dio->done;
+    struct DiskJob **done_tail = dio->done_tail;
+    dio->done = NULL;
+    dio->done_tail = &dio->done;
+    pthread_mutex_unlock(&dio->lock);
+
+#ifdef HAVE_IO_URING
+    if (dio->ring != NULL) {
+        if (done == NULL) {
+            done_tail = &done;
+        }
+        ring_reap(dio->ring, done_tail);
+    }
+#endif
+    return done;
+}
+
+void
+diskio_free(struct DiskIO **pdio)
+{
+    struct DiskIO *dio = *pdio;
+    *pdio = NULL;
+
+    pthread_mutex_lock(&dio->lock);
+    dio->is_stopping = 1;
+    pthread_cond_broadcast(&dio->cond);
+    pthread_mutex_unlock(&dio->lock);
+
+    for (int i = 0; i < dio->nr_threads; i++) {
+        pthread_join(dio->tids[i], NULL);
+    }
+
+    struct DiskJob *ring_jobs = NULL;
+#ifdef HAVE_IO_URING
+    // 内核可能还在读写任务的缓冲区，等它们完成再释放
+    struct DiskRing *ring = dio->ring;
+    if (ring != NULL) {
+        struct DiskJob **tail = &ring_jobs;
+        ring_enter(ring, 0);
+        while (ring->nr_inflight > 0) {
+            ring_enter(ring, 1);
+            tail = ring_reap(ring, tail);
+            ring_enter(ring, 0);
+        }
+        *tail = ring->backlog;
+        ring->backlog = NULL;
+    }
+#endif
+
+    for (struct DiskJob *lists[] = { dio->head, dio->done, ring_jobs }, **l = lists; l < lists + 3; l++) {
+        while (*l) {
+            struct DiskJob *next = (*l)->next;
+            diskio_release(dio, *l);
+            *l = next;
+        }
+    }
+
+#ifdef HAVE_IO_URING
+    if (ring != NULL) {
+        ring_free(ring);
+    }
+#endif
+
+    close(dio->efd);
+    pthread_cond_destroy(&dio->cond);
+    pthread_mutex_destroy(&dio->lock);
+    free(dio->tids);
+    free(dio);
+}
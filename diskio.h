@@ -0,0 +1,172 @@
+/**
+ * @file diskio.h
+ * @brief 后台磁盘任务线程池的 API 声明
+ */
+
+#ifndef DISKIO_H
+#define DISKIO_H
+
+#include "metainfo.h"
+#include "storage.h"
+#include <sys/types.h>
+
+/**
+ * @brief 磁盘任务类型
+ */
+enum DiskJobType
+{
+    DISK_VERIFY,  ///< 读出一个分片并校验 SHA1
+    DISK_READ,    ///< 读出一段数据到 buf
+    DISK_WRITE,   ///< 把 buf 写入文件
+    DISK_SPLICE,  ///< 把一段数据从文件移到管道，总是交给工作线程
+    DISK_DIGEST,  ///< 读出一段数据并分块计算摘要，总是交给工作线程
+};
+
+/**
+ * @brief io_uring 注册缓冲区的大小，容纳一个 16 KiB 子分片和 PIECE 报文头
+ */
+#define DISKIO_SLOT_SIZE (0x4000 + 64)
+
+/**
+ * @brief 磁盘任务
+ *
+ * 由事件循环动态分配并提交，工作线程或者 io_uring 执行后放入完成队列，
+ * 事件循环通过 diskio_reap() 取回后用 diskio_release() 释放，包括 buf.
+ * buf 应当由 diskio_alloc() 分配，以便使用 io_uring 的注册缓冲区。
+ */
+struct DiskJob
+{
+    enum DiskJobType type;         ///< 任务类型
+    int fd;                        ///< 数据文件描述符，-1 表示通过 st 读写
+    struct Storage *st;            ///< 存储层，offset 是线性偏移；多文件种子的任务总是交给工作线程
+    uint32_t index;                ///< 分片号
+    off_t offset;                  ///< 在文件中的偏移
+    size_t length;                 ///< 字节数
+    uint8_t expect[HASH_SIZE];     ///< DISK_VERIFY: 期望的摘要
+    const uint8_t *src;            ///< DISK_VERIFY, DISK_DIGEST: 非 NULL 时直接使用这段内存（缓冲区或者数据文件的映射），不读盘
+    size_t block;                  ///< DISK_DIGEST: 每个摘要覆盖的字节数，最后一块可能不足
+    size_t md_size;                ///< DISK_DIGEST: 摘要的字节数
+    void (*digest)(const void *data, size_t size, uint8_t *md);  ///< DISK_DIGEST: 摘要函数
+    uint8_t *buf;                  ///< DISK_READ: 读入的位置；DISK_WRITE: 要写出的数据；DISK_DIGEST: 依次存放摘要
+    size_t head;                   ///< DISK_READ, DISK_DIGEST: buf 开头留给调用者的字节数（例如报文头），数据或者摘要放在 buf + head
+    uint32_t begin;                ///< DISK_READ, DISK_WRITE, DISK_SPLICE: 子分片在分片内的偏移
+    int is_piece;                  ///< DISK_WRITE: 1 - 校验通过的整个分片，0 - 单个子分片；DISK_READ: 1 - 为读缓存读入整个分片；DISK_DIGEST: 1 - 追查坏数据的来源，0 - 回复 HASH REQUEST
+    int pipe[2];                   ///< DISK_SPLICE: 数据移入 pipe[1], 事件循环再从 pipe[0] 发出
+    int peer_fd;                   ///< DISK_READ, DISK_SPLICE, DISK_DIGEST: 请求数据的 peer 的套接字
+    char peer_id[HASH_SIZE];       ///< DISK_READ, DISK_SPLICE, DISK_DIGEST: 用于确认套接字仍然属于同一个 peer
+    int result;                    ///< DISK_VERIFY: 1 - 一致，0 - 不一致，-1 - 读取出错；其他: 0 - 成功，-1 - 出错
+    size_t done;                   ///< io_uring 后端内部使用：已经读写的字节数
+    struct DiskJob *next;          ///< 队列链接
+};
+
+/**
+ * @brief 磁盘任务线程池句柄
+ *
+ * 工作线程从提交队列取任务，完成后挂到完成队列并写 eventfd.
+ * eventfd 加入 epoll 后，事件循环在可读时取回完成的任务，
+ * 所以磁盘读写和摘要计算都不会阻塞事件循环。
+ *
+ * 启用 io_uring 后端（见 diskio_use_uring()）时，DISK_READ 和 DISK_WRITE
+ * 改由 io_uring 执行，完成时内核同样写这个 eventfd; 提交的任务先攒在
+ * 提交队列里，由事件循环每轮调用 diskio_flush() 一次系统调用批量提交。
+ * DISK_VERIFY 需要计算摘要，总是交给工作线程。
+ *
+ * 多个工作线程（以及 io_uring）之间任务的完成顺序不确定，有先后依赖的任务
+ * （例如先写入再校验）由提交者在前一个任务完成后再提交。
+ */
+struct DiskIO;
+
+/**
+ * @brief 创建线程池
+ * @param nr_threads 工作线程数，0 表示使用在线 CPU 数
+ * @return 动态分配的句柄
+ */
+struct DiskIO *diskio_new(int nr_threads);
+
+/**
+ * @brief 启用 io_uring 后端
+ *
+ * 为数据文件注册固定文件，并注册一组 DISKIO_SLOT_SIZE 大小的缓冲区供
+ * diskio_alloc() 分配。注册缓冲区失败（例如超出 RLIMIT_MEMLOCK）时
+ * 仍然使用 io_uring, 只是不用注册缓冲区。
+ *
+ * @param dio 线程池
+ * @param fd 数据文件描述符，其他描述符的任务不使用固定文件
+ * @param entries 队列深度，同时也是注册缓冲区的个数
+ * @return 成功返回 0; 内核不支持等原因失败返回 -1, 此时仍使用线程池读写
+ */
+int diskio_use_uring(struct DiskIO *dio, int fd, unsigned entries);
+
+/**
+ * @brief 分配任务的 buf
+ *
+ * 启用了 io_uring 且 size 不超过 DISKIO_SLOT_SIZE 时优先从注册缓冲区分配，
+ * 否则使用 malloc().
+ *
+ * @param dio 线程池
+ * @param size 字节数
+ * @return 缓冲区，随任务由 diskio_release() 释放
+ */
+uint8_t *diskio_alloc(struct DiskIO *dio, size_t size);
+
+/**
+ * @brief 释放 diskio_alloc() 分配但没有交给任务的缓冲区
+ * @param dio 线程池
+ * @param buf 缓冲区，可以为 NULL
+ */
+void diskio_free_buf(struct DiskIO *dio, uint8_t *buf);
+
+/**
+ * @brief 释放取回的任务和它的 buf
+ * @param dio 线程池
+ * @param job 任务
+ */
+void diskio_release(struct DiskIO *dio, struct DiskJob *job);
+
+/**
+ * @brief 把攒下的 io_uring 任务一次提交给内核
+ *
+ * 事件循环在每轮等待事件之前调用；没有启用 io_uring 时什么也不做。
+ *
+ * @param dio 线程池
+ */
+void diskio_flush(struct DiskIO *dio);
+
+/**
+ * @brief 获取完成通知的 eventfd, 用于加入 epoll
+ */
+int diskio_eventfd(struct DiskIO *dio);
+
+/**
+ * @brief 是否启用了 io_uring 后端
+ * @return 启用返回 1, 否则返回 0
+ */
+int diskio_has_uring(const struct DiskIO *dio);
+
+/**
+ * @brief 提交任务，不阻塞
+ * @param dio 线程池
+ * @param job 动态分配的任务，所有权交给线程池直到被取回
+ */
+void diskio_submit(struct DiskIO *dio, struct DiskJob *job);
+
+/**
+ * @brief 取回全部已完成的任务
+ *
+ * 在 eventfd 可读时调用，同时清空 eventfd 计数。
+ *
+ * @param dio 线程池
+ * @return 完成任务的链表（按完成顺序），没有时返回 NULL
+ */
+struct DiskJob *diskio_reap(struct DiskIO *dio);
+
+/**
+ * @brief 停止工作线程并释放线程池，未执行的任务被丢弃
+ *
+ * 已经交给内核的 io_uring 任务会先等它们完成。
+ *
+ * @param pdio 指向句柄，会改写成 NULL
+ */
+void diskio_free(struct DiskIO **pdio);
+
+#endif  // DISKIO_H
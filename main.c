@@ -7,10 +7,18 @@
 #include "util.h"
 #include "peer.h"
 #include "connect.h"
+#include "create.h"
+#include "diskio.h"
+#include "resume.h"
+#include "readcache.h"
 #include <sys/epoll.h>    // epoll_create1(), epoll_ctl(), epoll_wait(), epoll_event
 #include <arpa/inet.h>    // inet_ntoa()
 #include <sys/timerfd.h>  // timerfd_settime()
 #include <signal.h>       // sigaction()
+#include <string.h>       // strcmp()
+#include <fcntl.h>        // open()
+#include <sys/mman.h>     // mmap()
+#include <sys/stat.h>     // fstat()
 #include <unistd.h>
 
 /**
@@ -18,6 +26,21 @@
  */
 #define BUF_SIZE 4096
 
+/**
+ * @brief 分片缓冲区总量的默认上限 (MiB)
+ */
+#define CACHE_SIZE_DEFAULT 64
+
+/**
+ * @brief 做种读缓存的默认上限 (MiB)
+ */
+#define READ_CACHE_SIZE_DEFAULT 32
+
+/**
+ * @brief io_uring 的队列深度
+ */
+#define URING_ENTRIES 256
+
 /**
  * @brief global metainfo, describing the current downloading task.
  */
@@ -28,7 +51,7 @@ void bt_handler(struct MetaInfo *mi, int efd);
 void send_msg_to_tracker(struct MetaInfo *mi, struct Tracker *tracker);
 
 /**
- * @brief send stopped message to trackers when exit from SIGINT
+ * @brief save the resume file and send stopped message to trackers when exit from SIGINT
  */
 void exit_handler(int signum)
 {
@@ -37,6 +60,11 @@ void exit_handler(int signum)
         exit(EXIT_FAILURE);
     }
 
+    // 保存续传状态，下次启动不必重新校验
+    if (mi->storage != NULL) {
+        resume_save(mi);
+    }
+
     // Indicate STOPPED event!
     mi->downloaded = mi->left = mi->file_size;
 
@@ -87,26 +115,42 @@ void exit_handler(int signum)
 }
 
 /**
- * @brief 将种子文件完全载入内存
+ * @brief 将种子文件只读地映射到内存
+ *
+ * 语法树零拷贝地引用映射，分片摘要表也直接指向映射，
+ * 所以映射要保留到程序结束（见 free_metainfo()）。
+ *
  * @param torrent 种子文件名
- * @return 种子文件数据 [动态缓冲区]
+ * @param psize [OUT] 种子文件大小
+ * @return 种子文件数据 [只读映射]
  */
 char *
-get_torrent_data_from_file(const char *torrent)
+get_torrent_data_from_file(const char *torrent, size_t *psize)
 {
-    FILE *fp = fopen(torrent, "rb");
+    int fd = open(torrent, O_RDONLY);
+    if (fd == -1) {
+        perror(torrent);
+        exit(EXIT_FAILURE);
+    }
 
-    fseek(fp, 0, SEEK_END);
-    ssize_t size = ftell(fp);
-    char *bcode = calloc((size_t)size, sizeof(*bcode));
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        perror("fstat torrent");
+        exit(EXIT_FAILURE);
+    }
+    if (sb.st_size == 0) {
+        panic("empty torrent file %s", torrent);
+    }
 
-    rewind(fp);
-    if (fread(bcode, 1, (size_t)size, fp) < size) {
-        panic("reading is not sufficient");
+    char *bcode = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (bcode == MAP_FAILED) {
+        perror("mmap torrent");
+        exit(EXIT_FAILURE);
     }
 
-    fclose(fp);
+    close(fd);  // 映射不依赖描述符
 
+    *psize = (size_t)sb.st_size;
     return bcode;
 }
 
@@ -116,10 +160,62 @@ get_torrent_data_from_file(const char *torrent)
 int
 main(int argc, char *argv[])
 {
-    if (argc < 3) {
-        printf("Usage: %s <torrent> <port> [slow]\n", argv[0]);
+    // 制作种子模式
+    if (argc >= 2 && !strcmp(argv[1], "create")) {
+        if (argc != 5) {
+            printf("Usage: %s create <path> <piece-size> <tracker>\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        return create_torrent(argv[2], argv[3], argv[4]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // 选项：-c 分片缓冲区总量上限 (MiB), 0 表示子分片直接写盘；-u 使用 io_uring 读写数据文件；
+    //       -m 把数据文件映射到内存；-p full|sparse 新数据文件的空间分配方式；
+    //       -r 做种读缓存上限 (MiB), 0 表示不缓存
+    size_t cache_mb = CACHE_SIZE_DEFAULT;
+    size_t read_cache_mb = READ_CACHE_SIZE_DEFAULT;
+    int use_uring = 0;
+    int use_mmap = 0;
+    int prealloc = PREALLOC_SPARSE;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:ump:r:")) != -1) {
+        switch (opt) {
+        case 'c':
+            cache_mb = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            read_cache_mb = strtoul(optarg, NULL, 10);
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'm':
+            use_mmap = 1;
+            break;
+        case 'p':
+            if (!strcmp(optarg, "full")) {
+                prealloc = PREALLOC_FULL;
+            }
+            else if (!strcmp(optarg, "sparse")) {
+                prealloc = PREALLOC_SPARSE;
+            }
+            else {
+                argc = 0;
+            }
+            break;
+        default:
+            argc = 0;  // 打印用法
+            break;
+        }
+    }
+
+    if (argc - optind < 2) {
+        printf("Usage: %s [-c cache-MiB] [-r read-cache-MiB] [-u] [-m] [-p full|sparse] <torrent> <port> [slow]\n"
+               "       %s create <path> <piece-size> <tracker>\n", argv[0], argv[0]);
         exit(EXIT_FAILURE);
     }
+    const char *torrent = argv[optind];
+    const char *port = argv[optind + 1];
 
     setbuf(stdout, NULL);
 
@@ -133,14 +229,23 @@ main(int argc, char *argv[])
     }
 
     // 解析种子文件
-    char *bcode = get_torrent_data_from_file(argv[1]);
-    struct BNode *ast = bparser(bcode);
+    size_t bcode_size;
+    char *bcode = get_torrent_data_from_file(torrent, &bcode_size);
+    struct BNode *ast = bparser_arena(bcode, bcode_size);  // 语法树直接引用 bcode
+    if (ast == NULL) {
+        panic("malformed torrent file %s", torrent);
+    }
     puts("Parsed Bencode:");
     print_bcode(ast, 0, 0);
 
     // 创建并初始化 MetaInfo 对象
     mi = calloc(1, sizeof(*mi));
-    if (argc >= 4) {
+    mi->torrent = bcode;
+    mi->torrent_size = bcode_size;
+    mi->fd = -1;
+    mi->cache_size = cache_mb << 20;
+    mi->prealloc = prealloc;
+    if (argc - optind >= 3) {
         mi->slow = 1;
     }
 
@@ -150,7 +255,7 @@ main(int argc, char *argv[])
         perror("create listen socket");
         exit(EXIT_FAILURE);
     }
-    mi->port = (uint16_t)atoi(argv[2]);
+    mi->port = (uint16_t)atoi(port);
     struct sockaddr_in addr = {
             .sin_addr.s_addr = INADDR_ANY,
             .sin_family = AF_INET,
@@ -175,16 +280,22 @@ main(int argc, char *argv[])
     for (int i = 0; i < 20; i++) mi->peer_id[i] = symbol[ (mi->peer_id[i]) % symbol_size ];
     printf("peer-id %s", mi->peer_id);
 
-    // 计算 info hash, 此后不需要源数据
+    // 计算 info hash
     make_info_hash(ast, mi->info_hash);
-    free(bcode);
 
     // 提取相关信息
     extract_trackers(mi, ast);
     extract_pieces(mi, ast);
     metainfo_load_file(mi, ast);
+    if (use_mmap && metainfo_map_file(mi) == -1) {
+        log("failed to map the data file, fall back to read/write");
+    }
+    // 映射模式下页缓存就是读缓存
+    if (read_cache_mb > 0 && mi->map == NULL) {
+        mi->read_cache = readcache_new(mi->nr_pieces, read_cache_mb << 20);
+    }
 
-    // 不再需要种子信息
+    // 不再需要语法树，种子文件映射仍被分片摘要表引用
     free_bnode(&ast);
 
     // 创建用于定时发送 keep-alive 消息的定时器
@@ -223,6 +334,15 @@ main(int argc, char *argv[])
     };
     epoll_ctl(efd, EPOLL_CTL_ADD, mi->timerfd, &ev);
 
+    // 侦听后台磁盘任务的完成通知
+    mi->dio = diskio_new(0);
+    if (use_uring && diskio_use_uring(mi->dio, mi->fd, URING_ENTRIES) == -1) {
+        log("io_uring is unavailable, fall back to pread/pwrite");
+    }
+    ev.data.fd = diskio_eventfd(mi->dio);
+    ev.events = EPOLLIN;
+    epoll_ctl(efd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+
     // 侦听连接请求
     ev.data.fd = mi->listen_fd;
     ev.events = EPOLLIN;
@@ -0,0 +1,100 @@
+/**
+ * @file merkle.c
+ * @brief BitTorrent v2 (BEP 52) 默克尔树的 API 实现
+ */
+
+#include "merkle.h"
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <openssl/sha.h>
+
+/**
+ * @brief 支持的最大树高，足够覆盖 2^63 个叶子
+ */
+#define MAX_HEIGHT 64
+
+static uint8_t zeros[MAX_HEIGHT][MERKLE_HASH_SIZE];  ///< 全零子树的根
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void
+merkle_parent(const uint8_t *left, const uint8_t *right, uint8_t *out)
+{
+    uint8_t pair[2 * MERKLE_HASH_SIZE];
+    memcpy(pair, left, MERKLE_HASH_SIZE);
+    memcpy(pair + MERKLE_HASH_SIZE, right, MERKLE_HASH_SIZE);
+    SHA256(pair, sizeof(pair), out);
+}
+
+static void
+init_zeros(void)
+{
+    for (int h = 1; h < MAX_HEIGHT; h++) {
+        merkle_parent(zeros[h - 1], zeros[h - 1], zeros[h]);
+    }
+}
+
+void
+merkle_leaf(const void *data, size_t size, uint8_t *out)
+{
+    SHA256(data, size, out);
+}
+
+const uint8_t *
+merkle_zero(int height)
+{
+    pthread_once(&once, init_zeros);
+    return zeros[height];
+}
+
+void
+merkle_root(const uint8_t *nodes, size_t nr_nodes, int base, int levels, uint8_t *out)
+{
+    if (nr_nodes == 0) {
+        memcpy(out, merkle_zero(base + levels), MERKLE_HASH_SIZE);
+        return;
+    }
+
+    uint8_t *layer = malloc(nr_nodes * MERKLE_HASH_SIZE);
+    memcpy(layer, nodes, nr_nodes * MERKLE_HASH_SIZE);
+
+    size_t n = nr_nodes;
+    for (int h = base; h < base + levels; h++) {
+        for (size_t i = 0; i < (n + 1) / 2; i++) {
+            const uint8_t *left = layer + 2 * i * MERKLE_HASH_SIZE;
+            const uint8_t *right = 2 * i + 1 < n ? left + MERKLE_HASH_SIZE : merkle_zero(h);
+            merkle_parent(left, right, layer + i * MERKLE_HASH_SIZE);
+        }
+        n = (n + 1) / 2;
+    }
+
+    memcpy(out, layer, MERKLE_HASH_SIZE);
+    free(layer);
+}
+
+void
+merkle_climb(const uint8_t *node, size_t index, const uint8_t *uncles, int nr_uncles, uint8_t *out)
+{
+    uint8_t cur[MERKLE_HASH_SIZE];
+    memcpy(cur, node, MERKLE_HASH_SIZE);
+    for (int i = 0; i < nr_uncles; i++, index >>= 1) {
+        const uint8_t *uncle = uncles + i * MERKLE_HASH_SIZE;
+        if (index & 1) {
+            merkle_parent(uncle, cur, cur);
+        }
+        else {
+            merkle_parent(cur, uncle, cur);
+        }
+    }
+    memcpy(out, cur, MERKLE_HASH_SIZE);
+}
+
+int
+merkle_log2(size_t n)
+{
+    int h = 0;
+    while (((size_t)1 << h) < n) {
+        h++;
+    }
+    return h;
+}
@@ -0,0 +1,68 @@
+/**
+ * @file merkle.h
+ * @brief BitTorrent v2 (BEP 52) 默克尔树的 API 声明
+ *
+ * 叶子是每个 16 KiB 数据块的 SHA-256, 文件末尾之后凑整所需的叶子为全零，
+ * 父结点是左右子结点拼接后的 SHA-256. 高度 h 的结点覆盖 2^h 个叶子。
+ */
+
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/**
+ * @brief SHA-256 摘要的字节数
+ */
+#define MERKLE_HASH_SIZE 32
+
+/**
+ * @brief 叶子对应的数据块大小
+ */
+#define MERKLE_BLOCK_SIZE 0x4000
+
+/**
+ * @brief 计算叶子，即数据块的 SHA-256
+ * @param data 数据块
+ * @param size 字节数，只有文件的最后一块可以不足 MERKLE_BLOCK_SIZE
+ * @param out [OUT] 叶子
+ */
+void merkle_leaf(const void *data, size_t size, uint8_t *out);
+
+/**
+ * @brief 获取全零叶子构成的高度为 height 的子树的根
+ * @param height 高度，0 表示叶子本身
+ * @return 指向静态表中的 MERKLE_HASH_SIZE 字节
+ */
+const uint8_t *merkle_zero(int height);
+
+/**
+ * @brief 从某一层的连续结点向上归约
+ *
+ * 不足 2^levels 个结点时用全零子树的根补齐。
+ *
+ * @param nodes 高度为 base 的连续结点
+ * @param nr_nodes 结点数量，不超过 2^levels
+ * @param base 结点所在的高度
+ * @param levels 向上归约的层数
+ * @param out [OUT] 高度为 base + levels 的根
+ */
+void merkle_root(const uint8_t *nodes, size_t nr_nodes, int base, int levels, uint8_t *out);
+
+/**
+ * @brief 用自底向上的兄弟结点（uncle）把子树的根推到祖先
+ * @param node 子树的根
+ * @param index 子树的根在其所在层中的下标
+ * @param uncles 兄弟结点，共 nr_uncles 个
+ * @param nr_uncles 兄弟结点数量
+ * @param out [OUT] 祖先结点
+ */
+void merkle_climb(const uint8_t *node, size_t index, const uint8_t *uncles, int nr_uncles, uint8_t *out);
+
+/**
+ * @brief 上取整的以 2 为底的对数
+ */
+int merkle_log2(size_t n);
+
+#endif  // MERKLE_H
@@ -3,29 +3,137 @@
  * @brief 操作全局信息的相关 API 实现
  */
 
+#define _GNU_SOURCE       // SEEK_DATA, SEEK_HOLE
 #include "metainfo.h"
 #include "bparser.h"
 #include "butil.h"
 #include "peer.h"
 #include "connect.h"
+#include "diskio.h"
 #include "util.h"
+#include "piecehash.h"
+#include "storage.h"
+#include "readcache.h"
+#include "resume.h"
 #include <string.h>
-#include <openssl/sha.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+void
+free_piece_hasher(struct MetaInfo *mi, struct PieceInfo *piece)
+{
+    struct PieceHasher *hasher = piece->hasher;
+    if (hasher == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < mi->sub_count; i++) {
+        free(hasher->held[i]);
+    }
+    free(hasher->held);
+    free(hasher);
+    piece->hasher = NULL;
+}
+
+void
+free_piece_merkle(struct MetaInfo *mi, struct PieceInfo *piece)
+{
+    struct PieceMerkle *merkle = piece->merkle;
+    if (merkle == NULL) {
+        return;
+    }
+
+    free(merkle->got);
+    free(merkle->want);
+    free(merkle->flags);
+    free(merkle);
+    piece->merkle = NULL;
+}
+
+void
+free_piece_buffer(struct MetaInfo *mi, struct PieceInfo *piece)
+{
+    if (piece->buf == NULL) {
+        return;
+    }
+
+    free(piece->buf);
+    piece->buf = NULL;
+    mi->cache_used -= piece_length(mi, (size_t)(piece - mi->pieces));
+}
+
+void
+free_piece_blame(struct PieceInfo *piece)
+{
+    free(piece->sources);
+    free(piece->suspects);
+    piece->sources = NULL;
+    piece->suspects = NULL;
+}
 
 void
 free_metainfo(struct MetaInfo **pmi)
 {
     struct MetaInfo *mi = *pmi;
     *pmi = NULL;
+    // 先停下磁盘线程池，后台任务可能还在使用分片的缓冲区
+    if (mi->dio) {
+        diskio_free(&mi->dio);
+    }
     if (mi->trackers) {
+        for (size_t i = 0; i < mi->nr_trackers; i++) {
+            free_tracker_reply(&mi->trackers[i]);  // 可能有没收完的响应
+        }
         free(mi->trackers);
     }
     if (mi->pieces) {
+        for (size_t i = 0; i < mi->nr_pieces; i++) {
+            free_piece_hasher(mi, &mi->pieces[i]);
+            free_piece_merkle(mi, &mi->pieces[i]);
+            free_piece_blame(&mi->pieces[i]);
+            free_piece_buffer(mi, &mi->pieces[i]);
+        }
         free(mi->pieces);
     }
+    free(mi->substates);
+    free(mi->bitfield);
+    free(mi->name);
+    free(mi->offenders);
+    if (mi->read_cache) {
+        readcache_free(&mi->read_cache);
+    }
+    if (mi->map) {
+        munmap(mi->map, mi->file_size);
+    }
+    if (mi->storage) {
+        storage_free(&mi->storage);  // 同时关闭 fd
+    }
+    if (mi->torrent) {
+        munmap((void *)mi->torrent, mi->torrent_size);
+    }
     free(mi);
 }
 
+/**
+ * @brief 解析 tracker 的 URL 串
+ *
+ * 语法树中的串可能直接指向源缓冲区而不以 '\0' 结尾，
+ * parse_url() 需要 C 字符串，所以先拷贝一份。
+ *
+ * @param url URL 串结点
+ * @param tracker 要填写的 tracker
+ */
+static void
+parse_tracker_url(const struct BNode *url, struct Tracker *tracker)
+{
+    char *s = strndup(url->s_data, url->s_size);
+    parse_url(s, tracker->method, tracker->host, tracker->port, tracker->request);
+    free(s);
+}
+
 /**
  * 观察实际的种子文件, 发现如果有 announce-list, 那么
  * announce 往往是其中的第一项. 但是 announce-list 本身
@@ -37,18 +145,14 @@ extract_trackers(struct MetaInfo *mi, const struct BNode *ast)
 {
     // 提取 tracker 列表
 
-    const struct BNode *announce_list = query_bcode_by_key(ast, "announce-list");
+    const struct BNode *announce_list = query_bcode_by_path(ast, "announce-list");
 
     if (!announce_list) {
         // 没有 announce-list, 那么就使用 announce
-        const struct BNode *announce = query_bcode_by_key(ast, "announce");
+        const struct BNode *announce = query_bcode_by_path(ast, "announce");
         mi->nr_trackers = 1;
         mi->trackers = calloc(mi->nr_trackers, sizeof(*mi->trackers));
-        parse_url(announce->s_data,
-                  mi->trackers[0].method,
-                  mi->trackers[0].host,
-                  mi->trackers[0].port,
-                  mi->trackers[0].request);
+        parse_tracker_url(announce, &mi->trackers[0]);
     }
     else {
         mi->nr_trackers = 0;
@@ -62,24 +166,278 @@ extract_trackers(struct MetaInfo *mi, const struct BNode *ast)
         mi->trackers = calloc(mi->nr_trackers, sizeof(*mi->trackers));
         struct Tracker *tracker = &mi->trackers[0];
         for (const struct BNode *iter = announce_list; iter; iter = iter->l_next) {
-            parse_url(iter->l_item->l_item->s_data,
-                      tracker->method,
-                      tracker->host,
-                      tracker->port,
-                      tracker->request);
+            parse_tracker_url(iter->l_item->l_item, tracker);
             tracker++;
         }
     }
 }
 
+/**
+ * @brief 把线性区间 [from, to) 涉及的分片标记为 value
+ */
+static void
+mark_pieces(struct MetaInfo *mi, uint8_t *skip, off_t from, off_t to, uint8_t value)
+{
+    if (from >= to) {
+        return;
+    }
+    size_t last = (size_t)(to - 1) / mi->piece_size;
+    for (size_t i = (size_t)from / mi->piece_size; i <= last && i < mi->nr_pieces; i++) {
+        skip[i] = value;
+    }
+}
+
+/**
+ * @brief 找出不必或者不能校验的分片
+ *
+ * 用 SEEK_DATA / SEEK_HOLE 遍历每个文件的数据区间，与任何数据区间有交集的分片
+ * 都要校验，其余分片从未写入过，不必读取。文件系统不支持时整个文件
+ * 都被当作数据（内核的通用实现即如此），所以结果总是保守的。
+ * 与缺失的文件或者文件缺失的尾部有交集的分片一定不完整，也不读取。
+ *
+ * @param mi 全局信息，存储层已经创建
+ * @param skip [OUT] 每个分片一个字节，1 表示分片不必校验
+ * @return 不必校验的分片的数量
+ */
+static size_t
+find_hole_pieces(struct MetaInfo *mi, uint8_t *skip)
+{
+    struct Storage *st = mi->storage;
+    off_t *avail = calloc(st->nr_files, sizeof(*avail));
+    memset(skip, 1, mi->nr_pieces);
+
+    for (size_t f = 0; f < st->nr_files; f++) {
+        const struct StorageFile *file = &st->files[f];
+        int fd = file->length > 0 ? storage_acquire(st, f) : -1;
+        struct stat sb;
+        if (fd == -1 || fstat(fd, &sb) == -1) {
+            if (fd != -1) storage_release(st, f);
+            continue;
+        }
+        avail[f] = sb.st_size < (off_t)file->length ? sb.st_size : (off_t)file->length;
+
+        off_t pos = 0;
+        while (pos < avail[f]) {
+            off_t data = lseek(fd, pos, SEEK_DATA);
+            if (data == -1) {
+                if (errno != ENXIO) {  // 不支持，全部当作数据
+                    perror("lseek SEEK_DATA");
+                    mark_pieces(mi, skip, file->offset + pos, file->offset + avail[f], 0);
+                }
+                break;  // 之后全是空洞
+            }
+            if (data >= avail[f]) {
+                break;
+            }
+
+            off_t hole = lseek(fd, data, SEEK_HOLE);
+            if (hole == -1 || hole > avail[f]) {
+                hole = avail[f];
+            }
+            mark_pieces(mi, skip, file->offset + data, file->offset + hole, 0);
+            pos = hole;
+        }
+        storage_release(st, f);
+    }
+
+    for (size_t f = 0; f < st->nr_files; f++) {
+        const struct StorageFile *file = &st->files[f];
+        mark_pieces(mi, skip, file->offset + avail[f], file->offset + (off_t)file->length, 1);
+    }
+    free(avail);
+
+    size_t nr_skip = 0;
+    for (size_t i = 0; i < mi->nr_pieces; i++) {
+        nr_skip += skip[i];
+    }
+    return nr_skip;
+}
+
+/**
+ * @brief 多线程重新校验已有的数据文件
+ * @param mi 全局信息
+ * @return 校验通过的分片的总字节数
+ */
+static size_t
+recheck_file(struct MetaInfo *mi)
+{
+    size_t finished = 0;
+    size_t nr_check = mi->nr_pieces;
+
+    // 从未写入过或者不完整的分片不读取，直接算作缺失
+    uint8_t *skip = malloc(nr_check + 1);
+    size_t nr_skip = find_hole_pieces(mi, skip);
+    log("%lu / %lu pieces lie in holes or missing files", nr_skip, nr_check);
+
+    uint8_t *md = malloc(nr_check * HASH_SIZE + 1);
+    if (nr_check > nr_skip
+            && hash_pieces(mi->storage, mi->file_size, mi->piece_size, md, 0, "recheck", skip) == -1) {
+        err("failed to recheck %s, treat it as empty", mi->name);
+        nr_check = 0;
+    }
+
+    size_t nr_ok = 0;
+    for (size_t i = 0; i < nr_check; i++) {
+        if (!skip[i] && memcmp(md + i * HASH_SIZE, piece_hash(mi, i), HASH_SIZE) == 0) {  // 分片正确
+            mi->pieces[i].is_downloaded = 1;
+            finished += piece_length(mi, i);
+            set_bit(mi->bitfield, i);
+            nr_ok++;
+        }
+    }
+    free(md);
+    free(skip);
+    log("%lu / %lu pieces ok", nr_ok, mi->nr_pieces);
+
+    return finished;
+}
+
+/**
+ * @brief 把可写的数据文件扩展到完整大小
+ *
+ * PREALLOC_FULL 用 fallocate 分配全部空间，已有的数据和空洞里的零不受影响，
+ * 空间不足在启动时就会发现，而不是下载到一半才失败；文件系统不支持时
+ * 退回到稀疏文件。PREALLOC_SPARSE 只用 ftruncate 设置大小，不缩短已有文件。
+ *
+ * @param mi 全局信息
+ * @param fd 数据文件描述符
+ * @param length 文件的完整大小
+ * @param path 文件路径，用于提示
+ */
+static void
+prealloc_file(struct MetaInfo *mi, int fd, size_t length, const char *path)
+{
+    if (mi->prealloc == PREALLOC_FULL && length > 0) {
+        if (fallocate(fd, 0, 0, (off_t)length) == 0) {
+            log("allocated %lu bytes for %s", length, path);
+            return;
+        }
+        if (errno != EOPNOTSUPP) {
+            perror("fallocate");
+            exit(EXIT_FAILURE);
+        }
+        err("%s does not support fallocate, fall back to a sparse file", path);
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    if ((size_t)sb.st_size < length && ftruncate(fd, (off_t)length) == -1) {
+        perror("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief 检查路径的一个分量，不允许逃出下载目录
+ */
+static void
+check_path_component(const char *s, size_t size)
+{
+    if (size == 0 || memchr(s, '/', size) != NULL || memchr(s, '\0', size) != NULL
+            || (size == 1 && s[0] == '.') || (size == 2 && s[0] == '.' && s[1] == '.')) {
+        panic("unsafe path component '%.*s' in torrent", (int)size, s);
+    }
+}
+
+/**
+ * @brief 按路径比较两个文件指针，供 qsort 使用
+ */
+static int
+compare_file_path(const void *x, const void *y)
+{
+    const struct StorageFile *a = *(const struct StorageFile *const *)x;
+    const struct StorageFile *b = *(const struct StorageFile *const *)y;
+    return strcmp(a->path, b->path);
+}
+
+/**
+ * @brief 检查文件列表中没有重复的路径，否则两个文件会写到同一个文件里
+ */
+static void
+check_duplicate_paths(const struct Storage *st)
+{
+    const struct StorageFile **sorted = malloc(st->nr_files * sizeof(*sorted));
+    for (size_t i = 0; i < st->nr_files; i++) {
+        sorted[i] = &st->files[i];
+    }
+    qsort(sorted, st->nr_files, sizeof(*sorted), compare_file_path);
+    for (size_t i = 1; i < st->nr_files; i++) {
+        if (strcmp(sorted[i - 1]->path, sorted[i]->path) == 0) {
+            panic("duplicate file path '%s' in torrent", sorted[i]->path);
+        }
+    }
+    free(sorted);
+}
+
+/**
+ * @brief 按种子的文件列表创建存储层
+ *
+ * 单文件种子只有一个以 info.name 命名的文件；多文件种子的每个文件位于
+ * info.name 目录下，路径由 path 列表的各个分量拼接而成。
+ *
+ * @param mi 全局信息，文件名和总长度已经提取
+ * @param ast B 编码语法树
+ */
+static void
+create_storage(struct MetaInfo *mi, const struct BNode *ast)
+{
+    mi->storage = storage_new(0);
+    check_path_component(mi->name, strlen(mi->name));
+
+    const struct BNode *files = query_bcode_by_path(ast, "info.files");
+    if (files == NULL) {
+        storage_add_file(mi->storage, mi->name, mi->file_size);
+        return;
+    }
+    if (files->type != B_LIST) {
+        panic("malformed file list in torrent");
+    }
+
+    for (const struct BNode *iter = files; iter && iter->l_item; iter = iter->l_next) {
+        const struct BNode *length = query_bcode_by_path(iter->l_item, "length");
+        const struct BNode *path = query_bcode_by_path(iter->l_item, "path");
+        if (length == NULL || path == NULL || path->type != B_LIST) {
+            panic("malformed file entry in torrent");
+        }
+
+        size_t size = strlen(mi->name) + 1;
+        for (const struct BNode *comp = path; comp && comp->l_item; comp = comp->l_next) {
+            if (comp->l_item->type != B_STR) {
+                panic("malformed path component in torrent");
+            }
+            check_path_component(comp->l_item->s_data, comp->l_item->s_size);
+            size += comp->l_item->s_size + 1;
+        }
+        if (size == strlen(mi->name) + 1) {
+            panic("malformed file entry in torrent");
+        }
+
+        char *full = malloc(size);
+        char *p = full + sprintf(full, "%s", mi->name);
+        for (const struct BNode *comp = path; comp && comp->l_item; comp = comp->l_next) {
+            p += sprintf(p, "/%.*s", (int)comp->l_item->s_size, comp->l_item->s_data);
+        }
+        storage_add_file(mi->storage, full, (size_t)length->i);
+        free(full);
+    }
+    check_duplicate_paths(mi->storage);
+    log("%lu files", mi->storage->nr_files);
+}
+
 void
 metainfo_load_file(struct MetaInfo *mi, const struct BNode *ast)
 {
-    const struct BNode *name = query_bcode_by_key(ast, "name");
+    const struct BNode *name_node = query_bcode_by_path(ast, "info.name");
+    char *name = strndup(name_node->s_data, name_node->s_size);
+    mi->name = name;
 
-    log("filename: %s", name->s_data);
+    log("filename: %s", name);
 
-    FILE *fp = fopen(name->s_data, "rb");
+    create_storage(mi, ast);
+    struct Storage *st = mi->storage;
 
     // This variable record the downloaded pieces' size.
     // We do not use MetaInfo::downloaded as that field is only for data exchanging
@@ -87,47 +445,136 @@ metainfo_load_file(struct MetaInfo *mi, const struct BNode *ast)
     // client is seeding.
     size_t finished = 0;
 
-    if (fp != NULL) {  // 已有下载文件，检查分片 SHA1
-        uint8_t *piece = malloc(mi->piece_size);  // piece data buffer
-        uint8_t md[HASH_SIZE];  // sha1 buffer
+    struct stat sb;
+    if (storage_stat(st, &sb) == 0) {  // 已有下载文件，优先采用续传文件，否则多线程检查分片 SHA1
+        ssize_t resumed = resume_load(mi, &sb);
+        finished = resumed >= 0 ? (size_t)resumed : recheck_file(mi);
+    }
+
+    if (finished == mi->file_size) {
+        log("file has been downloaded");
+    }
+    else {  // 有不正确的分片，或者文件不完整，以可写方式打开，缺少的文件这时创建
+        if (storage_open(st, O_RDWR) == -1) {
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < st->nr_files; i++) {
+            int fd = storage_acquire(st, i);
+            if (fd == -1) {
+                exit(EXIT_FAILURE);
+            }
+            prealloc_file(mi, fd, st->files[i].length, st->files[i].path);
+            storage_release(st, i);
+        }
+    }
 
-        size_t nr_read;
-        int piece_index = 0;
-        while ((nr_read = fread(piece, 1, mi->piece_size, fp)) != 0) {  // EOF 退出，容许不足
-            SHA1(piece, nr_read, md);
+    // 单文件种子一直钉住唯一的描述符，供 mmap, io_uring 等直接使用
+    if (st->nr_files == 1) {
+        mi->fd = storage_acquire(st, 0);
+        if (mi->fd == -1) {
+            exit(EXIT_FAILURE);
+        }
+    }
 
-            printf("piece %d: %lu bytes", piece_index, nr_read);
+    mi->left = mi->file_size - finished;
+}
 
-            if (memcmp(md, mi->pieces[piece_index].hash, HASH_SIZE) == 0) {  // 分片正确
-                mi->pieces[piece_index].is_downloaded = 1;
-                finished += nr_read;
-                set_bit(mi->bitfield, piece_index);
-                printf(" ok");
-            }
+int
+metainfo_map_file(struct MetaInfo *mi)
+{
+    int is_seeding = mi->left == 0;
+    if (mi->fd == -1) {
+        err("multi-file torrents cannot be mapped as a whole");
+        return -1;
+    }
 
-            printf("\n");
+    struct stat sb;
+    if (fstat(mi->fd, &sb) == -1) {
+        perror("fstat");
+        return -1;
+    }
+    if ((size_t)sb.st_size < mi->file_size && ftruncate(mi->fd, (off_t)mi->file_size) == -1) {
+        perror("ftruncate");
+        return -1;
+    }
 
-            piece_index++;
-        }
+    int prot = is_seeding ? PROT_READ : PROT_READ | PROT_WRITE;
+    void *map = mmap(NULL, mi->file_size, prot, MAP_SHARED, mi->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap data file");
+        return -1;
+    }
+    madvise(map, mi->file_size, is_seeding ? MADV_RANDOM : MADV_SEQUENTIAL);
 
-        if (finished == mi->file_size) {
-            log("file has been downloaded");
-            mi->file = fp;
-            return;
+    mi->map = map;
+    log("data file mapped, %s access", is_seeding ? "random" : "sequential");
+    return 0;
+}
+
+/**
+ * @brief 提取 hybrid 种子的 v2 默克尔树信息
+ *
+ * 只支持单文件：info.file tree 中与 info.name 同名的文件项给出 pieces root,
+ * 多于一个分片时顶层 piece layers 字典以 pieces root 为键给出分片层。
+ * 没有 v1 分片表的纯 v2 种子不支持。
+ *
+ * @param mi 全局信息，v1 分片信息已经提取
+ * @param ast B 编码语法树
+ */
+static void
+extract_merkle(struct MetaInfo *mi, const struct BNode *ast)
+{
+    const struct BNode *version = query_bcode_by_path(ast, "info.meta version");
+    if (version == NULL) {
+        return;
+    }
+    if (version->type != B_INT || version->i != 2) {
+        panic("unsupported meta version");
+    }
+    if (mi->hashes == NULL) {
+        panic("pure v2 torrents are not supported");
+    }
+    if (query_bcode_by_path(ast, "info.files") != NULL) {
+        log("multi-file hybrid torrent, verify with v1 piece hashes only");
+        return;
+    }
+    if (mi->piece_size < MERKLE_BLOCK_SIZE || (mi->piece_size & (mi->piece_size - 1)) != 0) {
+        panic("v2 piece length %u is not a power of two no less than 16KiB", mi->piece_size);
+    }
+
+    const struct BNode *name = query_bcode_by_path(ast, "info.name");
+    const struct BNode *file_tree = query_bcode_by_path(ast, "info.file tree");
+    const struct BNode *entry = bdict_get(bdict_get(file_tree, name->s_data, name->s_size), "", 0);
+    const struct BNode *length = bdict_get(entry, "length", 6);
+    const struct BNode *root = bdict_get(entry, "pieces root", 11);
+    if (!length || !root || root->s_size != MERKLE_HASH_SIZE || (size_t)length->i != mi->file_size) {
+        panic("file tree does not describe the single file %.*s", (int)name->s_size, name->s_data);
+    }
+    mi->pieces_root = (const uint8_t *)root->s_data;
+
+    if (mi->nr_pieces == 1) {
+        // 只有一个分片时树就是这个分片，叶子按实际子分片数凑整
+        mi->piece_height = merkle_log2((mi->file_size - 1) / MERKLE_BLOCK_SIZE + 1);
+    }
+    else {
+        mi->piece_height = merkle_log2(mi->piece_size / MERKLE_BLOCK_SIZE);
+        const struct BNode *layers = query_bcode_by_path(ast, "piece layers");
+        const struct BNode *layer = bdict_get(layers, root->s_data, MERKLE_HASH_SIZE);
+        if (layer == NULL || layer->s_size != mi->nr_pieces * MERKLE_HASH_SIZE) {
+            panic("piece layer does not match %lu pieces", mi->nr_pieces);
         }
-        else {  // 有不正确的分片，或者文件不完整，重新以可写方式打开。
-            fclose(fp);
-            mi->file = fopen(name->s_data, "rb+");  // read, write, no trunc
+
+        uint8_t md[MERKLE_HASH_SIZE];
+        merkle_root((const uint8_t *)layer->s_data, mi->nr_pieces,
+                    mi->piece_height, merkle_log2(mi->nr_pieces), md);
+        if (memcmp(md, mi->pieces_root, MERKLE_HASH_SIZE) != 0) {
+            panic("piece layer does not match pieces root");
         }
-    }
-    else {  // 没有下载文件，放心 trunc
-        mi->file = fopen(name->s_data, "wb");
-        fwrite("hello", 1, 5, mi->file);
-        fclose(mi->file);
-        mi->file = fopen(name->s_data, "rb+");
+        mi->piece_layer = (const uint8_t *)layer->s_data;
     }
 
-    mi->left = mi->file_size - finished;
+    mi->is_v2 = 1;
+    log("hybrid torrent, piece height %d", mi->piece_height);
 }
 
 void
@@ -135,12 +582,22 @@ extract_pieces(struct MetaInfo *mi, const struct BNode *ast)
 {
     // 提取分片信息
 
-    const struct BNode *length_node = query_bcode_by_key(ast, "length");
+    const struct BNode *length_node = query_bcode_by_path(ast, "info.length");
+    const struct BNode *files = query_bcode_by_path(ast, "info.files");
     if (length_node) {
         mi->file_size = (size_t)length_node->i;
     }
+    else {  // 多文件种子，所有文件首尾相接
+        for (const struct BNode *iter = files; iter && iter->l_item; iter = iter->l_next) {
+            const struct BNode *length = query_bcode_by_path(iter->l_item, "length");
+            if (length == NULL || length->type != B_INT || length->i < 0) {
+                panic("malformed file length in torrent");
+            }
+            mi->file_size += (size_t)length->i;
+        }
+    }
 
-    const struct BNode *piece_length_node = query_bcode_by_key(ast, "piece length");
+    const struct BNode *piece_length_node = query_bcode_by_path(ast, "info.piece length");
     if (piece_length_node) {
         mi->piece_size = (uint32_t)piece_length_node->i;
     }
@@ -159,17 +616,22 @@ extract_pieces(struct MetaInfo *mi, const struct BNode *ast)
 
     log("sub_size %d, sub_count %lu", mi->sub_size, mi->sub_count);
 
-    const struct BNode *pieces_node = query_bcode_by_key(ast, "pieces");
+    // 分片摘要表直接引用语法树指向的源数据（种子文件映射），不做拷贝
+    const struct BNode *pieces_node = query_bcode_by_path(ast, "info.pieces");
     if (pieces_node) {
+        if (pieces_node->s_size != mi->nr_pieces * HASH_SIZE) {
+            panic("pieces length %lu does not match %lu pieces", pieces_node->s_size, mi->nr_pieces);
+        }
+        mi->hashes = (const uint8_t *)pieces_node->s_data;
         mi->pieces = calloc(mi->nr_pieces, sizeof(*mi->pieces));
-        const char *hash = pieces_node->s_data;
-        for (int i = 0; i < mi->nr_pieces; i++) {
-            memcpy(mi->pieces[i].hash, hash, HASH_SIZE);
-            hash += HASH_SIZE;
-            // 最后一个分片可能会造成空间冗余，即子分片不足 sub_count, 但是没有副作用。
-            mi->pieces[i].substate = calloc(mi->sub_count, sizeof(*mi->pieces[i].substate));
+        // 最后一个分片可能会造成空间冗余，即子分片不足 sub_count, 但是没有副作用。
+        mi->substates = calloc(mi->nr_pieces * mi->sub_count, sizeof(*mi->substates));
+        for (size_t i = 0; i < mi->nr_pieces; i++) {
+            mi->pieces[i].substate = mi->substates + i * mi->sub_count;
         }
     }
+
+    extract_merkle(mi, ast);
 }
 
 void
@@ -203,6 +665,9 @@ del_peer_by_fd(struct MetaInfo *mi, int fd)
     }
 
     if (peer != NULL) {
+        if (peer->block_owned) {
+            diskio_free_buf(mi->dio, peer->block);  // 没有读完的 PIECE 报文
+        }
         peer_free(&peer);
     }
 
@@ -344,3 +809,30 @@ rm_wait_peer(struct MetaInfo *mi, int index)
     }
     mi->nr_wait_peers--;
 }
+
+int
+add_strike(struct MetaInfo *mi, uint32_t addr)
+{
+    for (int i = 0; i < mi->nr_offenders; i++) {
+        if (mi->offenders[i].addr == addr) {
+            return ++mi->offenders[i].strikes;
+        }
+    }
+
+    mi->offenders = realloc(mi->offenders, (mi->nr_offenders + 1) * sizeof(*mi->offenders));
+    mi->offenders[mi->nr_offenders].addr = addr;
+    mi->offenders[mi->nr_offenders].strikes = 1;
+    mi->nr_offenders++;
+    return 1;
+}
+
+int
+is_banned(const struct MetaInfo *mi, uint32_t addr)
+{
+    for (int i = 0; i < mi->nr_offenders; i++) {
+        if (mi->offenders[i].addr == addr) {
+            return mi->offenders[i].strikes >= BAN_STRIKES;
+        }
+    }
+    return 0;
+}
@@ -9,6 +9,8 @@
 #include <stdio.h>
 #include <time.h>
 #include <inttypes.h>
+#include "sha1.h"
+#include "merkle.h"
 
 /**
  * @brief SHA1 HASH 的字节数
@@ -16,6 +18,10 @@
 #define HASH_SIZE 20
 
 struct BNode;
+struct TrackerReply;
+struct DiskIO;
+struct Storage;
+struct ReadCache;
 
 /** @brief 描述 tracker 的相关信息 */
 struct Tracker
@@ -26,6 +32,7 @@ struct Tracker
     char request[128];      ///< 请求 url （一般是 /announce, 默认 / ）
     int sfd;                ///< socket file descriptor, 默认为 -1. 主要用于搜索, 会频繁重置.
     int timerfd;            ///< 定时器描述符，用于在 epoll 里处理定时事件。
+    struct TrackerReply *reply; ///< 正在接收的 HTTP 响应，没有时为 NULL
 };
 
 /** 子分片没有开始下载 */
@@ -35,11 +42,55 @@ struct Tracker
 /** 子分片完成下载 */
 #define SUB_FINISH 2
 
+/**
+ * @brief 分片的增量 SHA1 状态
+ *
+ * 子分片按顺序到达时直接喂给 ctx, 乱序到达的子分片拷贝到 held 中，
+ * 等前面的空缺补上后再依次喂入，这样分片完成时不需要从磁盘读回。
+ * 最坏情况下 held 暂存接近一个分片的数据。
+ */
+struct PieceHasher
+{
+    struct Sha1Ctx ctx;    ///< 已按序喂入部分的摘要状态
+    size_t next_sub;       ///< 下一个要喂入的子分片号
+    uint8_t **held;        ///< 暂存的乱序子分片，sub_count 项，每项前 4 字节是长度
+};
+
+/** 子分片的叶子已经计算，见 PieceMerkle::got */
+#define LEAF_GOT 1
+/** 子分片的期望叶子已经得到证明，见 PieceMerkle::want */
+#define LEAF_WANT 2
+
+/**
+ * @brief v2 种子中下载中分片的默克尔树状态
+ *
+ * 每个子分片到达时计算叶子：已知期望叶子时当场比较，不符的子分片直接丢弃重新请求；
+ * 否则先记下，分片完成时由叶子归约出的根与分片层比较。根不符时向 peer 请求
+ * 这个分片的叶子（hash request），拿到经过证明的叶子后只重新请求不符的子分片。
+ */
+struct PieceMerkle
+{
+    uint8_t *got;          ///< 已写入的子分片的叶子，sub_count 项
+    uint8_t *want;         ///< 经过证明的期望叶子，sub_count 项
+    uint8_t *flags;        ///< 每个子分片的 LEAF_GOT | LEAF_WANT
+    int nr_requested;      ///< 已发出但还没有回应的 hash request 数量
+    int failed_ticks;      ///< 根不符后等待叶子经过的定时周期数，0 表示没有失败
+};
+
+/**
+ * @brief 校验失败时一个子分片的来源和内容摘要
+ */
+struct BlockRecord
+{
+    uint32_t addr;               ///< 来源 peer 的 ip 地址，网络字节序，0 表示未知
+    uint8_t md[HASH_SIZE];       ///< 当时写入的数据的 SHA1 摘要
+};
+
 /**
  * @brief 分片信息
  *
- * hash 在一开始构造 metainfo 时从 B 编码树上获取并记录。
- * nr_owners 在处理 bitfield 和 have 报文时进行更新。
+ * 分片的 SHA1 摘要不在这里保存，而是直接引用种子文件映射中的 pieces 串，
+ * 见 piece_hash()。nr_owners 在处理 bitfield 和 have 报文时进行更新。
  *
  * 使用文件作为保存数据的临时空间，主要出于内存消耗以及
  * 断点续传的考虑，但是计算 hash 不是很方便。
@@ -48,10 +99,36 @@ struct Tracker
  */
 struct PieceInfo
 {
-    unsigned char  hash[HASH_SIZE]; ///< 该分片的 SHA1 摘要。
     int            nr_owners;       ///< 该分片拥有者的数量。
     int            is_downloaded;   ///< 标记该分片是否已经完成下载：1 - 已下载，0 - 未完成。
-    unsigned char *substate;        ///< 标记子分片完成情况： SUB_NA - 未下载，SUB_DOWNLOAD - 下载中，SUB_FINISH - 下载完成。
+    unsigned char *substate;        ///< 标记子分片完成情况： SUB_NA - 未下载，SUB_DOWNLOAD - 下载中，SUB_FINISH - 下载完成。指向 MetaInfo::substates.
+    struct PieceHasher *hasher;     ///< 下载中分片的增量摘要，在收到第一个子分片时分配，NULL 表示没有。
+    struct PieceMerkle *merkle;     ///< v2 种子中下载中分片的默克尔树状态，按需分配，NULL 表示没有。
+    uint8_t *buf;                   ///< 下载中分片的内存缓冲区，校验通过后一次写盘；NULL 表示子分片直接写盘。
+    int nr_writes;                  ///< 已提交但还没有完成的写盘任务数，写完之前不结算分片。
+    int is_rewriting;               ///< 有子分片在写盘期间被丢弃，写完之前不再请求，以免新旧数据的写盘乱序。
+    uint32_t *sources;              ///< 每个子分片的来源 peer 的 ip 地址，0 表示未知，写入第一个子分片时分配。
+    struct BlockRecord *suspects;   ///< 上次校验失败时各子分片的来源和摘要，分片通过校验时用来找出坏数据的来源。
+    int is_blaming;                 ///< 校验失败后正在后台计算各子分片的摘要，算完之前不重新下载。
+};
+
+/** 数据文件用 ftruncate 扩展到完整大小，空间在写入时才分配（稀疏文件） */
+#define PREALLOC_SPARSE 0
+/** 数据文件用 fallocate 一次分配全部空间 */
+#define PREALLOC_FULL 1
+
+/**
+ * @brief 发送过坏数据的次数达到这个值就断开并拒绝这个 ip 地址
+ */
+#define BAN_STRIKES 2
+
+/**
+ * @brief 发送过坏数据的 peer
+ */
+struct Offender
+{
+    uint32_t addr;    ///< ip 地址，网络字节序
+    int strikes;      ///< 被证实发送坏数据的次数
 };
 
 /**
@@ -81,12 +158,23 @@ struct WaitPeer
  */
 struct MetaInfo
 {
-    size_t file_size;                   ///< 数据文件大小
+    size_t file_size;                   ///< 数据文件大小，多文件种子是全部文件的总长度
     size_t downloaded;                  ///< 已完成文件大小
     size_t left;                        ///< 未完成文件大小
     size_t uploaded;                    ///< 上传文件大小
-    FILE *file;                         ///< 下载文件
+    struct Storage *storage;            ///< 数据文件存储层，把线性的分片空间映射到种子的各个文件
+    int fd;                             ///< 单文件种子的数据文件描述符（由 storage 管理），多文件种子或者还没有打开时为 -1
+    uint8_t *map;                       ///< mmap 模式下数据文件的共享映射，NULL 表示不使用
+    int prealloc;                       ///< 数据文件的空间分配方式：PREALLOC_SPARSE 或者 PREALLOC_FULL
+    char *name;                         ///< 下载文件名，续传文件名在此基础上加 .resume
     unsigned char info_hash[HASH_SIZE]; ///< 整个 info 字典的 sha1 摘要
+    const char *torrent;                ///< 种子文件的只读映射，整个运行期间有效
+    size_t torrent_size;                ///< 种子文件大小
+    const uint8_t *hashes;              ///< 分片 SHA1 表，直接指向 torrent 中的 pieces 串
+    int is_v2;                          ///< 是否是 v2 (hybrid) 种子，是则按子分片校验默克尔树
+    const uint8_t *pieces_root;         ///< 文件默克尔树的根，指向 torrent 中的 pieces root 串
+    const uint8_t *piece_layer;         ///< 分片层，指向 torrent 中 piece layers 的串；只有一个分片时为 NULL
+    int piece_height;                   ///< 分片层在默克尔树中的高度，即每个分片 2^piece_height 个叶子
 
     uint32_t piece_size;                ///< 分片大小
     size_t nr_pieces;                   ///< 分片数量，由 file_size 和 piece_size 计算得出，上取整
@@ -94,6 +182,7 @@ struct MetaInfo
     uint32_t sub_size;                  ///< 子分片的大小，使用统一大小的子分片以简化实现
     size_t sub_count;                   ///< 子分片的数量
     struct PieceInfo *pieces;           ///< 分片信息数组
+    unsigned char *substates;           ///< 所有分片的子分片状态，每个分片 sub_count 项，一次分配
     uint8_t *bitfield;                  ///< 分片完成情况位图
     uint8_t peer_id[21];                ///< random-generated peer-id, the extra 21th byte is '\0' used by host.
 
@@ -104,11 +193,86 @@ struct MetaInfo
     struct Peer **peers;                ///< 已握手 peer 的集合
     int nr_wait_peers;                  ///< 已发出 connect 的 peer 数量
     struct WaitPeer *wait_peers;        ///< 已发出 connect 的 peer 集合
+    int nr_offenders;                   ///< offenders 数组的大小
+    struct Offender *offenders;         ///< 发送过坏数据的 peer, 按 ip 地址记录
     size_t nr_trackers;                 ///< tracker 数量
     struct Tracker *trackers;           ///< tracker 数组
     int slow;                           ///< 是否开启慢速模式
+    struct DiskIO *dio;                 ///< 后台磁盘任务线程池（分片校验）
+    size_t cache_size;                  ///< 分片缓冲区总量的上限，达到后新的分片直接写盘
+    size_t cache_used;                  ///< 已分配的分片缓冲区总量，包括正在写盘的
+    struct ReadCache *read_cache;       ///< 做种读缓存，NULL 表示不缓存
 };
 
+/**
+ * @brief 获取分片的 SHA1 摘要
+ * @param mi 全局信息
+ * @param index 分片号
+ * @return 指向种子文件映射中的 HASH_SIZE 字节摘要
+ */
+static inline const uint8_t *
+piece_hash(const struct MetaInfo *mi, size_t index)
+{
+    return mi->hashes + index * HASH_SIZE;
+}
+
+/**
+ * @brief 获取分片在 v2 默克尔树中的结点（分片层的哈希）
+ * @param mi 全局信息，要求 is_v2
+ * @param index 分片号
+ * @return 指向种子文件映射中的 MERKLE_HASH_SIZE 字节
+ */
+static inline const uint8_t *
+piece_root(const struct MetaInfo *mi, size_t index)
+{
+    return mi->piece_layer ? mi->piece_layer + index * MERKLE_HASH_SIZE : mi->pieces_root;
+}
+
+/**
+ * @brief 获取分片的实际长度，只有最后一个分片可能不足 piece_size
+ * @param mi 全局信息
+ * @param index 分片号
+ * @return 分片字节数
+ */
+static inline size_t
+piece_length(const struct MetaInfo *mi, size_t index)
+{
+    return (index == mi->nr_pieces - 1) ? mi->file_size - index * mi->piece_size : mi->piece_size;
+}
+
+/**
+ * @brief 释放分片的增量摘要状态
+ * @param mi 全局信息
+ * @param piece 分片，之后 hasher 为 NULL
+ */
+void free_piece_hasher(struct MetaInfo *mi, struct PieceInfo *piece);
+
+/**
+ * @brief 释放分片的默克尔树状态
+ * @param mi 全局信息
+ * @param piece 分片，之后 merkle 为 NULL
+ */
+void free_piece_merkle(struct MetaInfo *mi, struct PieceInfo *piece);
+
+/**
+ * @brief 释放分片的内存缓冲区
+ * @param mi 全局信息
+ * @param piece 分片，之后 buf 为 NULL
+ */
+void free_piece_buffer(struct MetaInfo *mi, struct PieceInfo *piece);
+
+/**
+ * @brief 释放分片的坏数据追查状态（sources 和 suspects）
+ * @param piece 分片
+ */
+void free_piece_blame(struct PieceInfo *piece);
+
+/**
+ * @brief 释放 tracker 的响应接收状态，包括没有收完的响应（实现见 bittorrent.c）
+ * @param tracker 指向 tracker
+ */
+void free_tracker_reply(struct Tracker *tracker);
+
 /** @brief 释放全局信息 */
 void free_metainfo(struct MetaInfo **pmi);
 
@@ -119,11 +283,35 @@ void free_metainfo(struct MetaInfo **pmi);
  */
 void extract_trackers(struct MetaInfo *mi, const struct BNode *ast);
 
-/** @brief 获取文件名，读取文件，分析已经完成的块 */
+/**
+ * @brief 获取文件名，打开文件，恢复已完成的分片
+ *
+ * 续传文件与数据文件一致时直接采用，否则多线程重新校验已有的分片。
+ * 没有下载完成的数据文件按 MetaInfo::prealloc 扩展到完整大小。
+ *
+ * @param mi 全局信息
+ * @param ast B 编码语法树
+ */
 void metainfo_load_file(struct MetaInfo *mi, const struct BNode *ast);
 
+/**
+ * @brief 把数据文件整个映射到内存 (mmap 模式)
+ *
+ * 文件不足 file_size 时先扩展，以免访问映射越界 (SIGBUS).
+ * 下载期间提示顺序访问，已经下载完成（只做种）时提示随机访问。
+ * 映射失败时退回到普通读写。
+ *
+ * @param mi 全局信息，要求已经调用 metainfo_load_file()
+ * @return 成功返回 0, 失败返回 -1
+ */
+int metainfo_map_file(struct MetaInfo *mi);
+
 /**
  * @brief 提取分片 hash
+ *
+ * 带有 meta version 2 的 hybrid 种子同时提取 v2 的 pieces root 和分片层，
+ * 并确认分片层归约后与 pieces root 一致。
+ *
  * @param mi 全局信息
  * @param ast B 编码语法树
  */
@@ -219,4 +407,20 @@ int get_wait_peer_fd(struct MetaInfo *mi, uint32_t addr, uint16_t port);
 /** @brief 删除等待 peer */
 void rm_wait_peer(struct MetaInfo *mi, int index);
 
+/**
+ * @brief 记录一个 ip 地址发送了一次坏数据
+ * @param mi 全局信息
+ * @param addr ip 地址，网络字节序
+ * @return 该地址累计的次数
+ */
+int add_strike(struct MetaInfo *mi, uint32_t addr);
+
+/**
+ * @brief 检查 ip 地址是否已被拒绝
+ * @param mi 全局信息
+ * @param addr ip 地址，网络字节序
+ * @return 累计次数达到 BAN_STRIKES 返回 1, 否则返回 0
+ */
+int is_banned(const struct MetaInfo *mi, uint32_t addr);
+
 #endif  // METAINFO_H
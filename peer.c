@@ -7,72 +7,160 @@
 #include "util.h"
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 
-const char *bt_types[] =
-{
-    "CHOKE",
-    "UNCHOKE",
-    "INTERESTED",
-    "NOT_INTERESTED",
-    "HAVE",
-    "BITFIELD",
-    "REQUEST",
-    "PIECE",
-    "CANCEL",
+const char *bt_types[NR_BT_TYPES] =
+{
+    [BT_CHOKE]          = "CHOKE",
+    [BT_UNCHOKE]        = "UNCHOKE",
+    [BT_INTERESTED]     = "INTERESTED",
+    [BT_NOT_INTERESTED] = "NOT_INTERESTED",
+    [BT_HAVE]           = "HAVE",
+    [BT_BITFIELD]       = "BITFIELD",
+    [BT_REQUEST]        = "REQUEST",
+    [BT_PIECE]          = "PIECE",
+    [BT_CANCEL]         = "CANCEL",
+    [BT_HASH_REQUEST]   = "HASH_REQUEST",
+    [BT_HASHES]         = "HASHES",
+    [BT_HASH_REJECT]    = "HASH_REJECT",
 };
 
 /**
- * len 不应为 0, keep-alive 由上层检查
+ * @brief 非阻塞地读一次套接字
+ * @return 读到的字节数；套接字已读空返回 0; 对方断开或者出错返回 -1
  */
-struct PeerMsg *
-peer_get_packet(struct Peer *peer)
-{
-    ssize_t s;
-
-    if (peer->wanted == 0) {  // 从头开始的一次 BT 报文读取
-        // 至少有多长的载荷是一定要读满的
-        s = recv(peer->fd, &peer->wanted, 4, MSG_WAITALL);
-        peer->wanted = htonl(peer->wanted);
-        if (s < 0) {
-            perror("read phase 1");
-            return NULL;
-        }
-        else if (s == 0) {
-            log("%s:%u disconnected at recv pkt phase 1", peer->ip, peer->port);
-            return NULL;
-        }
+static ssize_t
+recv_some(struct Peer *peer, void *buf, size_t size)
+{
+    ssize_t n;
+    do {
+        n = recv(peer->fd, buf, size, MSG_DONTWAIT);
+    } while (n == -1 && errno == EINTR);
 
-        assert(s == 4);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (n == -1) {
+        perror("recv from peer");
+        return -1;
+    }
+    if (n == 0) {
+        log("%s:%u disconnected", peer->ip, peer->port);
+        return -1;
+    }
+    return n;
+}
 
-        peer->msg = malloc(4 + peer->wanted);
-        peer->msg->len = peer->wanted;
+/**
+ * @brief 子分片读完，处理 PIECE 报文
+ */
+static void
+finish_block(struct Peer *peer, MsgHandler handle, void *arg)
+{
+    handle(peer, &peer->msg, arg);
+    peer->block = NULL;
+    peer->block_owned = 0;
+}
+
+/**
+ * @brief 处理接收缓冲区中所有完整的报文
+ *
+ * 遇到子分片还没有到齐的 PIECE 报文时，已经到达的部分拷到 place 选定的位置，
+ * 之后由 peer_recv() 直接读入剩下的部分。
+ *
+ * @return 成功返回 0, 报文过长返回 -1
+ */
+static int
+parse_msgs(struct Peer *peer, MsgHandler handle, BlockPlacer place, void *arg)
+{
+    while (peer->block == NULL && peer->rbuf_end - peer->rbuf_start >= 4) {
+        uint8_t *p = peer->rbuf + peer->rbuf_start;
+        size_t avail = peer->rbuf_end - peer->rbuf_start;
+        uint32_t len;
+        memcpy(&len, p, 4);
+        len = ntohl(len);
+        if (len > PEER_MSG_MAX) {
+            err("%s:%u sent a %u bytes message", peer->ip, peer->port, len);
+            return -1;
+        }
 
-        if (peer->msg->len == 0) {  // KEEP-ALIVE
-            log("KEEP_ALIVE");
-            return peer->msg;
+        struct PeerMsg *msg = (struct PeerMsg *)p;
+        if (place != NULL && len > 9 && avail >= 4 + 9 && msg->id == BT_PIECE) {
+            // 子分片直接放到最终位置，只有报文头留在 peer 中
+            uint32_t size = len - 9;
+            size_t have = avail - (4 + 9) < size ? avail - (4 + 9) : size;
+            memcpy(&peer->msg, p, 4 + 9);
+            peer->msg.len = len;
+            peer->block_owned = 0;
+            peer->block = place(peer, &peer->msg, arg);
+            memcpy(peer->block, p + 4 + 9, have);
+            peer->rbuf_start += 4 + 9 + have;
+            peer->wanted = size - (uint32_t)have;
+            if (peer->wanted == 0) {
+                finish_block(peer, handle, arg);
+            }
+            continue;
         }
 
-        log("want to receive %d bytes payload from %s:%d", peer->wanted, peer->ip, peer->port);
+        if (avail < 4 + (size_t)len) {
+            break;
+        }
+        msg->len = len;
+        peer->rbuf_start += 4 + (size_t)len;
+        handle(peer, msg, arg);
     }
 
-    // 异步连续读取
-
-    s = read(peer->fd, (char *)&peer->msg->id + peer->msg->len - peer->wanted, peer->wanted);
-    if (s < 0) {
-        perror("read phase 2");
-        free(peer->msg);
-        return NULL;
+    // 挪走已经处理的数据，保证下次读有足够的空间，并且能放下整个下一个报文
+    size_t avail = peer->rbuf_end - peer->rbuf_start;
+    size_t need = 0;
+    if (peer->block == NULL && avail >= 4) {
+        uint32_t len;
+        memcpy(&len, peer->rbuf + peer->rbuf_start, 4);
+        need = 4 + (size_t)ntohl(len);
+    }
+    if (peer->rbuf_start > 0 && (avail == 0 || peer->rbuf_size - peer->rbuf_end < PEER_RBUF_SIZE / 2
+                                 || peer->rbuf_start + need > peer->rbuf_size)) {
+        memmove(peer->rbuf, peer->rbuf + peer->rbuf_start, avail);
+        peer->rbuf_start = 0;
+        peer->rbuf_end = avail;
     }
-    else if (s == 0) {
-        log("%s:%u disconnected at recv pkt phase 2", peer->ip, peer->port);
-        free(peer->msg);
-        return NULL;
+    if (need > peer->rbuf_size) {
+        peer->rbuf_size = need;
+        peer->rbuf = realloc(peer->rbuf, peer->rbuf_size);
     }
+    return 0;
+}
 
-    peer->wanted -= s;
-    return peer->msg;
+int
+peer_recv(struct Peer *peer, MsgHandler handle, BlockPlacer place, void *arg)
+{
+    while (1) {
+        ssize_t n;
+        if (peer->block != NULL) {
+            // 子分片的剩余部分直接读到最终位置
+            n = recv_some(peer, peer->block + (peer->msg.len - 9) - peer->wanted, peer->wanted);
+            if (n > 0) {
+                peer->wanted -= (unsigned)n;
+                if (peer->wanted == 0) {
+                    finish_block(peer, handle, arg);
+                }
+            }
+        }
+        else {
+            n = recv_some(peer, peer->rbuf + peer->rbuf_end, peer->rbuf_size - peer->rbuf_end);
+            if (n > 0) {
+                peer->rbuf_end += (size_t)n;
+            }
+        }
+        if (n <= 0) {
+            return (int)n;
+        }
+        if (parse_msgs(peer, handle, place, arg) == -1) {
+            return -1;
+        }
+    }
 }
 
 /**
@@ -100,6 +188,8 @@ peer_new(int fd, size_t nr_pieces)
     p->requesting_index = -1;
     p->requesting_begin = -1;
     p->speed = 0.0;
+    p->rbuf_size = PEER_RBUF_SIZE;
+    p->rbuf = malloc(p->rbuf_size);
 
     size_t bitfield_capacity = (nr_pieces - 1) / 8 + 1;  // 上取整
     p->bitfield = calloc(bitfield_capacity, sizeof(*p->bitfield));
@@ -113,6 +203,7 @@ peer_free(struct Peer **p)
     *p = NULL;
 
     free(peer->bitfield);
+    free(peer->rbuf);
     if (peer->requested_pieces) {
         free(peer->requested_pieces);
     }
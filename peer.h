@@ -18,6 +18,12 @@
  */
 #define PSTRLEN_DEFAULT (sizeof(PSTR_DEFAULT) - 1)
 
+/**
+ * @brief 握手保留区域中表示支持 v2 协议 (BEP 52) 的字节和位
+ */
+#define HS_V2_BYTE 7
+#define HS_V2_MASK 0x10
+
 #pragma pack(1)
 /**
  * @brief 握手信息
@@ -40,10 +46,14 @@ enum {
     BT_REQUEST,
     BT_PIECE,
     BT_CANCEL,
+    BT_HASH_REQUEST = 21,
+    BT_HASHES,
+    BT_HASH_REJECT,
+    NR_BT_TYPES,
 };
 
 /**
- * @brief 对应 BT 报文类型的字符串
+ * @brief 对应 BT 报文类型的字符串，没有定义的编号为 NULL
  */
 extern const char *bt_types[];
 
@@ -88,6 +98,15 @@ struct PeerMsg {
             uint32_t begin;        ///< 子分片起始偏移量
             uint32_t length;       ///< 子分片长度
         } cancel;                  ///< CANCEL 消息
+
+        struct {
+            uint8_t pieces_root[MERKLE_HASH_SIZE];  ///< 文件默克尔树的根
+            uint32_t base_layer;   ///< 请求的最低层，0 为叶子层
+            uint32_t index;        ///< 请求的第一个结点在 base_layer 中的下标
+            uint32_t length;       ///< 请求的结点数，2 的幂，不超过 512
+            uint32_t proof_layers; ///< 证明到 base_layer 之上第几层，只附带请求的结点覆盖不到的 uncle
+            uint8_t hashes[0];     ///< HASHES 消息：length 个结点，之后是自底向上的 uncle
+        } hash;                    ///< HASH REQUEST, HASHES, HASH REJECT 消息
     };
 };
 #pragma pack()
@@ -97,6 +116,7 @@ struct PeerMsg {
  *
  * peer 只记录单次分片请求的信息。因为对单个连接上的数据传输，没有并发的可能，
  * 只能顺序地读取，所以较为稳定的一次请求一次读取的操作，虽然简单，也是合理的。
+ * 接收的数据先进入 peer 自己的接收缓冲区，见 peer_recv().
  * @note 请求报文的传播延迟无法重叠，还是会有效率上的损失。
  */
 struct Peer
@@ -115,19 +135,73 @@ struct Peer
     int *requested_subpieces; ///< -1 terminated
     int requesting_index;     ///< 请求的分片号，-1 为无效。
     int requesting_begin;     ///< 请求的子分片偏移量（固定长度）
+    int is_v2;                ///< 握手时声明支持 v2 协议，可以交换默克尔树结点
+    int is_banned;            ///< 已被证实多次发送坏数据，事件循环会断开连接
     int contribution;         ///< 检查周期内的数据贡献
-    unsigned wanted;          ///< 期望接受的字节数
-    struct PeerMsg *msg;      ///< 记录尚未读完的 msg
+    unsigned wanted;          ///< 正在直接读入的子分片还差的字节数
+    struct PeerMsg msg;       ///< 正在直接读入子分片的 PIECE 报文头，len 为本机字节序
+    uint8_t *block;           ///< PIECE 报文的子分片直接读入的位置，NULL 表示没有正在读入的子分片
+    int block_owned;          ///< block 是为这个报文单独分配的缓冲区（diskio_alloc()），由接收方释放或者转交
+    uint8_t *rbuf;            ///< 接收缓冲区
+    size_t rbuf_size;         ///< 接收缓冲区容量，放不下的长报文到来时扩大
+    size_t rbuf_start;        ///< 尚未处理的数据的起点
+    size_t rbuf_end;          ///< 尚未处理的数据的终点
     struct timespec st;       ///< 记录发送请求的时刻，用于计算分片下载速度，不使用分片的 time 是因为后者可能因超时被更新。
     double speed;             ///< 下载速度
 };
 
 /**
- * @brief 获取 BT 报文
+ * @brief 接收缓冲区的初始大小，能容纳一个完整的 16 KiB PIECE 报文
+ */
+#define PEER_RBUF_SIZE 0x8000
+
+/**
+ * @brief 允许的最长报文（不含长度前缀），更长的报文视为出错
+ */
+#define PEER_MSG_MAX (1 << 20)
+
+/**
+ * @brief 为 PIECE 报文的子分片选定读入位置
+ *
+ * 调用时 msg 只包含报文头（id, index, begin），len 为本机字节序，index 和 begin
+ * 仍是网络字节序。返回的位置要能容纳 msg->len - 9 字节，单独分配的缓冲区
+ * 要同时设置 peer->block_owned.
+ *
+ * @param peer 发送报文的 peer
+ * @param msg 报文头
+ * @param arg 调用 peer_recv() 时传入的参数
+ * @return 子分片的读入位置，不能为 NULL
+ */
+typedef uint8_t *(*BlockPlacer)(struct Peer *peer, const struct PeerMsg *msg, void *arg);
+
+/**
+ * @brief 处理一个完整的 BT 报文
+ *
+ * msg->len 为本机字节序，其余字段仍是网络字节序。msg 指向接收缓冲区，
+ * 处理函数返回后失效；PIECE 报文的子分片在 peer->block 时 msg 只包含报文头，
+ * 单独分配的 block 由处理函数释放或者转交，返回后 peer->block 被清空。
+ *
+ * @param peer 发送报文的 peer
+ * @param msg 报文
+ * @param arg 调用 peer_recv() 时传入的参数
+ */
+typedef void (*MsgHandler)(struct Peer *peer, struct PeerMsg *msg, void *arg);
+
+/**
+ * @brief 读完套接字中的数据，逐个处理其中完整的 BT 报文
+ *
+ * 非阻塞地把数据大块读入接收缓冲区，直到套接字读空（EAGAIN），
+ * 所以可以配合边沿触发的 epoll 使用。缓冲区中所有完整的报文一次处理完，
+ * 不完整的留到下次。PIECE 报文读到报文头后由 place 选定子分片的位置，
+ * 缓冲区中已有的部分拷过去，其余直接从套接字读到那里。
+ *
  * @param peer 指向 peer 对象
- * @return 输出动态分配的指向 packet 的指针
+ * @param handle 处理完整的报文
+ * @param place 为 PIECE 报文的子分片选定读入位置，NULL 表示子分片也读入接收缓冲区
+ * @param arg 传给 handle 和 place 的参数
+ * @return 套接字读空返回 0; 对方断开、读取出错或者报文过长返回 -1
  */
-struct PeerMsg *peer_get_packet(struct Peer *peer);
+int peer_recv(struct Peer *peer, MsgHandler handle, BlockPlacer place, void *arg);
 
 /**
  * @brief peer 构造
@@ -0,0 +1,257 @@
+/**
+ * @file piecehash.c
+ * @brief 多线程分片摘要计算的 API 实现
+ */
+
+#include "piecehash.h"
+#include "metainfo.h"
+#include "util.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "sha1.h"
+
+/**
+ * @brief 每个线程一批分片的缓冲区上限，分片很大时减少一起计算的分片数
+ */
+#define BATCH_BYTES_MAX (16UL << 20)
+
+/**
+ * @brief 一次并行计算的共享状态
+ */
+struct HashJob
+{
+    struct Storage *st;       ///< 数据文件
+    size_t file_size;         ///< 文件大小
+    uint32_t piece_size;      ///< 分片大小
+    size_t nr_pieces;         ///< 分片数量
+    int nr_threads;           ///< 线程数
+    int batch;                ///< 每次领取的分片数
+    off_t window;             ///< 预读窗口字节数
+    uint8_t *md;              ///< 摘要输出表
+    const uint8_t *skip;      ///< 跳过的分片，可以为 NULL
+    atomic_size_t next;       ///< 下一个待领取的分片号
+    atomic_size_t nr_done;    ///< 已完成的分片数，用于进度提示
+    atomic_llong hinted;      ///< 已提示预读的末端偏移
+    int nr_running;           ///< 尚未退出的工作线程数，由 lock 保护
+    pthread_mutex_t lock;     ///< 保护 nr_running
+    pthread_cond_t finished;  ///< 最后一个工作线程退出时通知
+    atomic_int failed;        ///< 是否有线程读取出错
+};
+
+/**
+ * @brief 把预读提示推进到 end 之后
+ *
+ * 多个线程竞争推进同一个末端，用 CAS 保证每个区间只提示一次。
+ * 被跳过的分片不需要预读，所以末端落后于 start 时直接跳到 start.
+ *
+ * @param job 共享状态
+ * @param start 当前读取的偏移
+ * @param end 希望已提示的末端偏移
+ */
+static void
+advance_readahead(struct HashJob *job, off_t start, off_t end)
+{
+    long long hinted = atomic_load(&job->hinted);
+    while (hinted < start) {
+        atomic_compare_exchange_weak(&job->hinted, &hinted, (long long)start);
+    }
+
+    while (hinted < end && hinted < (long long)job->file_size) {
+        if (atomic_compare_exchange_weak(&job->hinted, &hinted, hinted + (long long)READAHEAD_SIZE)) {
+            storage_fadvise(job->st, (off_t)hinted, READAHEAD_SIZE, POSIX_FADV_WILLNEED);
+            hinted += (long long)READAHEAD_SIZE;
+        }
+    }
+}
+
+/**
+ * @brief 工作线程：循环领取一批分片并计算摘要
+ *
+ * 一批最多 batch 个分片，读入后用 sha1_multi() 一起计算，
+ * 长度不足的最后一个分片单独计算。
+ *
+ * @param arg 指向 HashJob
+ * @return NULL
+ */
+static void *
+hash_worker(void *arg)
+{
+    struct HashJob *job = arg;
+    uint8_t *buf = malloc((size_t)job->batch * job->piece_size);
+
+    size_t first;
+    while (!atomic_load(&job->failed)
+            && (first = atomic_fetch_add(&job->next, (size_t)job->batch)) < job->nr_pieces) {
+        size_t last = first + (size_t)job->batch;
+        if (last > job->nr_pieces) {
+            last = job->nr_pieces;
+        }
+
+        const uint8_t *in[SHA1_MAX_LANES];
+        uint8_t *out[SHA1_MAX_LANES];
+        int n = 0;
+        for (size_t index = first; index < last; index++) {
+            if (job->skip && job->skip[index]) {
+                continue;
+            }
+
+            off_t offset = (off_t)index * job->piece_size;
+            size_t length = job->piece_size;
+            if (index == job->nr_pieces - 1) {
+                length = job->file_size - (size_t)offset;
+            }
+
+            advance_readahead(job, offset, offset + (off_t)length + job->window);
+
+            uint8_t *piece = buf + (size_t)n * job->piece_size;
+            if (storage_pread(job->st, piece, length, offset) == -1) {
+                err("failed to read piece %lu", index);
+                atomic_store(&job->failed, 1);
+                goto out;
+            }
+
+            if (length == job->piece_size) {
+                in[n] = piece;
+                out[n] = job->md + index * HASH_SIZE;
+                n++;
+            }
+            else {
+                sha1(piece, length, job->md + index * HASH_SIZE);
+            }
+        }
+
+        sha1_multi(in, job->piece_size, out, n);
+        atomic_fetch_add(&job->nr_done, last - first);
+    }
+
+out:
+    free(buf);
+    pthread_mutex_lock(&job->lock);
+    if (--job->nr_running == 0) {
+        pthread_cond_signal(&job->finished);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+/**
+ * @brief 单调时钟，单位秒
+ */
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief 等待工作线程结束，期间每秒在同一行刷新进度
+ *
+ * 最后一个工作线程退出时通过 finished 唤醒，不用轮询。
+ *
+ * @param job 共享状态
+ * @param progress 进度提示前缀
+ */
+static void
+report_progress(struct HashJob *job, const char *progress)
+{
+    double start = now();
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    pthread_mutex_lock(&job->lock);
+    while (job->nr_running > 0) {
+        deadline.tv_sec++;
+        int ret = 0;
+        while (job->nr_running > 0 && ret != ETIMEDOUT) {
+            ret = pthread_cond_timedwait(&job->finished, &job->lock, &deadline);
+        }
+        if (job->nr_running == 0) {
+            break;
+        }
+
+        double t = now();
+        size_t done = atomic_load(&job->nr_done);
+        double bytes = (double)done * job->piece_size;
+        printf("\r%s: %lu / %lu pieces (%.1f%%), %.1f MiB/s", progress, done, job->nr_pieces,
+               100.0 * done / job->nr_pieces, bytes / (t - start) / (1 << 20));
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    double elapsed = now() - start;
+    printf("\r%s: %lu / %lu pieces in %.2fs, %.1f MiB/s\n", progress, atomic_load(&job->nr_done),
+           job->nr_pieces, elapsed, job->file_size / (elapsed > 0 ? elapsed : 1e-9) / (1 << 20));
+}
+
+int
+hash_pieces(struct Storage *st, size_t file_size, uint32_t piece_size, uint8_t *md, int nr_threads,
+            const char *progress, const uint8_t *skip)
+{
+    if (file_size == 0) {
+        return 0;
+    }
+
+    struct HashJob job = {
+        .st = st,
+        .file_size = file_size,
+        .piece_size = piece_size,
+        .nr_pieces = (file_size - 1) / piece_size + 1,
+        .md = md,
+        .skip = skip,
+    };
+    atomic_init(&job.next, 0);
+    atomic_init(&job.nr_done, 0);
+    atomic_init(&job.hinted, 0);
+    atomic_init(&job.failed, 0);
+
+    if (nr_threads <= 0) {
+        nr_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (nr_threads <= 0) nr_threads = 1;
+    }
+    if ((size_t)nr_threads > job.nr_pieces) {
+        nr_threads = (int)job.nr_pieces;
+    }
+    job.nr_threads = nr_threads;
+    job.batch = sha1_lanes();
+    if ((size_t)job.batch * piece_size > BATCH_BYTES_MAX) {
+        job.batch = piece_size >= BATCH_BYTES_MAX ? 1 : (int)(BATCH_BYTES_MAX / piece_size);
+    }
+    job.window = (off_t)nr_threads * job.batch * piece_size;
+    if (job.window < (off_t)READAHEAD_SIZE) {
+        job.window = (off_t)READAHEAD_SIZE;
+    }
+    job.nr_running = nr_threads;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&job.finished, &attr);
+    pthread_condattr_destroy(&attr);
+
+    storage_fadvise(st, 0, file_size, POSIX_FADV_SEQUENTIAL);
+
+    pthread_t *tids = calloc((size_t)nr_threads, sizeof(*tids));
+    for (int i = 0; i < nr_threads; i++) {
+        if (pthread_create(&tids[i], NULL, hash_worker, &job) != 0) {
+            panic("failed to create hash worker %d", i);
+        }
+    }
+    if (progress) {
+        report_progress(&job, progress);
+    }
+    for (int i = 0; i < nr_threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    pthread_cond_destroy(&job.finished);
+    pthread_mutex_destroy(&job.lock);
+
+    return atomic_load(&job.failed) ? -1 : 0;
+}
@@ -0,0 +1,40 @@
+/**
+ * @file piecehash.h
+ * @brief 多线程分片摘要计算的 API 声明
+ */
+
+#ifndef PIECEHASH_H
+#define PIECEHASH_H
+
+#include <stddef.h>
+#include <inttypes.h>
+#include "storage.h"
+
+/**
+ * @brief 预读提示的粒度
+ */
+#define READAHEAD_SIZE (32UL << 20)
+
+/**
+ * @brief 多线程计算存储层中每个分片的 SHA1 摘要
+ *
+ * 工作线程按分片号顺序一次领取 sha1_lanes() 个分片，各自用 pread 读入私有
+ * 缓冲区后用多流 SHA1 一起计算摘要，每个线程的缓冲区不超过 16 MiB
+ * （分片更大时为一个分片）。领取分片的线程顺带把已提示预读的
+ * 末端推进到至少一个窗口之后，每次提示 READAHEAD_SIZE 的连续区间，
+ * 窗口取 READAHEAD_SIZE 和全部线程一批分片总量中较大者，这样磁盘看到的
+ * 是大块顺序读而不是分片大小的零碎请求。
+ *
+ * @param st 存储层，分片可以跨越文件
+ * @param file_size 要计算的字节数，从线性空间的开头开始，除最后一个分片外都按整分片计算
+ * @param piece_size 分片大小
+ * @param md [OUT] 摘要表，至少 nr_pieces * HASH_SIZE 字节
+ * @param nr_threads 线程数，0 表示使用在线 CPU 数
+ * @param progress 进度提示的前缀，非 NULL 时大约每秒在同一行刷新一次进度
+ * @param skip 每个分片一个字节，非 0 的分片既不读取也不计算，其摘要保持原样；NULL 表示全部计算
+ * @return 成功返回 0, 读取出错返回 -1
+ */
+int hash_pieces(struct Storage *st, size_t file_size, uint32_t piece_size, uint8_t *md, int nr_threads,
+                const char *progress, const uint8_t *skip);
+
+#endif  // PIECEHASH_H
@@ -0,0 +1,126 @@
+/**
+ * @file readcache.c
+ * @brief 做种读缓存的 API 实现
+ */
+
+#include "readcache.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct ReadCache *
+readcache_new(size_t nr_pieces, size_t budget)
+{
+    struct ReadCache *rc = calloc(1, sizeof(*rc));
+    rc->budget = budget;
+    rc->nr_pieces = nr_pieces;
+    rc->pieces = calloc(nr_pieces, sizeof(*rc->pieces));
+    return rc;
+}
+
+/**
+ * @brief 把分片从 LRU 链表中摘下
+ */
+static void
+lru_unlink(struct ReadCache *rc, struct CachedPiece *cp)
+{
+    if (cp->prev != NULL) cp->prev->next = cp->next;
+    else rc->head = cp->next;
+    if (cp->next != NULL) cp->next->prev = cp->prev;
+    else rc->tail = cp->prev;
+    cp->prev = cp->next = NULL;
+}
+
+/**
+ * @brief 把分片放到 LRU 链表头
+ */
+static void
+lru_push(struct ReadCache *rc, struct CachedPiece *cp)
+{
+    cp->prev = NULL;
+    cp->next = rc->head;
+    if (rc->head != NULL) rc->head->prev = cp;
+    else rc->tail = cp;
+    rc->head = cp;
+}
+
+struct CachedPiece *
+readcache_get(struct ReadCache *rc, uint32_t index)
+{
+    struct CachedPiece *cp = rc->pieces[index];
+    if (cp == NULL) {
+        rc->misses++;
+        return NULL;
+    }
+    rc->hits++;
+    if (rc->head != cp) {
+        lru_unlink(rc, cp);
+        lru_push(rc, cp);
+    }
+    return cp;
+}
+
+struct CachedPiece *
+readcache_add(struct ReadCache *rc, uint32_t index, size_t length)
+{
+    // 从最久没有被请求的分片开始淘汰，跳过正在读入的
+    for (struct CachedPiece *cp = rc->tail; cp != NULL && rc->used + length > rc->budget; ) {
+        struct CachedPiece *prev = cp->prev;
+        if (!cp->is_loading) {
+            readcache_drop(rc, cp);
+        }
+        cp = prev;
+    }
+    if (rc->used + length > rc->budget) {
+        return NULL;
+    }
+
+    struct CachedPiece *cp = calloc(1, sizeof(*cp));
+    cp->index = index;
+    cp->length = length;
+    cp->is_loading = 1;
+    cp->waiters_tail = &cp->waiters;
+    lru_push(rc, cp);
+    rc->pieces[index] = cp;
+    rc->used += length;
+    return cp;
+}
+
+void
+readcache_wait(struct CachedPiece *cp, int peer_fd, const char *peer_id, uint32_t begin, uint32_t length)
+{
+    struct CacheWaiter *w = calloc(1, sizeof(*w));
+    w->peer_fd = peer_fd;
+    memcpy(w->peer_id, peer_id, HASH_SIZE);
+    w->begin = begin;
+    w->length = length;
+    *cp->waiters_tail = w;
+    cp->waiters_tail = &w->next;
+}
+
+void
+readcache_drop(struct ReadCache *rc, struct CachedPiece *cp)
+{
+    while (cp->waiters != NULL) {
+        struct CacheWaiter *next = cp->waiters->next;
+        free(cp->waiters);
+        cp->waiters = next;
+    }
+    lru_unlink(rc, cp);
+    rc->pieces[cp->index] = NULL;
+    rc->used -= cp->length;
+    free(cp->data);
+    free(cp);
+}
+
+void
+readcache_free(struct ReadCache **prc)
+{
+    struct ReadCache *rc = *prc;
+    *prc = NULL;
+
+    while (rc->head != NULL) {
+        readcache_drop(rc, rc->head);
+    }
+    free(rc->pieces);
+    free(rc);
+}
@@ -0,0 +1,114 @@
+/**
+ * @file readcache.h
+ * @brief 做种读缓存的 API 声明
+ *
+ * peer 一次只请求一个 16 KiB 子分片，而同一分片的后续子分片通常紧接着被
+ * 同一个或者其他 peer 请求。读缓存以分片为单位：第一次请求某个分片时把
+ * 整个分片读入内存，之后的请求直接从内存发送，热门分片只读一次盘。
+ * 缓存总量有上限，超出时淘汰最久没有被请求的分片。
+ *
+ * 只由事件循环线程访问，不加锁。
+ */
+
+#ifndef READCACHE_H
+#define READCACHE_H
+
+#include "metainfo.h"
+#include <stddef.h>
+#include <inttypes.h>
+
+/**
+ * @brief 分片读入期间到达的请求，读完后再发送
+ */
+struct CacheWaiter
+{
+    int peer_fd;                   ///< 请求数据的 peer 的套接字
+    char peer_id[HASH_SIZE];       ///< 用于确认套接字仍然属于同一个 peer
+    uint32_t begin;                ///< 子分片在分片内的偏移
+    uint32_t length;               ///< 子分片长度
+    struct CacheWaiter *next;      ///< 按到达顺序链接
+};
+
+/**
+ * @brief 缓存的分片
+ */
+struct CachedPiece
+{
+    uint32_t index;                ///< 分片号
+    size_t length;                 ///< 分片长度
+    uint8_t *data;                 ///< 分片数据，读入完成前为 NULL
+    int is_loading;                ///< 正在从磁盘读入
+    struct CacheWaiter *waiters;   ///< 读入期间到达的请求
+    struct CacheWaiter **waiters_tail;  ///< 请求队列尾
+    struct CachedPiece *prev;      ///< LRU 链表中更近被请求的分片
+    struct CachedPiece *next;      ///< LRU 链表中更久没有被请求的分片
+};
+
+/**
+ * @brief 读缓存
+ */
+struct ReadCache
+{
+    size_t budget;                 ///< 缓存总量的上限
+    size_t used;                   ///< 已缓存的总量，包括正在读入的
+    size_t nr_pieces;              ///< 分片数
+    struct CachedPiece **pieces;   ///< 按分片号索引，NULL 表示没有缓存
+    struct CachedPiece *head;      ///< 最近被请求的分片
+    struct CachedPiece *tail;      ///< 最久没有被请求的分片
+    size_t hits;                   ///< 命中次数（包括等待读入的）
+    size_t misses;                 ///< 未命中次数
+};
+
+/**
+ * @brief 创建读缓存
+ * @param nr_pieces 分片数
+ * @param budget 缓存总量的上限（字节）
+ * @return 动态分配的读缓存
+ */
+struct ReadCache *readcache_new(size_t nr_pieces, size_t budget);
+
+/**
+ * @brief 查找缓存的分片，找到时移到 LRU 链表头
+ * @param rc 读缓存
+ * @param index 分片号
+ * @return 缓存的分片，可能仍在读入；没有缓存返回 NULL
+ */
+struct CachedPiece *readcache_get(struct ReadCache *rc, uint32_t index);
+
+/**
+ * @brief 为分片分配缓存，标记为正在读入
+ *
+ * 空间不够时从 LRU 链表尾淘汰已经读入的分片，正在读入的分片不会被淘汰。
+ * 读入用的缓冲区由调用者分配，读完后交给 data.
+ *
+ * @param rc 读缓存
+ * @param index 分片号，要求没有缓存
+ * @param length 分片长度
+ * @return 新的缓存分片；腾不出空间返回 NULL
+ */
+struct CachedPiece *readcache_add(struct ReadCache *rc, uint32_t index, size_t length);
+
+/**
+ * @brief 把请求挂到正在读入的分片上
+ * @param cp 缓存的分片
+ * @param peer_fd peer 的套接字
+ * @param peer_id peer 的 id
+ * @param begin 子分片在分片内的偏移
+ * @param length 子分片长度
+ */
+void readcache_wait(struct CachedPiece *cp, int peer_fd, const char *peer_id, uint32_t begin, uint32_t length);
+
+/**
+ * @brief 移除缓存的分片（例如读入失败），挂着的请求一并丢弃
+ * @param rc 读缓存
+ * @param cp 缓存的分片
+ */
+void readcache_drop(struct ReadCache *rc, struct CachedPiece *cp);
+
+/**
+ * @brief 释放读缓存
+ * @param prc 指向读缓存，会改写成 NULL
+ */
+void readcache_free(struct ReadCache **prc);
+
+#endif  // READCACHE_H
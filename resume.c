@@ -0,0 +1,327 @@
+/**
+ * @file resume.c
+ * @brief 快速续传文件的 API 实现
+ */
+
+#include "resume.h"
+#include "bencoder.h"
+#include "bparser.h"
+#include "butil.h"
+#include "peer.h"
+#include "util.h"
+#include "storage.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * @brief 数据文件修改时间，单位纳秒
+ */
+static long
+stat_mtime(const struct stat *sb)
+{
+    return sb->st_mtim.tv_sec * 1000000000L + sb->st_mtim.tv_nsec;
+}
+
+/**
+ * @brief 获取分片的子分片数量
+ */
+static size_t
+piece_sub_count(const struct MetaInfo *mi, size_t index)
+{
+    return (piece_length(mi, index) - 1) / mi->sub_size + 1;
+}
+
+/**
+ * @brief 获取子分片长度，只有最后一个分片的最后一个子分片可能不足 sub_size
+ */
+static size_t
+block_length(const struct MetaInfo *mi, size_t index, size_t sub_idx)
+{
+    size_t rest = piece_length(mi, index) - sub_idx * mi->sub_size;
+    return rest < mi->sub_size ? rest : mi->sub_size;
+}
+
+/**
+ * @brief 生成续传文件名
+ * @param mi 全局信息
+ * @param suffix 附加在 ".resume" 之后的后缀
+ * @return 动态分配的文件名
+ */
+static char *
+resume_path(const struct MetaInfo *mi, const char *suffix)
+{
+    char *path = malloc(strlen(mi->name) + sizeof(".resume") + strlen(suffix));
+    sprintf(path, "%s.resume%s", mi->name, suffix);
+    return path;
+}
+
+int
+resume_save(struct MetaInfo *mi)
+{
+    struct stat sb;
+    if (storage_stat(mi->storage, &sb) == -1) {
+        err("no data file to describe in %s.resume", mi->name);
+        return -1;
+    }
+
+    struct BEncoder enc;
+    benc_init(&enc, mi->bitfield_size + 256);
+    benc_dict_begin(&enc);
+        benc_key(&enc, "bitfield");
+        benc_str(&enc, mi->bitfield, mi->bitfield_size);
+        benc_key(&enc, "file inode");
+        benc_int(&enc, (long)sb.st_ino);
+        benc_key(&enc, "file mtime");
+        benc_int(&enc, stat_mtime(&sb));
+        benc_key(&enc, "file size");
+        benc_int(&enc, (long)sb.st_size);
+        benc_key(&enc, "info hash");
+        benc_str(&enc, mi->info_hash, HASH_SIZE);
+        benc_key(&enc, "partial");
+        benc_list_begin(&enc);
+        uint8_t *blocks = malloc(mi->sub_count);
+        for (size_t i = 0; i < mi->nr_pieces; i++) {
+            const struct PieceInfo *piece = &mi->pieces[i];
+            size_t sub_cnt = piece_sub_count(mi, i);
+            // 缓冲区中或者正在写盘的子分片不一定已经写盘，不能记为完成
+            if (piece->is_downloaded || piece->buf != NULL || piece->nr_writes > 0
+                    || memchr(piece->substate, SUB_FINISH, sub_cnt) == NULL) {
+                continue;
+            }
+            for (size_t j = 0; j < sub_cnt; j++) {
+                blocks[j] = piece->substate[j] == SUB_FINISH;
+            }
+            benc_dict_begin(&enc);
+                benc_key(&enc, "blocks");
+                benc_str(&enc, blocks, sub_cnt);
+                benc_key(&enc, "index");
+                benc_int(&enc, (long)i);
+            benc_end(&enc);
+        }
+        free(blocks);
+        benc_end(&enc);
+        benc_key(&enc, "piece length");
+        benc_int(&enc, mi->piece_size);
+    benc_end(&enc);
+
+    char *tmp = resume_path(mi, ".tmp");
+    char *path = resume_path(mi, "");
+    int ret = 0;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || write(fd, enc.data, enc.size) != (ssize_t)enc.size || fsync(fd) == -1) {
+        perror(tmp);
+        ret = -1;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    if (ret == 0 && rename(tmp, path) == -1) {
+        perror(path);
+        ret = -1;
+    }
+    if (ret == 0) {
+        log("saved %s", path);
+    }
+
+    free(path);
+    free(tmp);
+    benc_free(&enc);
+    return ret;
+}
+
+/**
+ * @brief 读取整个续传文件
+ * @param path 文件名
+ * @param psize [OUT] 字节数
+ * @return 动态分配的内容，不存在或出错时返回 NULL
+ */
+static char *
+read_resume_file(const char *path, size_t *psize)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat sb;
+    char *data = NULL;
+    if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+        data = malloc((size_t)sb.st_size);
+        if (read(fd, data, (size_t)sb.st_size) != sb.st_size) {
+            free(data);
+            data = NULL;
+        }
+        *psize = (size_t)sb.st_size;
+    }
+    close(fd);
+    return data;
+}
+
+/**
+ * @brief 检查续传文件中下载中分片的列表，每一项都要有串类型的 blocks 和整型的 index
+ * @return 格式正确返回 1, 否则返回 0
+ */
+static int
+is_partial_valid(const struct BNode *partial)
+{
+    if (partial == NULL) {
+        return 1;
+    }
+    if (partial->type != B_LIST) {
+        return 0;
+    }
+    for (const struct BNode *iter = partial; iter && iter->l_item; iter = iter->l_next) {
+        if (iter->l_item->type != B_DICT) {
+            return 0;
+        }
+        const struct BNode *blocks = query_bcode_by_path(iter->l_item, "blocks");
+        const struct BNode *index = query_bcode_by_path(iter->l_item, "index");
+        if ((blocks && blocks->type != B_STR) || (index && index->type != B_INT)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief 检查续传文件是否属于当前种子和数据文件
+ *
+ * 续传文件可能损坏或者被手工修改，每个结点都先检查类型再使用。
+ * 位图最后一个字节中分片数之外的位必须为 0, 否则发给 peer 的 BITFIELD 无效。
+ *
+ * @return 一致返回 1, 否则返回 0
+ */
+static int
+is_resume_valid(const struct MetaInfo *mi, const struct BNode *tree, const struct stat *sb)
+{
+    const struct BNode *bitfield = query_bcode_by_path(tree, "bitfield");
+    const struct BNode *inode = query_bcode_by_path(tree, "file inode");
+    const struct BNode *mtime = query_bcode_by_path(tree, "file mtime");
+    const struct BNode *size = query_bcode_by_path(tree, "file size");
+    const struct BNode *info_hash = query_bcode_by_path(tree, "info hash");
+    const struct BNode *piece_length = query_bcode_by_path(tree, "piece length");
+
+    if (!bitfield || !inode || !mtime || !size || !info_hash || !piece_length) {
+        err("incomplete resume file");
+        return 0;
+    }
+    if (bitfield->type != B_STR || info_hash->type != B_STR || inode->type != B_INT || mtime->type != B_INT
+            || size->type != B_INT || piece_length->type != B_INT
+            || !is_partial_valid(query_bcode_by_path(tree, "partial"))) {
+        err("malformed resume file");
+        return 0;
+    }
+    if (info_hash->s_size != HASH_SIZE || memcmp(info_hash->s_data, mi->info_hash, HASH_SIZE) != 0
+            || piece_length->i != mi->piece_size || bitfield->s_size != mi->bitfield_size) {
+        err("resume file belongs to another torrent");
+        return 0;
+    }
+    if (mi->nr_pieces % 8 != 0 && (bitfield->s_data[mi->bitfield_size - 1] & (0xff >> (mi->nr_pieces % 8))) != 0) {
+        err("resume file marks pieces beyond the last one");
+        return 0;
+    }
+    if (inode->i != (long)sb->st_ino || mtime->i != stat_mtime(sb) || size->i != (long)sb->st_size) {
+        log("data file changed since the resume file was saved");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief 同步校验一个分片
+ * @return 一致返回 1, 否则返回 0
+ */
+static int
+verify_piece(const struct MetaInfo *mi, size_t index)
+{
+    size_t length = piece_length(mi, index);
+    uint8_t *buf = malloc(length);
+    uint8_t md[HASH_SIZE];
+    int ok = storage_pread(mi->storage, buf, length, (off_t)(index * mi->piece_size)) == 0;
+    if (ok) {
+        sha1(buf, length, md);
+        ok = memcmp(md, piece_hash(mi, index), HASH_SIZE) == 0;
+    }
+    free(buf);
+    return ok;
+}
+
+ssize_t
+resume_load(struct MetaInfo *mi, const struct stat *sb)
+{
+    char *path = resume_path(mi, "");
+    size_t size;
+    char *data = read_resume_file(path, &size);
+    if (data == NULL) {
+        free(path);
+        return -1;
+    }
+
+    struct BNode *tree = bparser_arena(data, size);
+    if (tree == NULL || tree->type != B_DICT || !is_resume_valid(mi, tree, sb)) {
+        free_bnode(&tree);
+        free(data);
+        free(path);
+        return -1;
+    }
+
+    // 已校验的分片
+    size_t finished = 0;
+    const struct BNode *bitfield = query_bcode_by_path(tree, "bitfield");
+    memcpy(mi->bitfield, bitfield->s_data, mi->bitfield_size);
+    for (size_t i = 0; i < mi->nr_pieces; i++) {
+        if (mi->bitfield[i / 8] & (0x80 >> (i % 8))) {
+            mi->pieces[i].is_downloaded = 1;
+            finished += piece_length(mi, i);
+        }
+    }
+
+    // 下载中的分片
+    const struct BNode *partial = query_bcode_by_path(tree, "partial");
+    size_t nr_partial = 0;
+    for (const struct BNode *iter = partial; iter && iter->l_item; iter = iter->l_next) {
+        const struct BNode *blocks = query_bcode_by_path(iter->l_item, "blocks");
+        const struct BNode *index = query_bcode_by_path(iter->l_item, "index");
+        if (!blocks || !index || index->i < 0 || (size_t)index->i >= mi->nr_pieces
+                || blocks->s_size != piece_sub_count(mi, (size_t)index->i)
+                || mi->pieces[index->i].is_downloaded) {
+            err("ignore malformed partial piece entry");
+            continue;
+        }
+
+        size_t idx = (size_t)index->i;
+        struct PieceInfo *piece = &mi->pieces[idx];
+        size_t nr_finished = 0;
+        for (size_t j = 0; j < blocks->s_size; j++) {
+            if (blocks->s_data[j]) {
+                piece->substate[j] = SUB_FINISH;
+                nr_finished++;
+            }
+        }
+
+        if (nr_finished < blocks->s_size) {
+            for (size_t j = 0; j < blocks->s_size; j++) {
+                if (piece->substate[j] == SUB_FINISH) {
+                    finished += block_length(mi, idx, j);
+                }
+            }
+            nr_partial++;
+        }
+        else if (verify_piece(mi, idx)) {  // 退出时正在校验
+            piece->is_downloaded = 1;
+            set_bit(mi->bitfield, (unsigned)idx);
+            finished += piece_length(mi, idx);
+        }
+        else {
+            memset(piece->substate, SUB_NA, mi->sub_count);
+        }
+    }
+
+    log("resumed from %s: %lu bytes finished, %lu partial pieces", path, finished, nr_partial);
+
+    free_bnode(&tree);
+    free(data);
+    free(path);
+    return (ssize_t)finished;
+}
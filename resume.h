@@ -0,0 +1,44 @@
+/**
+ * @file resume.h
+ * @brief 快速续传文件的 API 声明
+ *
+ * 续传文件 <name>.resume 是一个 B 编码字典，记录：
+ *   1. bitfield: 已校验的分片位图
+ *   2. partial: 下载中的分片的子分片完成情况 [{ "blocks": 每个子分片一个字节, "index": 分片号 }, ...]
+ *   3. file inode / file mtime / file size: 保存时数据文件的标识（多文件时是汇总，见 storage_stat()），mtime 单位纳秒
+ *   4. info hash / piece length: 用于确认属于同一个种子
+ *
+ * 启动时如果数据文件的标识与续传文件一致，就直接采用其中的状态，不再重新校验。
+ */
+
+#ifndef RESUME_H
+#define RESUME_H
+
+#include "metainfo.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/**
+ * @brief 保存续传文件
+ *
+ * 先写临时文件再 rename, 保证续传文件总是完整的。
+ * 校验中的分片按下载中的分片保存，还在内存缓冲区中或者正在写盘的分片不保存。
+ *
+ * @param mi 全局信息，要求数据文件已经打开
+ * @return 成功返回 0, 失败返回 -1
+ */
+int resume_save(struct MetaInfo *mi);
+
+/**
+ * @brief 读取并采用续传文件
+ *
+ * 续传文件不存在、损坏或者与数据文件、种子不符时不修改 mi.
+ * 子分片全部完成但没有校验的分片在这里同步校验。
+ *
+ * @param mi 全局信息，分片信息已经提取
+ * @param sb 数据文件的状态，由 storage_stat() 得到
+ * @return 采用时返回已完成的字节数（包括下载中分片的已完成子分片），否则返回 -1
+ */
+ssize_t resume_load(struct MetaInfo *mi, const struct stat *sb);
+
+#endif  // RESUME_H
@@ -0,0 +1,452 @@
+/**
+ * @file sha1.c
+ * @brief SHA1 摘要计算的 API 实现
+ */
+
+#include "sha1.h"
+#include <string.h>
+#include <pthread.h>
+#include <cpuid.h>
+#include <immintrin.h>
+#include <openssl/sha.h>
+
+/**
+ * @brief 单流压缩函数：按顺序压缩 nr_blocks 个 64 字节的块
+ */
+typedef void (*sha1_compress_t)(uint32_t h[5], const uint8_t *data, size_t nr_blocks);
+
+/**
+ * @brief 多流压缩函数：8 路各压缩 nr_blocks 个块，h[i][j] 是第 j 路的第 i 个链接变量
+ */
+typedef void (*sha1_compress_x8_t)(uint32_t h[5][8], const uint8_t *const data[8], size_t nr_blocks);
+
+static inline uint32_t
+rol32(uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+static inline uint32_t
+load_be32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void
+store_be32(uint8_t *p, uint32_t x)
+{
+    p[0] = (uint8_t)(x >> 24);
+    p[1] = (uint8_t)(x >> 16);
+    p[2] = (uint8_t)(x >> 8);
+    p[3] = (uint8_t)x;
+}
+
+/**
+ * @brief 可移植的 C 实现
+ */
+static void
+compress_generic(uint32_t h[5], const uint8_t *data, size_t nr_blocks)
+{
+    for (; nr_blocks > 0; nr_blocks--, data += 64) {
+        uint32_t w[16];
+        for (int i = 0; i < 16; i++) {
+            w[i] = load_be32(data + i * 4);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int t = 0; t < 80; t++) {
+            if (t >= 16) {
+                w[t & 15] = rol32(w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15], 1);
+            }
+
+            uint32_t f, k;
+            if (t < 20)      { f = d ^ (b & (c ^ d));       k = 0x5a827999; }
+            else if (t < 40) { f = b ^ c ^ d;               k = 0x6ed9eba1; }
+            else if (t < 60) { f = (b & c) | (d & (b | c)); k = 0x8f1bbcdc; }
+            else             { f = b ^ c ^ d;               k = 0xca62c1d6; }
+
+            uint32_t tmp = rol32(a, 5) + f + e + k + w[t & 15];
+            e = d;
+            d = c;
+            c = rol32(b, 30);
+            b = a;
+            a = tmp;
+        }
+
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+}
+
+/**
+ * @brief 借用 OpenSSL 的汇编实现
+ *
+ * 缓冲区为空的 SHA_CTX 在输入整块数据时，SHA1_Update 直接把全部块交给
+ * 内部的块函数，于是只借用它的压缩部分。
+ */
+static void
+compress_openssl(uint32_t h[5], const uint8_t *data, size_t nr_blocks)
+{
+    SHA_CTX c = { .h0 = h[0], .h1 = h[1], .h2 = h[2], .h3 = h[3], .h4 = h[4] };
+    SHA1_Update(&c, data, nr_blocks * 64);
+    h[0] = c.h0; h[1] = c.h1; h[2] = c.h2; h[3] = c.h3; h[4] = c.h4;
+}
+
+/**
+ * @brief 4 轮 SHA-NI 运算，g 是 4 轮一组的组号，f 是轮函数编号
+ *
+ * w[g % 4] 是本组的消息，g >= 4 时由之前的 4 组消息扩展得到。
+ */
+#define SHANI_ROUNDS(g, f) do {                                                          \
+    if ((g) >= 4) {                                                                      \
+        w[(g) % 4] = _mm_sha1msg2_epu32(                                                 \
+            _mm_xor_si128(_mm_sha1msg1_epu32(w[(g) % 4], w[((g) + 1) % 4]), w[((g) + 2) % 4]), \
+            w[((g) + 3) % 4]);                                                           \
+    }                                                                                    \
+    e = (g) == 0 ? _mm_add_epi32(e0, w[0]) : _mm_sha1nexte_epu32(prev, w[(g) % 4]);     \
+    prev = abcd;                                                                         \
+    abcd = _mm_sha1rnds4_epu32(abcd, e, f);                                              \
+} while (0)
+
+/**
+ * @brief Intel SHA 扩展指令实现
+ */
+__attribute__((target("sha,sse4.1")))
+static void
+compress_shani(uint32_t h[5], const uint8_t *data, size_t nr_blocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0x1b);
+    __m128i e0 = _mm_set_epi32((int)h[4], 0, 0, 0);
+
+    for (; nr_blocks > 0; nr_blocks--, data += 64) {
+        __m128i abcd_save = abcd, e0_save = e0;
+        __m128i w[4], e, prev;
+        for (int i = 0; i < 4; i++) {
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + i * 16)), bswap);
+        }
+
+        SHANI_ROUNDS(0, 0);  SHANI_ROUNDS(1, 0);  SHANI_ROUNDS(2, 0);  SHANI_ROUNDS(3, 0);  SHANI_ROUNDS(4, 0);
+        SHANI_ROUNDS(5, 1);  SHANI_ROUNDS(6, 1);  SHANI_ROUNDS(7, 1);  SHANI_ROUNDS(8, 1);  SHANI_ROUNDS(9, 1);
+        SHANI_ROUNDS(10, 2); SHANI_ROUNDS(11, 2); SHANI_ROUNDS(12, 2); SHANI_ROUNDS(13, 2); SHANI_ROUNDS(14, 2);
+        SHANI_ROUNDS(15, 3); SHANI_ROUNDS(16, 3); SHANI_ROUNDS(17, 3); SHANI_ROUNDS(18, 3); SHANI_ROUNDS(19, 3);
+
+        e0 = _mm_sha1nexte_epu32(prev, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i *)h, _mm_shuffle_epi32(abcd, 0x1b));
+    h[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+#undef SHANI_ROUNDS
+
+/**
+ * @brief AVX2 8 路并行实现
+ *
+ * 每个 32 位的通道处理一路消息。每路先各读 32 字节，经 8x8 转置得到
+ * 8 个“同一个字在 8 路中的值”的向量，再按标准算法做 80 轮。
+ */
+__attribute__((target("avx2")))
+static void
+compress_avx2x8(uint32_t h[5][8], const uint8_t *const data[8], size_t nr_blocks)
+{
+    const __m256i bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                          12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+#define ROL(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+
+    __m256i a = _mm256_loadu_si256((const __m256i *)h[0]);
+    __m256i b = _mm256_loadu_si256((const __m256i *)h[1]);
+    __m256i c = _mm256_loadu_si256((const __m256i *)h[2]);
+    __m256i d = _mm256_loadu_si256((const __m256i *)h[3]);
+    __m256i e = _mm256_loadu_si256((const __m256i *)h[4]);
+
+    for (size_t blk = 0; blk < nr_blocks; blk++) {
+        __m256i w[16];
+
+        // 两次 8x8 转置，得到 16 个消息字
+        for (int half = 0; half < 2; half++) {
+            __m256i r[8], t[8], u[8];
+            for (int j = 0; j < 8; j++) {
+                r[j] = _mm256_loadu_si256((const __m256i *)(data[j] + blk * 64 + half * 32));
+            }
+            for (int j = 0; j < 8; j += 2) {
+                t[j] = _mm256_unpacklo_epi32(r[j], r[j + 1]);
+                t[j + 1] = _mm256_unpackhi_epi32(r[j], r[j + 1]);
+            }
+            for (int j = 0; j < 8; j += 4) {
+                u[j] = _mm256_unpacklo_epi64(t[j], t[j + 2]);
+                u[j + 1] = _mm256_unpackhi_epi64(t[j], t[j + 2]);
+                u[j + 2] = _mm256_unpacklo_epi64(t[j + 1], t[j + 3]);
+                u[j + 3] = _mm256_unpackhi_epi64(t[j + 1], t[j + 3]);
+            }
+            __m256i *out = w + half * 8;
+            for (int j = 0; j < 4; j++) {
+                out[j] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[j], u[j + 4], 0x20), bswap);
+                out[j + 4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[j], u[j + 4], 0x31), bswap);
+            }
+        }
+
+        __m256i sa = a, sb = b, sc = c, sd = d, se = e;
+        for (int t = 0; t < 80; t++) {
+            if (t >= 16) {
+                __m256i x = _mm256_xor_si256(_mm256_xor_si256(w[(t - 3) & 15], w[(t - 8) & 15]),
+                                             _mm256_xor_si256(w[(t - 14) & 15], w[t & 15]));
+                w[t & 15] = ROL(x, 1);
+            }
+
+            __m256i f, k;
+            if (t < 20) {
+                f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+                k = _mm256_set1_epi32(0x5a827999);
+            }
+            else if (t < 40) {
+                f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+                k = _mm256_set1_epi32(0x6ed9eba1);
+            }
+            else if (t < 60) {
+                f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+                k = _mm256_set1_epi32((int)0x8f1bbcdc);
+            }
+            else {
+                f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+                k = _mm256_set1_epi32((int)0xca62c1d6);
+            }
+
+            __m256i tmp = _mm256_add_epi32(_mm256_add_epi32(ROL(a, 5), f),
+                                           _mm256_add_epi32(_mm256_add_epi32(e, k), w[t & 15]));
+            e = d;
+            d = c;
+            c = ROL(b, 30);
+            b = a;
+            a = tmp;
+        }
+
+        a = _mm256_add_epi32(a, sa);
+        b = _mm256_add_epi32(b, sb);
+        c = _mm256_add_epi32(c, sc);
+        d = _mm256_add_epi32(d, sd);
+        e = _mm256_add_epi32(e, se);
+    }
+
+    _mm256_storeu_si256((__m256i *)h[0], a);
+    _mm256_storeu_si256((__m256i *)h[1], b);
+    _mm256_storeu_si256((__m256i *)h[2], c);
+    _mm256_storeu_si256((__m256i *)h[3], d);
+    _mm256_storeu_si256((__m256i *)h[4], e);
+#undef ROL
+}
+
+/**
+ * @brief 后端描述
+ */
+struct Backend
+{
+    const char *name;           ///< 后端名
+    int is_multi;               ///< 0 - 单流，1 - 多流
+    void *compress;             ///< sha1_compress_t 或者 sha1_compress_x8_t
+    int (*is_supported)(void);  ///< CPU 是否支持
+};
+
+static int
+always(void)
+{
+    return 1;
+}
+
+static int
+has_shani(void)
+{
+    unsigned a, b, c, d;
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+        return 0;
+    }
+    return (b & bit_SHA) && __builtin_cpu_supports("sse4.1");
+}
+
+static int
+has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+/**
+ * @brief 全部后端，同类中排在前面的优先
+ */
+static const struct Backend backends[] = {
+    { "shani",   0, compress_shani,   has_shani },
+    { "openssl", 0, compress_openssl, always },
+    { "generic", 0, compress_generic, always },
+    { "avx2x8",  1, compress_avx2x8,  has_avx2 },
+    { "none",    1, NULL,             always },
+};
+
+#define NR_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+static const struct Backend *single;   ///< 当前单流后端
+static const struct Backend *multi;    ///< 当前多流后端
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief 按优先级选择受支持的后端
+ *
+ * 即使有 SHA-NI, AVX2 8 路并行的总吞吐量仍然更高（见 bench/sha1bench.c），
+ * 所以多流后端总是独立选择。
+ */
+static void
+select_backends(void)
+{
+    for (size_t i = 0; i < NR_BACKENDS; i++) {
+        const struct Backend **slot = backends[i].is_multi ? &multi : &single;
+        if (*slot == NULL && backends[i].is_supported()) {
+            *slot = &backends[i];
+        }
+    }
+}
+
+static inline sha1_compress_t
+compress(void)
+{
+    pthread_once(&once, select_backends);
+    return (sha1_compress_t)single->compress;
+}
+
+void
+sha1_init(struct Sha1Ctx *ctx)
+{
+    ctx->h[0] = 0x67452301;
+    ctx->h[1] = 0xefcdab89;
+    ctx->h[2] = 0x98badcfe;
+    ctx->h[3] = 0x10325476;
+    ctx->h[4] = 0xc3d2e1f0;
+    ctx->size = 0;
+}
+
+void
+sha1_update(struct Sha1Ctx *ctx, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    size_t used = ctx->size % 64;
+    ctx->size += size;
+
+    if (used > 0) {
+        size_t n = 64 - used < size ? 64 - used : size;
+        memcpy(ctx->block + used, p, n);
+        p += n;
+        size -= n;
+        if (used + n < 64) {
+            return;
+        }
+        compress()(ctx->h, ctx->block, 1);
+    }
+
+    if (size >= 64) {
+        compress()(ctx->h, p, size / 64);
+        p += size / 64 * 64;
+        size %= 64;
+    }
+
+    memcpy(ctx->block, p, size);
+}
+
+void
+sha1_final(struct Sha1Ctx *ctx, uint8_t *md)
+{
+    uint64_t bits = ctx->size * 8;
+    size_t used = ctx->size % 64;
+
+    ctx->block[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->block + used, 0, 64 - used);
+        compress()(ctx->h, ctx->block, 1);
+        used = 0;
+    }
+    memset(ctx->block + used, 0, 56 - used);
+    store_be32(ctx->block + 56, (uint32_t)(bits >> 32));
+    store_be32(ctx->block + 60, (uint32_t)bits);
+    compress()(ctx->h, ctx->block, 1);
+
+    for (int i = 0; i < 5; i++) {
+        store_be32(md + i * 4, ctx->h[i]);
+    }
+}
+
+void
+sha1(const void *data, size_t size, uint8_t *md)
+{
+    struct Sha1Ctx ctx;
+    sha1_init(&ctx);
+    sha1_update(&ctx, data, size);
+    sha1_final(&ctx, md);
+}
+
+void
+sha1_multi(const uint8_t *const data[], size_t size, uint8_t *const md[], int n)
+{
+    pthread_once(&once, select_backends);
+
+    size_t nr_blocks = size / 64;
+    if (multi->compress == NULL || n < 2 || nr_blocks == 0) {
+        for (int i = 0; i < n; i++) {
+            sha1(data[i], size, md[i]);
+        }
+        return;
+    }
+
+    // 整块部分 8 路一起压缩，空闲的通道重复第一路的数据
+    const uint8_t *lanes[8];
+    uint32_t h[5][8];
+    struct Sha1Ctx ctx;
+    sha1_init(&ctx);
+    for (int j = 0; j < 8; j++) {
+        lanes[j] = data[j < n ? j : 0];
+        for (int i = 0; i < 5; i++) {
+            h[i][j] = ctx.h[i];
+        }
+    }
+    ((sha1_compress_x8_t)multi->compress)(h, lanes, nr_blocks);
+
+    // 剩余部分和填充逐路完成
+    for (int j = 0; j < n; j++) {
+        for (int i = 0; i < 5; i++) {
+            ctx.h[i] = h[i][j];
+        }
+        ctx.size = nr_blocks * 64;
+        sha1_update(&ctx, data[j] + ctx.size, size - ctx.size);
+        sha1_final(&ctx, md[j]);
+    }
+}
+
+int
+sha1_lanes(void)
+{
+    pthread_once(&once, select_backends);
+    return multi->compress ? 8 : 1;
+}
+
+int
+sha1_use(const char *name)
+{
+    pthread_once(&once, select_backends);
+    for (size_t i = 0; i < NR_BACKENDS; i++) {
+        if (!strcmp(backends[i].name, name)) {
+            if (!backends[i].is_supported()) {
+                return -1;
+            }
+            if (backends[i].is_multi) {
+                multi = &backends[i];
+            }
+            else {
+                single = &backends[i];
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *
+sha1_backend(int is_multi)
+{
+    pthread_once(&once, select_backends);
+    return is_multi ? multi->name : single->name;
+}
@@ -0,0 +1,99 @@
+/**
+ * @file sha1.h
+ * @brief SHA1 摘要计算的 API 声明
+ *
+ * 压缩函数有多个后端，首次使用时根据 CPUID 选择：
+ *   1. 单流：shani（SHA 扩展指令） > openssl（借用 OpenSSL 的块函数） > generic（可移植 C）
+ *   2. 多流：avx2x8（8 路并行，每路一个独立的消息），CPU 不支持时退化为逐个单流计算
+ *
+ * 所有接口都是线程安全的。
+ */
+
+#ifndef SHA1_H
+#define SHA1_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/**
+ * @brief SHA1 摘要的字节数
+ */
+#define SHA1_DIGEST_SIZE 20
+
+/**
+ * @brief sha1_multi() 一次最多计算的消息数
+ */
+#define SHA1_MAX_LANES 8
+
+/**
+ * @brief 增量计算的上下文
+ */
+struct Sha1Ctx
+{
+    uint32_t h[5];         ///< 链接变量
+    uint64_t size;         ///< 已输入的字节数
+    uint8_t block[64];     ///< 不足一个块的剩余输入，共 size % 64 字节
+};
+
+/** @brief 初始化上下文 */
+void sha1_init(struct Sha1Ctx *ctx);
+
+/**
+ * @brief 输入数据
+ * @param ctx 上下文
+ * @param data 数据
+ * @param size 字节数
+ */
+void sha1_update(struct Sha1Ctx *ctx, const void *data, size_t size);
+
+/**
+ * @brief 结束计算并输出摘要，之后上下文需要重新初始化才能使用
+ * @param ctx 上下文
+ * @param md [OUT] SHA1_DIGEST_SIZE 字节的摘要
+ */
+void sha1_final(struct Sha1Ctx *ctx, uint8_t *md);
+
+/**
+ * @brief 一次性计算摘要
+ * @param data 数据
+ * @param size 字节数
+ * @param md [OUT] SHA1_DIGEST_SIZE 字节的摘要
+ */
+void sha1(const void *data, size_t size, uint8_t *md);
+
+/**
+ * @brief 同时计算多个等长消息的摘要
+ *
+ * 有多流后端时 n 个消息的整块部分一起压缩，剩余部分和填充逐个完成。
+ *
+ * @param data 消息数组
+ * @param size 每个消息的字节数
+ * @param md [OUT] 摘要输出位置数组
+ * @param n 消息数，不超过 SHA1_MAX_LANES
+ */
+void sha1_multi(const uint8_t *const data[], size_t size, uint8_t *const md[], int n);
+
+/**
+ * @brief 多流后端一次并行的消息数
+ * @return 没有多流后端时返回 1
+ */
+int sha1_lanes(void);
+
+/**
+ * @brief 强制使用某个后端，主要用于基准测试
+ *
+ * 单流后端：generic, openssl, shani; 多流后端：avx2x8, none.
+ *
+ * @param name 后端名
+ * @return 成功返回 0, 不认识或者 CPU 不支持返回 -1
+ */
+int sha1_use(const char *name);
+
+/**
+ * @brief 获取当前使用的后端名
+ * @param is_multi 0 - 单流后端，1 - 多流后端
+ * @return 后端名
+ */
+const char *sha1_backend(int is_multi);
+
+#endif  // SHA1_H
@@ -0,0 +1,465 @@
+/**
+ * @file storage.c
+ * @brief 数据文件存储层的 API 实现
+ */
+
+#define _GNU_SOURCE       // splice()
+#include "storage.h"
+#include "util.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+struct Storage *
+storage_new(int max_open)
+{
+    if (max_open <= 0) {
+        struct rlimit rl;
+        max_open = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+            ? (int)(rl.rlim_cur / 2) : 512;
+        if (max_open < 1) max_open = 1;
+    }
+
+    struct Storage *st = calloc(1, sizeof(*st));
+    pthread_mutex_init(&st->lock, NULL);
+    st->flags = O_RDONLY;
+    st->max_open = max_open;
+    st->lru_head = st->lru_tail = -1;
+    return st;
+}
+
+void
+storage_add_file(struct Storage *st, const char *path, size_t length)
+{
+    st->files = realloc(st->files, (st->nr_files + 1) * sizeof(*st->files));
+    st->files[st->nr_files] = (struct StorageFile) {
+        .path = strdup(path),
+        .offset = (off_t)st->size,
+        .length = length,
+        .fd = -1,
+        .lru_prev = -1,
+        .lru_next = -1,
+    };
+    st->nr_files++;
+    st->size += length;
+}
+
+/**
+ * @brief 把打开的文件从 LRU 链表中摘下，调用者持有锁
+ */
+static void
+lru_unlink(struct Storage *st, int i)
+{
+    struct StorageFile *f = &st->files[i];
+    if (f->lru_prev != -1) st->files[f->lru_prev].lru_next = f->lru_next;
+    else st->lru_head = f->lru_next;
+    if (f->lru_next != -1) st->files[f->lru_next].lru_prev = f->lru_prev;
+    else st->lru_tail = f->lru_prev;
+    f->lru_prev = f->lru_next = -1;
+}
+
+/**
+ * @brief 把打开的文件放到 LRU 链表头，调用者持有锁
+ */
+static void
+lru_push(struct Storage *st, int i)
+{
+    struct StorageFile *f = &st->files[i];
+    f->lru_prev = -1;
+    f->lru_next = st->lru_head;
+    if (st->lru_head != -1) st->files[st->lru_head].lru_prev = i;
+    else st->lru_tail = i;
+    st->lru_head = i;
+}
+
+/**
+ * @brief 关闭一个没有被钉住的打开文件，调用者持有锁
+ */
+static void
+close_file(struct Storage *st, int i)
+{
+    lru_unlink(st, i);
+    close(st->files[i].fd);
+    st->files[i].fd = -1;
+    st->nr_open--;
+}
+
+/**
+ * @brief 创建文件路径中缺少的目录
+ * @return 成功返回 0, 失败返回 -1
+ */
+static int
+make_parents(const char *path)
+{
+    char *dir = strdup(path);
+    for (char *p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+            perror(dir);
+            free(dir);
+            return -1;
+        }
+        *p = '/';
+    }
+    free(dir);
+    return 0;
+}
+
+int
+storage_open(struct Storage *st, int flags)
+{
+    pthread_mutex_lock(&st->lock);
+    for (int i = st->lru_tail; i != -1; ) {
+        int prev = st->files[i].lru_prev;
+        if (st->files[i].pins == 0) {
+            close_file(st, i);
+        }
+        i = prev;
+    }
+    st->flags = flags;
+    pthread_mutex_unlock(&st->lock);
+
+    if ((flags & O_ACCMODE) == O_RDONLY) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < st->nr_files; i++) {
+        const char *path = st->files[i].path;
+        if (make_parents(path) == -1) {
+            return -1;
+        }
+        int fd = open(path, O_WRONLY | O_CREAT, 0644);
+        if (fd == -1) {
+            perror(path);
+            return -1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+int
+storage_stat(struct Storage *st, struct stat *sb)
+{
+    int found = 0;
+    memset(sb, 0, sizeof(*sb));
+    for (size_t i = 0; i < st->nr_files; i++) {
+        struct stat fsb;
+        if (stat(st->files[i].path, &fsb) == -1) {
+            continue;
+        }
+        if (!found) {
+            *sb = fsb;
+            found = 1;
+            continue;
+        }
+        sb->st_ino ^= fsb.st_ino;
+        sb->st_size += fsb.st_size;
+        if (fsb.st_mtim.tv_sec > sb->st_mtim.tv_sec
+                || (fsb.st_mtim.tv_sec == sb->st_mtim.tv_sec && fsb.st_mtim.tv_nsec > sb->st_mtim.tv_nsec)) {
+            sb->st_mtim = fsb.st_mtim;
+        }
+    }
+    return found ? 0 : -1;
+}
+
+size_t
+storage_find(const struct Storage *st, off_t offset)
+{
+    // 找最后一个起点不超过 offset 的文件
+    size_t lo = 0, hi = st->nr_files;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (st->files[mid].offset <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    // 长度为 0 的文件与后一个文件起点相同，上面的查找会越过它们，
+    // 只有末尾的长度为 0 的文件需要跳过
+    size_t i = lo - 1;
+    while (i > 0 && st->files[i].length == 0) {
+        i--;
+    }
+    return i;
+}
+
+int
+storage_acquire(struct Storage *st, size_t index)
+{
+    struct StorageFile *f = &st->files[index];
+    int i = (int)index;
+
+    pthread_mutex_lock(&st->lock);
+    if (f->fd != -1) {
+        lru_unlink(st, i);
+    }
+    else {
+        // 先腾出位置，被钉住的文件跳过
+        for (int j = st->lru_tail; j != -1 && st->nr_open >= st->max_open; ) {
+            int prev = st->files[j].lru_prev;
+            if (st->files[j].pins == 0) {
+                close_file(st, j);
+            }
+            j = prev;
+        }
+        f->fd = open(f->path, st->flags);
+        if (f->fd == -1) {
+            if (errno != ENOENT || (st->flags & O_ACCMODE) != O_RDONLY) {
+                perror(f->path);
+            }
+            pthread_mutex_unlock(&st->lock);
+            return -1;
+        }
+        st->nr_open++;
+    }
+    lru_push(st, i);
+    f->pins++;
+    int fd = f->fd;
+    pthread_mutex_unlock(&st->lock);
+    return fd;
+}
+
+void
+storage_release(struct Storage *st, size_t index)
+{
+    pthread_mutex_lock(&st->lock);
+    st->files[index].pins--;
+    pthread_mutex_unlock(&st->lock);
+}
+
+/**
+ * @brief 截取 iov 中 [skip, skip + length) 的部分
+ * @param iov 原 iov
+ * @param iovcnt 原 iov 项数
+ * @param skip 跳过的字节数
+ * @param length 截取的字节数
+ * @param out [OUT] 截取结果，至少 iovcnt 项
+ * @return 截取结果的项数
+ */
+static int
+slice_iov(const struct iovec *iov, int iovcnt, size_t skip, size_t length, struct iovec *out)
+{
+    int n = 0;
+    for (int i = 0; i < iovcnt && length > 0; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        size_t len = iov[i].iov_len - skip;
+        if (len > length) len = length;
+        out[n].iov_base = (uint8_t *)iov[i].iov_base + skip;
+        out[n].iov_len = len;
+        n++;
+        length -= len;
+        skip = 0;
+    }
+    return n;
+}
+
+/**
+ * @brief 在一个文件内读满或者写完 iov, 处理读写不足
+ * @return 成功返回 0, 失败返回 -1
+ */
+static int
+transfer_file(int fd, struct iovec *iov, int iovcnt, off_t offset, int is_write)
+{
+    while (iovcnt > 0) {
+        ssize_t n = is_write ? pwritev(fd, iov, iovcnt, offset) : preadv(fd, iov, iovcnt, offset);
+        if (n <= 0) {
+            if (n < 0) perror(is_write ? "pwritev" : "preadv");
+            return -1;
+        }
+        offset += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 按文件拆分线性空间上的读写
+ * @return 成功返回 0, 失败返回 -1
+ */
+static int
+storage_transfer(struct Storage *st, const struct iovec *iov, int iovcnt, off_t offset, int is_write)
+{
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    if ((size_t)offset + total > st->size) {
+        err("%s beyond the end of storage", is_write ? "write" : "read");
+        return -1;
+    }
+
+    struct iovec *part = malloc((size_t)iovcnt * sizeof(*part));
+    size_t done = 0;
+    size_t index = total > 0 ? storage_find(st, offset) : 0;
+    int ret = 0;
+    while (done < total) {
+        const struct StorageFile *f = &st->files[index];
+        off_t pos = offset + (off_t)done - f->offset;
+        size_t len = f->length - (size_t)pos;
+        if (len > total - done) {
+            len = total - done;
+        }
+
+        if (len > 0) {
+            int fd = storage_acquire(st, index);
+            int n = slice_iov(iov, iovcnt, done, len, part);
+            if (fd == -1 || transfer_file(fd, part, n, pos, is_write) == -1) {
+                ret = -1;
+            }
+            if (fd != -1) {
+                storage_release(st, index);
+            }
+            if (ret == -1) {
+                break;
+            }
+        }
+        done += len;
+        index++;
+    }
+    free(part);
+    return ret;
+}
+
+int
+storage_preadv(struct Storage *st, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    return storage_transfer(st, iov, iovcnt, offset, 0);
+}
+
+int
+storage_pwritev(struct Storage *st, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    return storage_transfer(st, iov, iovcnt, offset, 1);
+}
+
+/**
+ * @brief 在一个文件内把 length 字节移到管道 pipe_fd
+ *
+ * 文件所在的文件系统不支持 splice() 时退回 pread() + write().
+ *
+ * @return 成功返回 0, 失败返回 -1
+ */
+static int
+splice_file(int pipe_fd, int fd, off_t pos, size_t length)
+{
+    int use_copy = 0;
+    uint8_t buf[0x4000];
+    while (length > 0) {
+        ssize_t n;
+        if (!use_copy) {
+            n = splice(fd, &pos, pipe_fd, NULL, length, SPLICE_F_MOVE);
+            if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                use_copy = 1;
+                continue;
+            }
+        }
+        else {
+            n = pread(fd, buf, length < sizeof(buf) ? length : sizeof(buf), pos);
+            if (n > 0 && write(pipe_fd, buf, (size_t)n) != n) {
+                n = -1;
+            }
+            if (n > 0) {
+                pos += n;
+            }
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n < 0) perror("splice");
+            return -1;
+        }
+        length -= (size_t)n;
+    }
+    return 0;
+}
+
+int
+storage_splice(struct Storage *st, int pipe_fd, off_t offset, size_t length)
+{
+    if ((size_t)offset + length > st->size) {
+        err("splice beyond the end of storage");
+        return -1;
+    }
+
+    size_t done = 0;
+    size_t index = length > 0 ? storage_find(st, offset) : 0;
+    while (done < length) {
+        const struct StorageFile *f = &st->files[index];
+        off_t pos = offset + (off_t)done - f->offset;
+        size_t len = f->length - (size_t)pos;
+        if (len > length - done) {
+            len = length - done;
+        }
+
+        if (len > 0) {
+            int fd = storage_acquire(st, index);
+            if (fd == -1) {
+                return -1;
+            }
+            int ret = splice_file(pipe_fd, fd, pos, len);
+            storage_release(st, index);
+            if (ret == -1) {
+                return -1;
+            }
+        }
+        done += len;
+        index++;
+    }
+    return 0;
+}
+
+void
+storage_fadvise(struct Storage *st, off_t offset, size_t length, int advice)
+{
+    if (st->nr_files == 0 || (size_t)offset >= st->size) {
+        return;
+    }
+    if (length == 0 || (size_t)offset + length > st->size) {
+        length = st->size - (size_t)offset;
+    }
+
+    off_t end = offset + (off_t)length;
+    for (size_t i = storage_find(st, offset); i < st->nr_files && st->files[i].offset < end; i++) {
+        const struct StorageFile *f = &st->files[i];
+        if (f->length == 0) {
+            continue;
+        }
+        off_t from = offset > f->offset ? offset - f->offset : 0;
+        off_t to = end - f->offset < (off_t)f->length ? end - f->offset : (off_t)f->length;
+        int fd = storage_acquire(st, i);
+        if (fd != -1) {
+            posix_fadvise(fd, from, to - from, advice);
+            storage_release(st, i);
+        }
+    }
+}
+
+void
+storage_free(struct Storage **pst)
+{
+    struct Storage *st = *pst;
+    *pst = NULL;
+
+    for (size_t i = 0; i < st->nr_files; i++) {
+        if (st->files[i].fd != -1) {
+            close(st->files[i].fd);
+        }
+        free(st->files[i].path);
+    }
+    free(st->files);
+    pthread_mutex_destroy(&st->lock);
+    free(st);
+}
@@ -0,0 +1,177 @@
+/**
+ * @file storage.h
+ * @brief 数据文件存储层的 API 声明
+ *
+ * 种子的全部文件按顺序首尾相接，组成与分片对应的线性空间。
+ * 文件表按线性偏移升序排列，用二分查找定位偏移所在的文件；
+ * 跨越文件边界的读写拆成每个文件一次 preadv/pwritev.
+ *
+ * 文件描述符按需打开，打开的个数超过上限时关闭最久没有使用的，
+ * 这样有几万个文件的种子也不会用尽描述符。磁盘线程池的工作线程
+ * 也会调用这里的读写函数，所以描述符和 LRU 链表由互斥锁保护，
+ * 正在读写的描述符被钉住，不会被关闭。
+ */
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/**
+ * @brief 种子中的一个文件
+ */
+struct StorageFile
+{
+    char *path;          ///< 相对于当前目录的路径
+    off_t offset;        ///< 在线性空间中的起点
+    size_t length;       ///< 文件长度
+    int fd;              ///< 打开的描述符，-1 表示没有打开
+    int pins;            ///< 正在使用描述符的次数，大于 0 时不会被关闭
+    int lru_prev;        ///< LRU 链表中更近使用的文件，-1 表示没有
+    int lru_next;        ///< LRU 链表中更久没有使用的文件，-1 表示没有
+};
+
+/**
+ * @brief 存储层
+ */
+struct Storage
+{
+    pthread_mutex_t lock;       ///< 保护描述符、钉住次数和 LRU 链表
+    size_t nr_files;            ///< 文件数
+    struct StorageFile *files;  ///< 文件表，按 offset 升序
+    size_t size;                ///< 全部文件的总长度
+    int flags;                  ///< 打开文件的方式：O_RDONLY 或者 O_RDWR
+    int max_open;               ///< 同时打开的描述符上限（被钉住的描述符可能超出）
+    int nr_open;                ///< 已经打开的描述符数
+    int lru_head;               ///< 最近使用的打开文件，-1 表示没有
+    int lru_tail;               ///< 最久没有使用的打开文件，-1 表示没有
+};
+
+/**
+ * @brief 创建空的存储层，文件以只读方式打开
+ * @param max_open 同时打开的描述符上限，0 表示按 RLIMIT_NOFILE 的一半
+ * @return 动态分配的存储层
+ */
+struct Storage *storage_new(int max_open);
+
+/**
+ * @brief 在线性空间的末尾追加一个文件
+ * @param st 存储层
+ * @param path 文件路径，会被复制
+ * @param length 文件长度
+ */
+void storage_add_file(struct Storage *st, const char *path, size_t length);
+
+/**
+ * @brief 改变打开文件的方式
+ *
+ * 关闭全部没有被钉住的描述符，之后按新的方式打开。
+ * 可写时创建缺少的目录和文件（包括长度为 0 的文件）。
+ *
+ * @param st 存储层
+ * @param flags O_RDONLY 或者 O_RDWR
+ * @return 成功返回 0, 创建失败返回 -1
+ */
+int storage_open(struct Storage *st, int flags);
+
+/**
+ * @brief 汇总全部文件的状态，用于判断数据文件是否在程序之外被改动
+ *
+ * st_size 是已有文件大小之和，st_mtim 取最晚的修改时间，
+ * st_ino 是全部 inode 号的异或；只有一个文件时与 stat() 的结果一致。
+ *
+ * @param st 存储层
+ * @param sb [OUT] 汇总的状态
+ * @return 至少有一个文件存在时返回 0, 否则返回 -1
+ */
+int storage_stat(struct Storage *st, struct stat *sb);
+
+/**
+ * @brief 查找线性偏移所在的文件
+ * @param st 存储层
+ * @param offset 线性偏移，要求小于 size
+ * @return 文件下标，长度为 0 的文件不会被返回
+ */
+size_t storage_find(const struct Storage *st, off_t offset);
+
+/**
+ * @brief 获取文件的描述符并钉住，没有打开时先打开
+ * @param st 存储层
+ * @param index 文件下标
+ * @return 描述符，打开失败返回 -1
+ */
+int storage_acquire(struct Storage *st, size_t index);
+
+/**
+ * @brief 解除 storage_acquire() 的钉住
+ * @param st 存储层
+ * @param index 文件下标
+ */
+void storage_release(struct Storage *st, size_t index);
+
+/**
+ * @brief 从线性偏移处读满 iov
+ * @return 成功返回 0, 出错或者遇到文件末尾返回 -1
+ */
+int storage_preadv(struct Storage *st, const struct iovec *iov, int iovcnt, off_t offset);
+
+/**
+ * @brief 从线性偏移处写出全部 iov
+ * @return 成功返回 0, 出错返回 -1
+ */
+int storage_pwritev(struct Storage *st, const struct iovec *iov, int iovcnt, off_t offset);
+
+/**
+ * @brief 读满一块连续的缓冲区
+ */
+static inline int
+storage_pread(struct Storage *st, void *buf, size_t length, off_t offset)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = length };
+    return storage_preadv(st, &iov, 1, offset);
+}
+
+/**
+ * @brief 写出一块连续的缓冲区
+ */
+static inline int
+storage_pwrite(struct Storage *st, const void *buf, size_t length, off_t offset)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = length };
+    return storage_pwritev(st, &iov, 1, offset);
+}
+
+/**
+ * @brief 把线性空间的一段从文件移到管道，数据不经过用户空间
+ *
+ * 管道的容量必须放得下 length 字节，否则写满后会一直阻塞。
+ *
+ * @param st 存储层
+ * @param pipe_fd 管道的写端
+ * @param offset 线性偏移
+ * @param length 字节数
+ * @return 成功返回 0, 出错返回 -1
+ */
+int storage_splice(struct Storage *st, int pipe_fd, off_t offset, size_t length);
+
+/**
+ * @brief 对线性空间的一段给出访问提示，涉及的每个文件各提示一次
+ * @param st 存储层
+ * @param offset 线性偏移
+ * @param length 字节数，0 表示到末尾
+ * @param advice POSIX_FADV_*
+ */
+void storage_fadvise(struct Storage *st, off_t offset, size_t length, int advice);
+
+/**
+ * @brief 关闭全部描述符并释放存储层
+ * @param pst 指向存储层，会改写成 NULL
+ */
+void storage_free(struct Storage **pst);
+
+#endif  // STORAGE_H